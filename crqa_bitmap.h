@@ -0,0 +1,74 @@
+#ifndef CRQA_BITMAP_H
+#define CRQA_BITMAP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Bit-packed recurrence plot.
+//
+// All rows live in one contiguous allocation. Every row starts on a 64-bit
+// word boundary and occupies stride() words; bit (j % 64) of word (j / 64)
+// holds cell (i, j). Padding bits past cols() are always zero, so word-wise
+// operations (popcount, AND, shifts) never see garbage.
+// -----------------------------------------------------------------------------
+
+static inline int popcount64(uint64_t w)
+{
+    return __builtin_popcountll(w);
+}
+
+class RecurrenceBitmap
+{
+public:
+    static const int WORD_BITS = 64;
+
+    RecurrenceBitmap() : n_rows(0), n_cols(0), n_stride(0) {}
+    RecurrenceBitmap(int rows, int cols) { resize(rows, cols); }
+
+    // Reshape and clear. Storage is only reallocated when it has to grow.
+    void resize(int rows, int cols)
+    {
+        n_rows = rows;
+        n_cols = cols;
+        n_stride = words_for(cols);
+        words.assign((size_t)n_rows * n_stride, 0);
+    }
+
+    static int words_for(int bits) { return (bits + WORD_BITS - 1) / WORD_BITS; }
+
+    int rows() const { return n_rows; }
+    int cols() const { return n_cols; }
+    int stride() const { return n_stride; }
+
+    uint64_t *row(int i) { return &words[(size_t)i * n_stride]; }
+    const uint64_t *row(int i) const { return &words[(size_t)i * n_stride]; }
+
+    bool test(int i, int j) const
+    {
+        return (row(i)[j / WORD_BITS] >> (j % WORD_BITS)) & 1;
+    }
+
+    void set(int i, int j)
+    {
+        row(i)[j / WORD_BITS] |= 1ULL << (j % WORD_BITS);
+    }
+
+    // Number of recurrent points (set bits) in the whole plot.
+    uint64_t count() const
+    {
+        uint64_t total = 0;
+        for (size_t w = 0; w < words.size(); w++)
+            total += popcount64(words[w]);
+        return total;
+    }
+
+private:
+    int n_rows;
+    int n_cols;
+    int n_stride;
+    std::vector<uint64_t> words;
+};
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef CRQA_DISPATCH_H
+#define CRQA_DISPATCH_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include "crqa_thread_pool.h"
+#include "crqa_tiled.h"
+#include "crqa_workspace.h"
+
+// -----------------------------------------------------------------------------
+// Request dispatch between the server's socket I/O thread, a pool of compute
+// workers and the SystemC side that sends completions back.
+//
+// Requests live in a fixed array of slots owned by the caller; only indices
+// move between threads, through three lock-free queues:
+//   free -> (I/O thread fills the slot) -> jobs -> (worker computes) -> done
+// and the consumer of done hands the slot back to free. A slot may be split
+// into several jobs (one per window of a batch); jobs carries job indices
+// whose meaning is up to the caller, and the worker that finishes a slot's
+// last job moves it to done. Nothing is allocated per request, and a full
+// slot array throttles the I/O thread.
+// -----------------------------------------------------------------------------
+
+// Bounded multi-producer multi-consumer ring of slot indices (Vyukov).
+class CrqaIndexRing
+{
+public:
+    explicit CrqaIndexRing(size_t min_capacity)
+    {
+        size_t cap = 2;
+        while (cap < min_capacity) cap <<= 1;
+        cells.reset(new Cell[cap]);
+        mask = cap - 1;
+        for (size_t i = 0; i < cap; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+    }
+
+    bool push(uint32_t v)
+    {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        Cell *c;
+        for (;;) {
+            c = &cells[pos & mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        c->value = v;
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(uint32_t &v)
+    {
+        size_t pos = head.load(std::memory_order_relaxed);
+        Cell *c;
+        for (;;) {
+            c = &cells[pos & mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        v = c->value;
+        c->seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        uint32_t value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+// Ring plus a counting semaphore, for consumers that sleep when it is empty.
+class CrqaSlotQueue
+{
+public:
+    explicit CrqaSlotQueue(size_t capacity) : ring(capacity) { sem_init(&items, 0, 0); }
+    ~CrqaSlotQueue() { sem_destroy(&items); }
+
+    CrqaSlotQueue(const CrqaSlotQueue &) = delete;
+    CrqaSlotQueue &operator=(const CrqaSlotQueue &) = delete;
+
+    // Callers size the queue for everything that can be in flight, so a
+    // push only ever waits for a concurrent pop to finish publishing.
+    void push(uint32_t slot)
+    {
+        while (!ring.push(slot))
+            sched_yield();
+        sem_post(&items);
+    }
+
+    // Block until a slot is available. Returns false once wake_all() ran
+    // and the queue is drained.
+    bool pop_wait(uint32_t &slot)
+    {
+        while (sem_wait(&items) < 0 && errno == EINTR)
+            ;
+        // A counted entry can still be mid-publication by its producer.
+        while (!ring.pop(slot)) {
+            if (closed.load(std::memory_order_acquire))
+                return false;
+            sched_yield();
+        }
+        return true;
+    }
+
+    bool try_pop(uint32_t &slot)
+    {
+        if (sem_trywait(&items) < 0)
+            return false;
+        while (!ring.pop(slot))
+            sched_yield();
+        return true;
+    }
+
+    // Release up to 'waiters' blocked consumers; pop_wait() then fails once empty.
+    void wake_all(int waiters)
+    {
+        closed.store(true, std::memory_order_release);
+        for (int i = 0; i < waiters; i++)
+            sem_post(&items);
+    }
+
+private:
+    CrqaIndexRing ring;
+    sem_t items;
+    std::atomic<bool> closed{false};
+};
+
+// Parse a CPU list such as "2,4-7". Returns an empty list on any error.
+static inline std::vector<int> crqa_parse_cpu_list(const char *s)
+{
+    std::vector<int> cpus;
+    if (!s) return cpus;
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10);
+        if (end == s || lo < 0) return std::vector<int>();
+        long hi = lo;
+        s = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            if (end == s + 1 || hi < lo) return std::vector<int>();
+            s = end;
+        }
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++)
+            cpus.push_back((int)c);
+        if (*s == ',') s++;
+        else if (*s) return std::vector<int>();
+    }
+    return cpus;
+}
+
+static inline bool crqa_pin_thread(std::thread &t, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(t.native_handle(), sizeof(set), &set) == 0;
+}
+
+// Compute workers. Each worker owns a CrqaWorkspace (and a tiled engine over
+// the shared pool for long windows), pops jobs and runs compute on them.
+// When compute reports that a job finished its slot, the slot is pushed to
+// done and on_done is called so the consumer can be woken from another thread.
+class CrqaDispatcher
+{
+public:
+    // Returns true and sets 'slot' when this job was the slot's last one.
+    typedef std::function<bool(uint32_t job, CrqaWorkspace &ws, uint32_t &slot)> ComputeFn;
+    typedef std::function<void()> DoneFn;
+
+    CrqaSlotQueue free_slots;
+    CrqaSlotQueue jobs;
+    CrqaSlotQueue done;
+
+    // cpus: worker k is pinned to cpus[k % cpus.size()]; empty means no pinning.
+    // max_jobs bounds the jobs in flight over all slots.
+    CrqaDispatcher(uint32_t slots, uint32_t max_jobs, int workers, const std::vector<int> &cpus,
+                   bool huge_pages, CrqaThreadPool *tiled_pool,
+                   ComputeFn compute, DoneFn on_done)
+        : free_slots(slots), jobs(max_jobs), done(slots),
+          compute_fn(compute), done_fn(on_done)
+    {
+        for (uint32_t i = 0; i < slots; i++)
+            free_slots.push(i);
+
+        int n = workers > 0 ? workers : 1;
+        for (int k = 0; k < n; k++) {
+            Worker *w = new Worker(huge_pages, tiled_pool);
+            pool.emplace_back(w);
+            w->thread = std::thread(&CrqaDispatcher::worker_loop, this, w);
+            if (!cpus.empty())
+                w->pinned_cpu = crqa_pin_thread(w->thread, cpus[k % cpus.size()]) ?
+                                cpus[k % cpus.size()] : -1;
+        }
+    }
+
+    ~CrqaDispatcher()
+    {
+        jobs.wake_all((int)pool.size());
+        for (std::unique_ptr<Worker> &w : pool)
+            w->thread.join();
+    }
+
+    CrqaDispatcher(const CrqaDispatcher &) = delete;
+    CrqaDispatcher &operator=(const CrqaDispatcher &) = delete;
+
+    int workers() const { return (int)pool.size(); }
+
+    // CPU worker k is pinned to, or -1.
+    int worker_cpu(int k) const { return pool[k]->pinned_cpu; }
+
+private:
+    struct Worker {
+        CrqaWorkspace ws;
+        CrqaTiledEngine tiled;
+        std::thread thread;
+        int pinned_cpu;
+
+        Worker(bool huge_pages, CrqaThreadPool *tiled_pool)
+            : ws(huge_pages), tiled(tiled_pool), pinned_cpu(-1)
+        {
+            ws.tiled = &tiled;
+        }
+    };
+
+    std::vector<std::unique_ptr<Worker>> pool;
+    ComputeFn compute_fn;
+    DoneFn done_fn;
+
+    void worker_loop(Worker *w)
+    {
+        uint32_t job, slot;
+        while (jobs.pop_wait(job)) {
+            if (!compute_fn(job, w->ws, slot))
+                continue;
+            done.push(slot);
+            done_fn();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef CRQA_KERNEL_H
+#define CRQA_KERNEL_H
+
+#include <cmath>
+#include "crqa_bitmap.h"
+#include "crqa_stream.h"
+#include "crqa_simd.h"
+#include "crqa_workspace.h"
+
+// -----------------------------------------------------------------------------
+// CRQA kernels, specialised at compile time for (m, tau, N).
+//
+// CrqaKernel<M, TAU, N> has fully unrolled embedding loops over buffers taken
+// from the caller's CrqaWorkspace. crqa_compute() picks the instantiation
+// matching a request from crqa_kernel_table and falls back to a generic
+// runtime-sized kernel for any other configuration, so m/tau can change per
+// request without a rebuild.
+// -----------------------------------------------------------------------------
+
+struct CrqaParams {
+    int m;          // embedding dimension
+    int tau;        // embedding delay (samples)
+    int n;          // samples per signal
+    int min_diag;   // shortest diagonal line counted
+    int min_vert;   // shortest vertical line counted
+};
+
+static const CrqaParams CRQA_DEFAULT_PARAMS = { 3, 5, 512, 2, 2 };
+
+// Largest embedding dimension any kernel accepts.
+static const int CRQA_MAX_M = 16;
+
+// Plots at least this long are swept by the workspace's tiled engine, if any.
+static const int CRQA_TILED_MIN_LEN = 4096;
+
+static inline int crqa_embedded_len(const CrqaParams &p)
+{
+    return p.n - (p.m - 1) * p.tau;
+}
+
+static inline bool crqa_params_valid(const CrqaParams &p)
+{
+    return p.m >= 1 && p.m <= CRQA_MAX_M && p.tau >= 1 &&
+           p.min_diag >= 1 && p.min_vert >= 1 && crqa_embedded_len(p) > 0;
+}
+
+// mean and population standard deviation, std forced to 1 for flat signals
+static inline void crqa_signal_stats(const double *sig, int n, double &mean, double &std)
+{
+    mean = 0;
+    for (int i = 0; i < n; i++)
+        mean += sig[i];
+    mean /= n;
+
+    std = 0;
+    for (int i = 0; i < n; i++) {
+        double d = sig[i] - mean;
+        std += d * d;
+    }
+    std = std::sqrt(std / n);
+    if (std < 1e-12) std = 1;
+}
+
+// Turn the line statistics of a len x len plot into the 8 QEMU results.
+static inline void crqa_finish_metrics(const CrqaLineStats &st, int len, double results[8])
+{
+    double rec = (double)st.rec;
+    double RR = rec / ((double)len * len);
+
+    int d_max = st.diag.max();
+    double DET = rec > 0 ? (double)st.diag.points() / rec : 0;
+    double LAM = rec > 0 ? (double)st.vert.points() / rec : 0;
+    double DIV = d_max > 0 ? 1.0 / d_max : 0;
+
+    // Output in QEMU order
+    results[0] = DET;                  // epsilon
+    results[1] = RR;                   // recurrence rate
+    results[2] = DET;                  // determinism
+    results[3] = st.vert.mean();       // L (trapping time)
+    results[4] = d_max;                // L_max
+    results[5] = DIV;                  // divergence
+    results[6] = st.diag.entropy();    // entropy
+    results[7] = LAM;                  // laminarity
+}
+
+// Stream a len x len cross-recurrence plot of the two embeddings in ws.
+// Long plots go to the tiled multi-threaded engine when ws has one; both
+// paths give identical line statistics.
+static inline CrqaLineStats crqa_sweep(CrqaWorkspace &ws, int m, int len,
+                                       double R, int min_diag, int min_vert)
+{
+    const double R2 = crqa_radius_sq(R);
+
+    if (ws.tiled && len >= CRQA_TILED_MIN_LEN) {
+        CrqaTiledJob job = { ws.e1, ws.e2, m, len, len, R2, min_diag, min_vert };
+        ws.tiled->run(job);
+        return ws.tiled->stats();
+    }
+
+    const CrqaDistanceKernels &kern = crqa_distance_kernels();
+    const double *e2_cols[CRQA_MAX_M];
+    double x[CRQA_MAX_M];
+
+    for (int k = 0; k < m; k++) e2_cols[k] = ws.e2 + (size_t)k * len;
+
+    ws.lines.begin(len, len, min_diag, min_vert, ws.stream);
+    for (int i = 0; i < len; i++) {
+        for (int k = 0; k < m; k++) x[k] = ws.e1[(size_t)k * len + i];
+        kern.threshold_row(x, e2_cols, m, 0, len, R2, ws.row);
+        ws.lines.push_row(ws.row);
+    }
+    ws.lines.finish();
+    return ws.lines.stats();
+}
+
+template <int M, int TAU, int N>
+struct CrqaKernel
+{
+    static const int LEN = N - (M - 1) * TAU;
+    static_assert(M >= 1 && M <= CRQA_MAX_M, "unsupported embedding dimension");
+    static_assert(LEN > 0, "window too short for this embedding");
+
+    // out[k*LEN + i] = (x[i + k*TAU] - mean) / std
+    static void embed(const double *x, double mean, double std, double *out)
+    {
+        for (int k = 0; k < M; k++)
+            for (int i = 0; i < LEN; i++)
+                out[k * LEN + i] = (x[i + k * TAU] - mean) / std;
+    }
+
+    static void run(CrqaWorkspace &ws, double R, const double *sig1, const double *sig2,
+                    int min_diag, int min_vert, double results[8])
+    {
+        double mean1, std1, mean2, std2;
+        crqa_signal_stats(sig1, N, mean1, std1);
+        crqa_signal_stats(sig2, N, mean2, std2);
+
+        embed(sig1, mean1, std1, ws.e1);
+        embed(sig2, mean2, std2, ws.e2);
+
+        crqa_finish_metrics(crqa_sweep(ws, M, LEN, R, min_diag, min_vert), LEN, results);
+    }
+};
+
+// Any (m, tau, n) the table does not cover.
+static inline void crqa_run_generic(CrqaWorkspace &ws, const CrqaParams &p, double R,
+                                    const double *sig1, const double *sig2, double results[8])
+{
+    int len = crqa_embedded_len(p);
+
+    double mean1, std1, mean2, std2;
+    crqa_signal_stats(sig1, p.n, mean1, std1);
+    crqa_signal_stats(sig2, p.n, mean2, std2);
+
+    for (int k = 0; k < p.m; k++) {
+        for (int i = 0; i < len; i++) {
+            ws.e1[k * len + i] = (sig1[i + k * p.tau] - mean1) / std1;
+            ws.e2[k * len + i] = (sig2[i + k * p.tau] - mean2) / std2;
+        }
+    }
+
+    crqa_finish_metrics(crqa_sweep(ws, p.m, len, R, p.min_diag, p.min_vert), len, results);
+}
+
+typedef void (*crqa_kernel_fn)(CrqaWorkspace &ws, double R, const double *sig1, const double *sig2,
+                               int min_diag, int min_vert, double results[8]);
+
+struct CrqaKernelEntry {
+    int m, tau, n;
+    crqa_kernel_fn run;
+};
+
+// Configurations we deploy: the CRQA server default and the PSD embedding.
+static const CrqaKernelEntry crqa_kernel_table[] = {
+    { 3, 5, 512, &CrqaKernel<3, 5, 512>::run },
+    { 3, 1, 512, &CrqaKernel<3, 1, 512>::run },
+};
+
+static inline crqa_kernel_fn crqa_find_kernel(const CrqaParams &p)
+{
+    for (const CrqaKernelEntry &e : crqa_kernel_table)
+        if (e.m == p.m && e.tau == p.tau && e.n == p.n)
+            return e.run;
+    return nullptr;
+}
+
+static inline void crqa_compute(CrqaWorkspace &ws, const CrqaParams &p, double R,
+                                const double *sig1, const double *sig2, double results[8])
+{
+    if (!crqa_params_valid(p) || !ws.reserve(p.m, crqa_embedded_len(p))) {
+        for (int i = 0; i < 8; i++) results[i] = 0;
+        return;
+    }
+
+    crqa_kernel_fn fn = crqa_find_kernel(p);
+    if (fn)
+        fn(ws, R, sig1, sig2, p.min_diag, p.min_vert, results);
+    else
+        crqa_run_generic(ws, p, R, sig1, sig2, results);
+}
+
+#endif
@@ -0,0 +1,159 @@
+/* crqa_proto.h - wire format between the QEMU crqa-pci-dev and the SystemC
+ * CRQA server. Shared by systemc_server.cpp and psd.c (copy it next to psd.c
+ * in the QEMU tree); plain C so both sides can include it. */
+#ifndef CRQA_PROTO_H
+#define CRQA_PROTO_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define CRQA_PROTO_MAGIC     0x41515243u     /* "CRQA" little endian */
+#define CRQA_PROTO_VERSION   4
+#define CRQA_PROTO_SAMPLES   512             /* window length of the PCI device */
+
+/*
+ * Version 4: length-prefixed frames carrying a batch of windows.
+ *
+ * After connecting the client sends, once, its eventfd and optionally a
+ * memfd holding the device buffer (one SCM_RIGHTS message with one data
+ * byte, fds in that order); the server adds 1 to the eventfd per response
+ * frame written and maps the memfd shared. Then both directions are a
+ * stream of frames:
+ *
+ *   request:  crqa_frame_hdr
+ *             crqa_window[count]                  parameters of every window
+ *             for each window: sig1[n], sig2[n]   doubles
+ *   response: crqa_frame_hdr                      same tag and count
+ *             crqa_window_result[count]           in window order
+ *
+ * payload_len counts the bytes after the header, so a reader always knows
+ * how much to consume even for a frame it rejects. Every request frame is
+ * answered by exactly one response frame with the same tag (the guest-visible
+ * job id). Many frames may be in flight on one connection and responses come
+ * back in completion order, not request order.
+ *
+ * Zero-copy frames (CRQA_FRAME_SHM in flags): the payload is only
+ * crqa_shm_window[count]. Each names where its signals and its 8 results
+ * live in the shared memfd; the server computes on the samples in place and
+ * writes the results there. The response carries only uint32_t
+ * status[count], one CRQA_STATUS_* per window in window order, with the
+ * first failing one's in the header too; so the socket only carries a
+ * doorbell and a completion record.
+ */
+
+/*
+ * virtio transport (vhost-user-crqa device): no frames at all. Every
+ * request is one descriptor chain on virtqueue 0,
+ *
+ *   device-readable: crqa_window, sig1[n], sig2[n]   split anywhere
+ *   device-writable: crqa_window_result
+ *
+ * and the server, as vhost-user back-end, reads and writes guest memory
+ * directly and signals the call eventfd when requests complete.
+ */
+#define CRQA_VIRTIO_ID           63                  /* not assigned by the virtio spec */
+#define CRQA_VIRTIO_QUEUE_SIZE   128
+
+#define CRQA_PROTO_MAX_WINDOWS   256                 /* windows per frame */
+#define CRQA_PROTO_MAX_SAMPLES   131072              /* n of one window */
+#define CRQA_PROTO_MAX_PAYLOAD   (64u * 1024 * 1024) /* bytes after a header */
+
+/* flags of a request frame */
+#define CRQA_FRAME_SHM           0x0001
+
+/* status of a response frame or window */
+#define CRQA_STATUS_OK           0
+#define CRQA_STATUS_BAD_REQ      1   /* payload does not match the header */
+#define CRQA_STATUS_BAD_PARAMS   2   /* window parameters not computable */
+
+#pragma pack(push, 1)
+struct crqa_frame_hdr {
+    uint32_t magic;         /* CRQA_PROTO_MAGIC */
+    uint16_t version;       /* CRQA_PROTO_VERSION */
+    union {
+        uint16_t flags;     /* requests: CRQA_FRAME_* */
+        uint16_t status;    /* responses: CRQA_STATUS_* */
+    };
+    uint32_t count;         /* windows in this frame */
+    uint32_t payload_len;   /* bytes following this header */
+    uint64_t tag;
+};
+
+/* Zero for m, tau, min_diag or min_vert selects the server default. */
+struct crqa_window {
+    double   R;
+    uint32_t n;             /* samples per signal */
+    uint16_t m;
+    uint16_t tau;
+    uint16_t min_diag;
+    uint16_t min_vert;
+    uint32_t opcode;
+};
+
+/* Byte offsets into the shared memfd, all 8-byte aligned. */
+struct crqa_shm_window {
+    struct crqa_window w;
+    uint64_t sig1_off;      /* n doubles */
+    uint64_t sig2_off;      /* n doubles */
+    uint64_t result_off;    /* eps, rr, det, l, lmax, div, ent, lam */
+};
+
+struct crqa_window_result {
+    uint32_t status;
+    uint32_t reserved;
+    double eps, rr, det, l, lmax, div, ent, lam;
+};
+#pragma pack(pop)
+
+static inline void crqa_frame_hdr_init(struct crqa_frame_hdr *h, uint64_t tag,
+                                       uint32_t count, uint32_t payload_len)
+{
+    h->magic = CRQA_PROTO_MAGIC;
+    h->version = CRQA_PROTO_VERSION;
+    h->status = CRQA_STATUS_OK;
+    h->count = count;
+    h->payload_len = payload_len;
+    h->tag = tag;
+}
+
+/* Header checks that do not need the payload. */
+static inline int crqa_frame_hdr_valid(const struct crqa_frame_hdr *h)
+{
+    return h->magic == CRQA_PROTO_MAGIC && h->version == CRQA_PROTO_VERSION &&
+           h->count <= CRQA_PROTO_MAX_WINDOWS && h->payload_len <= CRQA_PROTO_MAX_PAYLOAD;
+}
+
+/* Payload bytes of a request with these windows. */
+static inline uint64_t crqa_request_payload_len(const struct crqa_window *w, uint32_t count)
+{
+    uint64_t len = (uint64_t)count * sizeof(struct crqa_window);
+    for (uint32_t i = 0; i < count; i++)
+        len += 2ull * w[i].n * sizeof(double);
+    return len;
+}
+
+static inline uint32_t crqa_shm_payload_len(uint32_t count)
+{
+    return count * (uint32_t)sizeof(struct crqa_shm_window);
+}
+
+/* Does [off, off + len) lie inside a shared region of 'size' bytes? */
+static inline int crqa_shm_range_ok(uint64_t off, uint64_t len, uint64_t size)
+{
+    return (off & 7) == 0 && off <= size && len <= size - off;
+}
+
+static inline uint32_t crqa_response_payload_len(uint32_t count)
+{
+    return count * (uint32_t)sizeof(struct crqa_window_result);
+}
+
+static inline uint32_t crqa_shm_response_payload_len(uint32_t count)
+{
+    return count * (uint32_t)sizeof(uint32_t);
+}
+
+#endif
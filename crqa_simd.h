@@ -0,0 +1,241 @@
+#ifndef CRQA_SIMD_H
+#define CRQA_SIMD_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "crqa_bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRQA_HAVE_X86_KERNELS 1
+#endif
+
+// -----------------------------------------------------------------------------
+// Distance kernels shared by the CRQA server and PSDEpsilonModule.
+//
+// Embeddings are laid out structure-of-arrays: cols[k][j] is coordinate k of
+// embedded point j. Every kernel compares one point x (m coordinates) against
+// points [begin, end) of the other embedding using squared distances only.
+//
+//   threshold_row : writes bit (j - begin) of out[] when |x - p_j|^2 <= r2.
+//                   Words are written whole, unused high bits are zero.
+//   max_dist_sq   : returns max |x - p_j|^2 (0 for an empty range).
+//
+// The squared distance is accumulated in coordinate order with separate
+// multiply and add (no FMA), so every path produces bit-identical results.
+// The scalar path is the reference; one path is picked at startup from the
+// host CPU features (override with CRQA_KERNEL=scalar|avx2|avx512).
+// -----------------------------------------------------------------------------
+
+typedef void (*crqa_threshold_row_fn)(const double *x, const double *const *cols, int m,
+                                      int begin, int end, double r2, uint64_t *out);
+typedef double (*crqa_max_dist_sq_fn)(const double *x, const double *const *cols, int m,
+                                      int begin, int end);
+
+struct CrqaDistanceKernels {
+    const char *name;
+    crqa_threshold_row_fn threshold_row;
+    crqa_max_dist_sq_fn max_dist_sq;
+};
+
+// Squared radius for "distance <= R"; a negative R never matches.
+static inline double crqa_radius_sq(double R)
+{
+    return R < 0 ? -1.0 : R * R;
+}
+
+// ---- scalar reference --------------------------------------------------------
+
+static inline double crqa_dist_sq_scalar(const double *x, const double *const *cols, int m, int j)
+{
+    double dist_sq = 0;
+    for (int k = 0; k < m; k++) {
+        double d = x[k] - cols[k][j];
+        dist_sq += d * d;
+    }
+    return dist_sq;
+}
+
+static void crqa_threshold_row_scalar(const double *x, const double *const *cols, int m,
+                                      int begin, int end, double r2, uint64_t *out)
+{
+    int n = end - begin;
+    for (int w = 0; w < RecurrenceBitmap::words_for(n); w++) {
+        uint64_t bits = 0;
+        int j0 = begin + w * RecurrenceBitmap::WORD_BITS;
+        int j1 = j0 + RecurrenceBitmap::WORD_BITS < end ? j0 + RecurrenceBitmap::WORD_BITS : end;
+        for (int j = j0; j < j1; j++) {
+            if (crqa_dist_sq_scalar(x, cols, m, j) <= r2)
+                bits |= 1ULL << (j - j0);
+        }
+        out[w] = bits;
+    }
+}
+
+static double crqa_max_dist_sq_scalar(const double *x, const double *const *cols, int m,
+                                      int begin, int end)
+{
+    double maxd = 0.0;
+    for (int j = begin; j < end; j++) {
+        double d2 = crqa_dist_sq_scalar(x, cols, m, j);
+        if (d2 > maxd) maxd = d2;
+    }
+    return maxd;
+}
+
+#ifdef CRQA_HAVE_X86_KERNELS
+
+// ---- AVX2: 4 points per compare, 16 compares per output word ----------------
+
+__attribute__((target("avx2")))
+static inline __m256d crqa_dist_sq_avx2(const double *x, const double *const *cols, int m, int j)
+{
+    __m256d acc = _mm256_setzero_pd();
+    for (int k = 0; k < m; k++) {
+        __m256d d = _mm256_sub_pd(_mm256_set1_pd(x[k]), _mm256_loadu_pd(cols[k] + j));
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(d, d));
+    }
+    return acc;
+}
+
+__attribute__((target("avx2")))
+static void crqa_threshold_row_avx2(const double *x, const double *const *cols, int m,
+                                    int begin, int end, double r2, uint64_t *out)
+{
+    const __m256d r2v = _mm256_set1_pd(r2);
+    int n = end - begin;
+    for (int w = 0; w < RecurrenceBitmap::words_for(n); w++) {
+        uint64_t bits = 0;
+        int j0 = begin + w * RecurrenceBitmap::WORD_BITS;
+        int j1 = j0 + RecurrenceBitmap::WORD_BITS < end ? j0 + RecurrenceBitmap::WORD_BITS : end;
+        int j = j0;
+        for (; j + 4 <= j1; j += 4) {
+            __m256d le = _mm256_cmp_pd(crqa_dist_sq_avx2(x, cols, m, j), r2v, _CMP_LE_OQ);
+            bits |= (uint64_t)_mm256_movemask_pd(le) << (j - j0);
+        }
+        for (; j < j1; j++) {
+            if (crqa_dist_sq_scalar(x, cols, m, j) <= r2)
+                bits |= 1ULL << (j - j0);
+        }
+        out[w] = bits;
+    }
+}
+
+__attribute__((target("avx2")))
+static double crqa_max_dist_sq_avx2(const double *x, const double *const *cols, int m,
+                                    int begin, int end)
+{
+    __m256d maxv = _mm256_setzero_pd();
+    int j = begin;
+    for (; j + 4 <= end; j += 4)
+        maxv = _mm256_max_pd(maxv, crqa_dist_sq_avx2(x, cols, m, j));
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, maxv);
+    double maxd = 0.0;
+    for (int l = 0; l < 4; l++)
+        if (lanes[l] > maxd) maxd = lanes[l];
+    for (; j < end; j++) {
+        double d2 = crqa_dist_sq_scalar(x, cols, m, j);
+        if (d2 > maxd) maxd = d2;
+    }
+    return maxd;
+}
+
+// ---- AVX-512: 8 points per compare, compare result is already a mask --------
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static inline __m512d crqa_dist_sq_avx512(const double *x, const double *const *cols, int m, int j)
+{
+    __m512d acc = _mm512_setzero_pd();
+    for (int k = 0; k < m; k++) {
+        __m512d d = _mm512_sub_pd(_mm512_set1_pd(x[k]), _mm512_loadu_pd(cols[k] + j));
+        acc = _mm512_add_pd(acc, _mm512_mul_pd(d, d));
+    }
+    return acc;
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void crqa_threshold_row_avx512(const double *x, const double *const *cols, int m,
+                                      int begin, int end, double r2, uint64_t *out)
+{
+    const __m512d r2v = _mm512_set1_pd(r2);
+    int n = end - begin;
+    for (int w = 0; w < RecurrenceBitmap::words_for(n); w++) {
+        uint64_t bits = 0;
+        int j0 = begin + w * RecurrenceBitmap::WORD_BITS;
+        int j1 = j0 + RecurrenceBitmap::WORD_BITS < end ? j0 + RecurrenceBitmap::WORD_BITS : end;
+        int j = j0;
+        for (; j + 8 <= j1; j += 8) {
+            __mmask8 le = _mm512_cmp_pd_mask(crqa_dist_sq_avx512(x, cols, m, j), r2v, _CMP_LE_OQ);
+            bits |= (uint64_t)le << (j - j0);
+        }
+        for (; j < j1; j++) {
+            if (crqa_dist_sq_scalar(x, cols, m, j) <= r2)
+                bits |= 1ULL << (j - j0);
+        }
+        out[w] = bits;
+    }
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static double crqa_max_dist_sq_avx512(const double *x, const double *const *cols, int m,
+                                      int begin, int end)
+{
+    __m512d maxv = _mm512_setzero_pd();
+    int j = begin;
+    for (; j + 8 <= end; j += 8)
+        maxv = _mm512_max_pd(maxv, crqa_dist_sq_avx512(x, cols, m, j));
+
+    double lanes[8];
+    _mm512_storeu_pd(lanes, maxv);
+    double maxd = 0.0;
+    for (int l = 0; l < 8; l++)
+        if (lanes[l] > maxd) maxd = lanes[l];
+    for (; j < end; j++) {
+        double d2 = crqa_dist_sq_scalar(x, cols, m, j);
+        if (d2 > maxd) maxd = d2;
+    }
+    return maxd;
+}
+
+#endif /* CRQA_HAVE_X86_KERNELS */
+
+static const CrqaDistanceKernels crqa_scalar_kernels = {
+    "scalar", crqa_threshold_row_scalar, crqa_max_dist_sq_scalar
+};
+
+static inline CrqaDistanceKernels crqa_select_kernels()
+{
+    const char *force = getenv("CRQA_KERNEL");
+    if (force && strcmp(force, "scalar") == 0)
+        return crqa_scalar_kernels;
+
+#ifdef CRQA_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    bool avx512 = __builtin_cpu_supports("avx512f");
+    bool avx2 = __builtin_cpu_supports("avx2");
+    if (force && strcmp(force, "avx2") == 0)
+        avx512 = false;
+
+    if (avx512) {
+        CrqaDistanceKernels k = { "avx512", crqa_threshold_row_avx512, crqa_max_dist_sq_avx512 };
+        return k;
+    }
+    if (avx2) {
+        CrqaDistanceKernels k = { "avx2", crqa_threshold_row_avx2, crqa_max_dist_sq_avx2 };
+        return k;
+    }
+#endif
+    return crqa_scalar_kernels;
+}
+
+// Kernels for this host, selected on first use.
+static inline const CrqaDistanceKernels &crqa_distance_kernels()
+{
+    static const CrqaDistanceKernels selected = crqa_select_kernels();
+    return selected;
+}
+
+#endif
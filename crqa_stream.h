@@ -0,0 +1,224 @@
+#ifndef CRQA_STREAM_H
+#define CRQA_STREAM_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include "crqa_bitmap.h"
+
+// -----------------------------------------------------------------------------
+// Single-sweep line statistics over a recurrence plot that is fed one row of
+// threshold bits at a time. The plot itself is never stored: only the previous
+// row is kept, plus the row at which the open run of every diagonal and every
+// column started. Working set is O(rows + cols) and lives in caller-owned
+// storage (see CrqaWorkspace), so a sweep never allocates.
+//
+// Rows are processed 64 cells per step. With prev/cur the previous and current
+// row words:
+//   diagonal open   = prev shifted up one column (cell (i-1, j-1) set)
+//   vertical open   = prev
+//   run starts      = cur & ~open
+//   run ends        = open & ~cur
+// Only the start and end bits are visited individually (ctz), so long runs
+// and empty stretches cost one word operation per 64 cells.
+//
+// Lines are only recorded in fixed-size length histograms; every line metric
+// (DET, L, L_max, ENTR, LAM, TT, V_max) is derived from the bins afterwards.
+// -----------------------------------------------------------------------------
+
+// count[l] = number of lines of length l, for 0 < l < len. Lines shorter than
+// the sweep's minimum length are never entered.
+struct CrqaLineHistogram {
+    const uint64_t *count;
+    int len;
+
+    uint64_t lines() const
+    {
+        uint64_t n = 0;
+        for (int l = 1; l < len; l++) n += count[l];
+        return n;
+    }
+
+    uint64_t points() const
+    {
+        uint64_t n = 0;
+        for (int l = 1; l < len; l++) n += (uint64_t)l * count[l];
+        return n;
+    }
+
+    int max() const
+    {
+        for (int l = len - 1; l > 0; l--)
+            if (count[l]) return l;
+        return 0;
+    }
+
+    double mean() const
+    {
+        uint64_t n = lines();
+        return n > 0 ? (double)points() / n : 0;
+    }
+
+    // Sum over lines of -p log2 p with p = l / points(): one log2 per
+    // occupied bin instead of one per line.
+    double entropy() const
+    {
+        double total = (double)points();
+        double ent = 0;
+        for (int l = 1; l < len; l++) {
+            if (!count[l]) continue;
+            double p = (double)l / total;
+            ent -= count[l] * (p * std::log2(p));
+        }
+        return ent;
+    }
+};
+
+// Result of one sweep.
+struct CrqaLineStats {
+    uint64_t rec;              // recurrent points
+    CrqaLineHistogram diag;    // diagonal lines >= min_diag
+    CrqaLineHistogram vert;    // vertical lines >= min_vert
+};
+
+// Scratch for one sweep over a rows x cols plot.
+struct CrqaStreamBuffers {
+    int *diag_start;      // rows + cols - 1, start row of each open diagonal run
+    int *col_start;       // cols, start row of each open vertical run
+    uint64_t *prev;       // previous row, words_for(cols) words
+    uint64_t *d_hist;     // diagonal line lengths, diag_hist_count() bins
+    uint64_t *v_hist;     // vertical line lengths, vert_hist_count() bins
+
+    static size_t diag_count(int rows, int cols) { return (size_t)rows + cols - 1; }
+    static size_t diag_hist_count(int rows, int cols) { return (size_t)(rows < cols ? rows : cols) + 1; }
+    static size_t vert_hist_count(int rows, int cols) { (void)cols; return (size_t)rows + 1; }
+};
+
+static inline int ctz64(uint64_t w)
+{
+    return __builtin_ctzll(w);
+}
+
+class CrqaLineStream
+{
+public:
+    CrqaLineStream() : rec(0), n_rows(0), n_cols(0), n_words(0), next_row(0),
+                       min_diag(2), min_vert(2), last_mask(0), diag_start(nullptr),
+                       col_start(nullptr), prev(nullptr), d_hist(nullptr), v_hist(nullptr) {}
+
+    void begin(int rows, int cols, int min_diag_len, int min_vert_len,
+               const CrqaStreamBuffers &buf)
+    {
+        n_rows = rows;
+        n_cols = cols;
+        n_words = RecurrenceBitmap::words_for(cols);
+        next_row = 0;
+        min_diag = min_diag_len;
+        min_vert = min_vert_len;
+        last_mask = (cols % RecurrenceBitmap::WORD_BITS) ?
+                    (1ULL << (cols % RecurrenceBitmap::WORD_BITS)) - 1 : ~0ULL;
+
+        // diagonal k = j - i is stored at index k + rows - 1
+        diag_start = buf.diag_start;
+        col_start = buf.col_start;
+        prev = buf.prev;
+        d_hist = buf.d_hist;
+        v_hist = buf.v_hist;
+        memset(prev, 0, n_words * sizeof(uint64_t));
+        memset(d_hist, 0, CrqaStreamBuffers::diag_hist_count(rows, cols) * sizeof(uint64_t));
+        memset(v_hist, 0, CrqaStreamBuffers::vert_hist_count(rows, cols) * sizeof(uint64_t));
+
+        rec = 0;
+    }
+
+    CrqaLineStats stats() const
+    {
+        CrqaLineStats st;
+        st.rec = rec;
+        st.diag.count = d_hist;
+        st.diag.len = (int)CrqaStreamBuffers::diag_hist_count(n_rows, n_cols);
+        st.vert.count = v_hist;
+        st.vert.len = (int)CrqaStreamBuffers::vert_hist_count(n_rows, n_cols);
+        return st;
+    }
+
+    // Feed the next row (in order, starting at row 0). 'bits' uses the
+    // RecurrenceBitmap row layout: bit j % 64 of word j / 64 is column j, and
+    // bits past the last column are zero.
+    void push_row(const uint64_t *bits)
+    {
+        const int i = next_row++;
+        int *dstart = &diag_start[n_rows - 1 - i];   // dstart[j] is diagonal j - i
+
+        // The diagonal through (i-1, cols-1) leaves the plot here.
+        if (i > 0 && ((prev[n_words - 1] >> ((n_cols - 1) % RecurrenceBitmap::WORD_BITS)) & 1))
+            end_diag(i - dstart[n_cols]);
+
+        uint64_t carry = 0;
+        for (int w = 0; w < n_words; w++) {
+            const uint64_t cur = bits[w];
+            const uint64_t up = prev[w];
+            uint64_t dopen = (up << 1) | carry;
+            carry = up >> (RecurrenceBitmap::WORD_BITS - 1);
+            if (w == n_words - 1)
+                dopen &= last_mask;
+            prev[w] = cur;
+
+            if ((cur | up | dopen) == 0)
+                continue;
+            rec += popcount64(cur);
+
+            const int j0 = w * RecurrenceBitmap::WORD_BITS;
+            int *dst = dstart + j0;
+            int *vst = col_start + j0;
+
+            for (uint64_t e = dopen & ~cur; e; e &= e - 1)
+                end_diag(i - dst[ctz64(e)]);
+            for (uint64_t e = cur & ~dopen; e; e &= e - 1)
+                dst[ctz64(e)] = i;
+            for (uint64_t e = up & ~cur; e; e &= e - 1)
+                end_vert(i - vst[ctz64(e)]);
+            for (uint64_t e = cur & ~up; e; e &= e - 1)
+                vst[ctz64(e)] = i;
+        }
+    }
+
+    // Close every run that is still open in the last row.
+    void finish()
+    {
+        const int *dstart = &diag_start[0];   // last row: dstart[j] is diagonal j - (rows-1)
+        for (int w = 0; w < n_words; w++) {
+            const int j0 = w * RecurrenceBitmap::WORD_BITS;
+            for (uint64_t e = prev[w]; e; e &= e - 1) {
+                int j = j0 + ctz64(e);
+                end_diag(n_rows - dstart[j]);
+                end_vert(n_rows - col_start[j]);
+            }
+        }
+    }
+
+private:
+    uint64_t rec;
+    int n_rows, n_cols, n_words, next_row;
+    int min_diag, min_vert;
+    uint64_t last_mask;
+    int *diag_start;
+    int *col_start;
+    uint64_t *prev;
+    uint64_t *d_hist;
+    uint64_t *v_hist;
+
+    void end_diag(int len)
+    {
+        if (len >= min_diag)
+            d_hist[len]++;
+    }
+
+    void end_vert(int len)
+    {
+        if (len >= min_vert)
+            v_hist[len]++;
+    }
+};
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef CRQA_THREAD_POOL_H
+#define CRQA_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Small work-stealing pool for splitting one CRQA request across cores.
+//
+// run() deals a batch of tasks round-robin onto per-worker deques and blocks
+// until all of them have finished. A worker pops from the back of its own
+// deque and, once that is empty, steals from the front of the others, so
+// uneven tiles even out without a shared queue on the fast path. A task gets
+// the index of the worker running it, for per-worker scratch.
+// -----------------------------------------------------------------------------
+class CrqaThreadPool
+{
+public:
+    typedef std::function<void(int worker)> Task;
+
+    explicit CrqaThreadPool(int threads)
+        : queues(threads > 0 ? threads : 1), queued(0), pending(0), stopping(false)
+    {
+        for (size_t w = 0; w < queues.size(); w++)
+            queues[w].reset(new WorkerQueue);
+        for (int w = 0; w < (int)queues.size(); w++)
+            workers.emplace_back(&CrqaThreadPool::worker_loop, this, w);
+    }
+
+    ~CrqaThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(idle_mtx);
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (std::thread &t : workers)
+            t.join();
+    }
+
+    CrqaThreadPool(const CrqaThreadPool &) = delete;
+    CrqaThreadPool &operator=(const CrqaThreadPool &) = delete;
+
+    int size() const { return (int)queues.size(); }
+
+    // Run every task and wait for all of them. Batches submitted from
+    // several threads run one after another; tasks must not call run().
+    void run(std::vector<Task> &tasks)
+    {
+        if (tasks.empty())
+            return;
+
+        std::lock_guard<std::mutex> batch(batch_mtx);
+
+        pending.store(tasks.size());
+        for (size_t t = 0; t < tasks.size(); t++) {
+            WorkerQueue &q = *queues[t % queues.size()];
+            std::lock_guard<std::mutex> lk(q.mtx);
+            q.tasks.push_back(&tasks[t]);
+        }
+        {
+            std::lock_guard<std::mutex> lk(idle_mtx);
+            queued.fetch_add(tasks.size());
+        }
+        idle_cv.notify_all();
+
+        std::unique_lock<std::mutex> lk(done_mtx);
+        done_cv.wait(lk, [this] { return pending.load() == 0; });
+    }
+
+private:
+    struct WorkerQueue {
+        std::mutex mtx;
+        std::deque<Task *> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex batch_mtx;
+
+    std::mutex idle_mtx;
+    std::condition_variable idle_cv;
+    std::atomic<size_t> queued;       // tasks sitting in any deque
+    std::atomic<size_t> pending;      // tasks of the current batch not finished
+    bool stopping;
+
+    std::mutex done_mtx;
+    std::condition_variable done_cv;
+
+    Task *take(int self)
+    {
+        {
+            WorkerQueue &q = *queues[self];
+            std::lock_guard<std::mutex> lk(q.mtx);
+            if (!q.tasks.empty()) {
+                Task *t = q.tasks.back();
+                q.tasks.pop_back();
+                return t;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++) {
+            WorkerQueue &q = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lk(q.mtx);
+            if (!q.tasks.empty()) {
+                Task *t = q.tasks.front();
+                q.tasks.pop_front();
+                return t;
+            }
+        }
+        return nullptr;
+    }
+
+    void worker_loop(int self)
+    {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lk(idle_mtx);
+                idle_cv.wait(lk, [this] { return stopping || queued.load() > 0; });
+                if (stopping)
+                    return;
+            }
+
+            Task *t = take(self);
+            if (!t)
+                continue;
+            queued.fetch_sub(1);
+            (*t)(self);
+
+            if (pending.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lk(done_mtx);
+                done_cv.notify_all();
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,352 @@
+#ifndef CRQA_TILED_H
+#define CRQA_TILED_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "crqa_bitmap.h"
+#include "crqa_stream.h"
+#include "crqa_simd.h"
+#include "crqa_thread_pool.h"
+
+// -----------------------------------------------------------------------------
+// Multi-threaded tiled CRQA sweep for long windows (N up to ~100k).
+//
+// The rows x cols plane is cut into bands of band_rows rows; each band is one
+// pool task. Inside a band the plot is walked tile by tile (chunk_cols columns
+// at a time, all rows of the band), so the slice of the second embedding a
+// tile reads stays in cache. Within a band, runs are tracked exactly as in
+// CrqaLineStream (previous-row words, run start rows, ctz over boundaries);
+// a diagonal crossing into the next tile picks up its open state from the
+// tile's left-edge column.
+//
+// Runs that touch a band border are not counted by the band. Each band reports
+// per diagonal and per column:
+//   pre  - length of the run starting on the band's first row (if the same
+//          line could continue from the band above), and whether it is still
+//          open at the band's last row ("through")
+//   suf  - length of a run open at the band's last row that started inside
+// The bands of a wave are then stitched in order on the calling thread, so the
+// histograms are exactly those of the single-threaded sweep. At most one wave
+// of band states exists at a time and the plot is never materialised.
+// -----------------------------------------------------------------------------
+
+struct CrqaTiledJob {
+    const double *e1;       // SoA embedding of the row signal, m * rows
+    const double *e2;       // SoA embedding of the column signal, m * cols
+    int m, rows, cols;
+    double r2;
+    int min_diag, min_vert;
+};
+
+class CrqaTiledEngine
+{
+public:
+    static const int DEFAULT_BAND_ROWS = 256;
+    static const int DEFAULT_CHUNK_COLS = 4096;
+
+    // chunk_cols is rounded up to whole 64-bit words.
+    explicit CrqaTiledEngine(CrqaThreadPool *thread_pool,
+                             int band_rows = DEFAULT_BAND_ROWS,
+                             int chunk_cols = DEFAULT_CHUNK_COLS)
+        : pool(thread_pool),
+          band_h(band_rows > 0 ? band_rows : 1),
+          chunk_w(RecurrenceBitmap::words_for(chunk_cols > 0 ? chunk_cols : 1) * RecurrenceBitmap::WORD_BITS),
+          rec(0) {}
+
+    // Sweep the whole plot. Results stay valid until the next run().
+    void run(const CrqaTiledJob &job)
+    {
+        j = job;
+        D = (size_t)j.rows + j.cols - 1;
+        int workers = pool ? pool->size() : 1;
+        int bands = (j.rows + band_h - 1) / band_h;
+        int wave = workers < bands ? workers : bands;
+
+        slots.resize(wave);
+        scratch.resize(workers);
+        for (Slot &s : slots) s.reserve(D, j.rows, j.cols);
+        for (Scratch &s : scratch) s.reserve(j.m, chunk_w, band_h);
+
+        d_carry.assign(D, 0);
+        v_carry.assign(j.cols, 0);
+        d_hist.assign(CrqaStreamBuffers::diag_hist_count(j.rows, j.cols), 0);
+        v_hist.assign(CrqaStreamBuffers::vert_hist_count(j.rows, j.cols), 0);
+        rec = 0;
+
+        std::vector<CrqaThreadPool::Task> tasks;
+        for (int b0 = 0; b0 < bands; b0 += wave) {
+            int nb = bands - b0 < wave ? bands - b0 : wave;
+            tasks.clear();
+            for (int k = 0; k < nb; k++) {
+                int r0 = (b0 + k) * band_h;
+                int r1 = r0 + band_h < j.rows ? r0 + band_h : j.rows;
+                Slot *slot = &slots[k];
+                tasks.push_back([this, r0, r1, slot](int worker) {
+                    sweep_band(r0, r1, *slot, scratch[worker]);
+                });
+            }
+            if (pool)
+                pool->run(tasks);
+            else
+                for (CrqaThreadPool::Task &t : tasks) t(0);
+
+            for (int k = 0; k < nb; k++)
+                stitch(slots[k]);
+        }
+    }
+
+    CrqaLineStats stats() const
+    {
+        CrqaLineStats st;
+        st.rec = rec;
+        st.diag.count = d_hist.data();
+        st.diag.len = (int)d_hist.size();
+        st.vert.count = v_hist.data();
+        st.vert.len = (int)v_hist.size();
+        return st;
+    }
+
+private:
+    // Per-band results, one per band of a wave
+    struct Slot {
+        std::vector<int> d_start, v_start;      // open run start rows
+        std::vector<int> d_pre, d_suf;          // per diagonal index
+        std::vector<uint8_t> d_thru;
+        std::vector<int> v_pre, v_suf;          // per column
+        std::vector<uint8_t> v_thru;
+        std::vector<uint64_t> d_hist, v_hist;   // lines entirely inside the band
+        uint64_t rec;
+
+        void reserve(size_t diags, int rows, int cols)
+        {
+            d_start.resize(diags);
+            v_start.resize(cols);
+            d_pre.resize(diags);
+            d_suf.resize(diags);
+            d_thru.resize(diags);
+            v_pre.resize(cols);
+            v_suf.resize(cols);
+            v_thru.resize(cols);
+            d_hist.resize(CrqaStreamBuffers::diag_hist_count(rows, cols));
+            v_hist.resize(CrqaStreamBuffers::vert_hist_count(rows, cols));
+        }
+
+        void clear()
+        {
+            memset(d_pre.data(), 0, d_pre.size() * sizeof(int));
+            memset(d_suf.data(), 0, d_suf.size() * sizeof(int));
+            memset(d_thru.data(), 0, d_thru.size());
+            memset(v_pre.data(), 0, v_pre.size() * sizeof(int));
+            memset(v_suf.data(), 0, v_suf.size() * sizeof(int));
+            memset(v_thru.data(), 0, v_thru.size());
+            memset(d_hist.data(), 0, d_hist.size() * sizeof(uint64_t));
+            memset(v_hist.data(), 0, v_hist.size() * sizeof(uint64_t));
+            rec = 0;
+        }
+    };
+
+    // Per-worker tile buffers
+    struct Scratch {
+        std::vector<uint64_t> cur, prev;        // one tile row, chunk_w bits
+        std::vector<uint64_t> edge_in, edge_out;   // tile edge column, one bit per band row
+        std::vector<const double *> cols;
+        std::vector<double> x;
+
+        void reserve(int m, int chunk_cols, int band_rows)
+        {
+            cur.resize(RecurrenceBitmap::words_for(chunk_cols));
+            prev.resize(cur.size());
+            edge_in.resize(RecurrenceBitmap::words_for(band_rows));
+            edge_out.resize(edge_in.size());
+            cols.resize(m);
+            x.resize(m);
+        }
+    };
+
+    CrqaThreadPool *pool;
+    int band_h, chunk_w;
+    CrqaTiledJob j;
+    size_t D;
+    std::vector<Slot> slots;
+    std::vector<Scratch> scratch;
+    std::vector<int> d_carry, v_carry;      // run open at the bottom of the stitched bands
+    std::vector<uint64_t> d_hist, v_hist;
+    uint64_t rec;
+
+    static bool get_bit(const uint64_t *w, int b)
+    {
+        return (w[b / RecurrenceBitmap::WORD_BITS] >> (b % RecurrenceBitmap::WORD_BITS)) & 1;
+    }
+
+    static void set_bit(uint64_t *w, int b)
+    {
+        w[b / RecurrenceBitmap::WORD_BITS] |= 1ULL << (b % RecurrenceBitmap::WORD_BITS);
+    }
+
+    int diag_index(int i, int col) const { return col - i + j.rows - 1; }
+
+    // A diagonal run starting at row r0 > 0 may continue from the band above
+    // unless the diagonal itself starts there (column 0).
+    static bool diag_from_above(int start, int r0, int col_at_start)
+    {
+        return start == r0 && r0 > 0 && col_at_start > 0;
+    }
+
+    // Diagonal run ending before row 'end' at column 'col' of row end - 1.
+    void close_diag(Slot &s, int r0, int end, int col) const
+    {
+        int idx = diag_index(end - 1, col);
+        int start = s.d_start[idx];
+        int len = end - start;
+        if (diag_from_above(start, r0, col - (len - 1)))
+            s.d_pre[idx] = len;
+        else if (len >= j.min_diag)
+            s.d_hist[len]++;
+    }
+
+    void close_vert(Slot &s, int r0, int end, int col) const
+    {
+        int start = s.v_start[col];
+        int len = end - start;
+        if (start == r0 && r0 > 0)
+            s.v_pre[col] = len;
+        else if (len >= j.min_vert)
+            s.v_hist[len]++;
+    }
+
+    void sweep_band(int r0, int r1, Slot &s, Scratch &sc) const
+    {
+        const CrqaDistanceKernels &kern = crqa_distance_kernels();
+        const int H = r1 - r0;
+        const int edge_words = RecurrenceBitmap::words_for(H);
+
+        s.clear();
+        for (int k = 0; k < j.m; k++) sc.cols[k] = j.e2 + (size_t)k * j.cols;
+        memset(sc.edge_in.data(), 0, edge_words * sizeof(uint64_t));
+
+        for (int c0 = 0; c0 < j.cols; c0 += chunk_w) {
+            const int c1 = c0 + chunk_w < j.cols ? c0 + chunk_w : j.cols;
+            const int nw = RecurrenceBitmap::words_for(c1 - c0);
+            const uint64_t last_mask = ((c1 - c0) % RecurrenceBitmap::WORD_BITS) ?
+                (1ULL << ((c1 - c0) % RecurrenceBitmap::WORD_BITS)) - 1 : ~0ULL;
+            uint64_t *cur = sc.cur.data();
+            uint64_t *prev = sc.prev.data();
+
+            memset(prev, 0, nw * sizeof(uint64_t));
+            memset(sc.edge_out.data(), 0, edge_words * sizeof(uint64_t));
+
+            for (int i = r0; i < r1; i++) {
+                const int t = i - r0;
+                for (int k = 0; k < j.m; k++) sc.x[k] = j.e1[(size_t)k * j.rows + i];
+                kern.threshold_row(sc.x.data(), sc.cols.data(), j.m, c0, c1, j.r2, cur);
+
+                // The diagonal through (i-1, cols-1) leaves the plot here.
+                if (c1 == j.cols && t > 0 && get_bit(prev, c1 - 1 - c0))
+                    close_diag(s, r0, i, j.cols - 1);
+
+                // Diagonal entering from the tile on the left: cell (i-1, c0-1)
+                uint64_t carry = (t > 0 && c0 > 0) ? get_bit(sc.edge_in.data(), t - 1) : 0;
+                for (int w = 0; w < nw; w++) {
+                    const uint64_t c = cur[w];
+                    const uint64_t up = prev[w];
+                    uint64_t dopen = (up << 1) | carry;
+                    carry = up >> (RecurrenceBitmap::WORD_BITS - 1);
+                    if (w == nw - 1)
+                        dopen &= last_mask;
+                    prev[w] = c;
+
+                    if ((c | up | dopen) == 0)
+                        continue;
+                    s.rec += popcount64(c);
+
+                    const int jw = c0 + w * RecurrenceBitmap::WORD_BITS;
+                    for (uint64_t e = dopen & ~c; e; e &= e - 1)
+                        close_diag(s, r0, i, jw + ctz64(e) - 1);
+                    for (uint64_t e = c & ~dopen; e; e &= e - 1)
+                        s.d_start[diag_index(i, jw + ctz64(e))] = i;
+                    for (uint64_t e = up & ~c; e; e &= e - 1)
+                        close_vert(s, r0, i, jw + ctz64(e));
+                    for (uint64_t e = c & ~up; e; e &= e - 1)
+                        s.v_start[jw + ctz64(e)] = i;
+                }
+
+                if (get_bit(cur, c1 - 1 - c0))
+                    set_bit(sc.edge_out.data(), t);
+            }
+
+            // Runs still open in the band's last row of this tile
+            for (int w = 0; w < nw; w++) {
+                const int jw = c0 + w * RecurrenceBitmap::WORD_BITS;
+                for (uint64_t e = prev[w]; e; e &= e - 1) {
+                    const int col = jw + ctz64(e);
+                    end_band_diag(s, r0, r1, col);
+                    end_band_vert(s, r0, r1, col);
+                }
+            }
+            std::swap(sc.edge_in, sc.edge_out);
+        }
+    }
+
+    void end_band_diag(Slot &s, int r0, int r1, int col) const
+    {
+        if (r1 == j.rows || col == j.cols - 1) {
+            close_diag(s, r0, r1, col);
+            return;
+        }
+        int idx = diag_index(r1 - 1, col);
+        int start = s.d_start[idx];
+        int len = r1 - start;
+        if (diag_from_above(start, r0, col - (len - 1))) {
+            s.d_pre[idx] = len;
+            s.d_thru[idx] = 1;
+        } else {
+            s.d_suf[idx] = len;
+        }
+    }
+
+    void end_band_vert(Slot &s, int r0, int r1, int col) const
+    {
+        if (r1 == j.rows) {
+            close_vert(s, r0, r1, col);
+            return;
+        }
+        int start = s.v_start[col];
+        int len = r1 - start;
+        if (start == r0 && r0 > 0) {
+            s.v_pre[col] = len;
+            s.v_thru[col] = 1;
+        } else {
+            s.v_suf[col] = len;
+        }
+    }
+
+    // Append one band (in row order) to the running totals.
+    void stitch(const Slot &s)
+    {
+        rec += s.rec;
+        for (size_t l = 0; l < d_hist.size(); l++) d_hist[l] += s.d_hist[l];
+        for (size_t l = 0; l < v_hist.size(); l++) v_hist[l] += s.v_hist[l];
+
+        for (size_t idx = 0; idx < D; idx++) {
+            int run = d_carry[idx] + s.d_pre[idx];
+            if (s.d_thru[idx]) {
+                d_carry[idx] = run;
+            } else {
+                if (run >= j.min_diag) d_hist[run]++;
+                d_carry[idx] = s.d_suf[idx];
+            }
+        }
+        for (int col = 0; col < j.cols; col++) {
+            int run = v_carry[col] + s.v_pre[col];
+            if (s.v_thru[col]) {
+                v_carry[col] = run;
+            } else {
+                if (run >= j.min_vert) v_hist[run]++;
+                v_carry[col] = s.v_suf[col];
+            }
+        }
+    }
+};
+
+#endif
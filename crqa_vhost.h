@@ -0,0 +1,628 @@
+#ifndef CRQA_VHOST_H
+#define CRQA_VHOST_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// -----------------------------------------------------------------------------
+// Back-end side of the vhost-user protocol, for the vhost-user-crqa device.
+//
+// QEMU hands over the guest RAM (memfds, mapped here), the ring addresses
+// and a kick/call eventfd pair for the virtqueue; after that, requests go
+// from guest memory straight to the workers and results straight back
+// without passing through QEMU. Only what a single-queue device without
+// config space needs is implemented: split rings, no indirect descriptors,
+// no event index and no dirty logging (so no live migration).
+//
+// Messages and kicks are handled on one thread, from a non-blocking socket;
+// completions may be pushed from another, so ring state is guarded by a
+// mutex.
+// -----------------------------------------------------------------------------
+
+enum {
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+};
+
+#define VHOST_USER_VERSION          0x1
+#define VHOST_USER_REPLY            0x4
+#define VHOST_USER_VRING_NOFD       0x100
+#define VHOST_USER_MAX_REGIONS      8
+
+#define VHOST_USER_F_PROTOCOL_FEATURES  (1ull << 30)
+#define CRQA_VIRTIO_F_VERSION_1         (1ull << 32)
+
+#define CRQA_VRING_DESC_F_NEXT      1
+#define CRQA_VRING_DESC_F_WRITE     2
+#define CRQA_VRING_AVAIL_F_NO_INTERRUPT 1
+#define CRQA_VRING_MAX_SEGS         16      // descriptors of one request
+
+#pragma pack(push, 1)
+struct VhostUserMemRegion {
+    uint64_t guest_addr;
+    uint64_t size;
+    uint64_t user_addr;
+    uint64_t mmap_offset;
+};
+
+struct VhostUserMsg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;          // payload bytes
+    union {
+        uint64_t u64;
+        struct { uint32_t index, num; } state;
+        struct { uint32_t index, flags; uint64_t desc, used, avail, log; } addr;
+        struct {
+            uint32_t nregions, padding;
+            VhostUserMemRegion regions[VHOST_USER_MAX_REGIONS];
+        } mem;
+        uint8_t raw[512];
+    };
+};
+
+struct CrqaVringDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct CrqaVringUsedElem {
+    uint32_t id;
+    uint32_t len;
+};
+#pragma pack(pop)
+
+// Guest RAM as mapped from the front-end's memfds. Requests hold a
+// reference so a new memory table never unmaps buffers still being computed.
+struct CrqaVhostMem {
+    struct Region {
+        uint64_t gpa, size, uva;
+        uint8_t *host;
+        void *map;
+        size_t map_len;
+    };
+    std::vector<Region> regions;
+
+    ~CrqaVhostMem()
+    {
+        for (Region &r : regions)
+            munmap(r.map, r.map_len);
+    }
+
+    // Host pointer to [uva, uva + len) of the front-end's address space.
+    uint8_t *from_uva(uint64_t uva, uint64_t len) const
+    {
+        for (const Region &r : regions)
+            if (uva >= r.uva && uva - r.uva <= r.size && len <= r.size - (uva - r.uva))
+                return r.host + (uva - r.uva);
+        return nullptr;
+    }
+
+    // Append the host pieces of guest-physical [gpa, gpa + len).
+    bool map_gpa(uint64_t gpa, uint64_t len, std::vector<struct iovec> &iov) const
+    {
+        while (len) {
+            const Region *hit = nullptr;
+            for (const Region &r : regions)
+                if (gpa >= r.gpa && gpa - r.gpa < r.size) {
+                    hit = &r;
+                    break;
+                }
+            if (!hit)
+                return false;
+            uint64_t off = gpa - hit->gpa;
+            uint64_t n = hit->size - off < len ? hit->size - off : len;
+            iov.push_back({ hit->host + off, (size_t)n });
+            gpa += n;
+            len -= n;
+        }
+        return true;
+    }
+};
+
+// One request popped off the virtqueue.
+struct CrqaVirtqElem {
+    uint16_t head;
+    uint32_t generation;                    // of the ring it came from
+    bool bad;                               // malformed chain, complete it empty
+    std::vector<struct iovec> out;          // device-readable
+    std::vector<struct iovec> in;           // device-writable
+    std::shared_ptr<CrqaVhostMem> mem;
+
+    size_t out_bytes() const { return iov_bytes(out); }
+    size_t in_bytes() const { return iov_bytes(in); }
+
+    // Copy len bytes at byte offset off of the readable part.
+    bool read(size_t off, void *dst, size_t len) const { return copy(out, off, (uint8_t *)dst, len, false); }
+    // Copy len bytes to byte offset off of the writable part.
+    bool write(size_t off, const void *src, size_t len) { return copy(in, off, (uint8_t *)src, len, true); }
+
+    // Pointer to [off, off + len) of the readable part if it lies in one
+    // piece, so it can be used in place.
+    void *out_span(size_t off, size_t len) const
+    {
+        for (const struct iovec &v : out) {
+            if (off < v.iov_len)
+                return len <= v.iov_len - off ? (uint8_t *)v.iov_base + off : nullptr;
+            off -= v.iov_len;
+        }
+        return nullptr;
+    }
+
+private:
+    static size_t iov_bytes(const std::vector<struct iovec> &iov)
+    {
+        size_t n = 0;
+        for (const struct iovec &v : iov) n += v.iov_len;
+        return n;
+    }
+
+    static bool copy(const std::vector<struct iovec> &iov, size_t off, uint8_t *p, size_t len, bool to_iov)
+    {
+        for (const struct iovec &v : iov) {
+            if (!len) break;
+            if (off >= v.iov_len) {
+                off -= v.iov_len;
+                continue;
+            }
+            size_t n = v.iov_len - off < len ? v.iov_len - off : len;
+            if (to_iov) memcpy((uint8_t *)v.iov_base + off, p, n);
+            else memcpy(p, (uint8_t *)v.iov_base + off, n);
+            p += n;
+            len -= n;
+            off = 0;
+        }
+        return len == 0;
+    }
+};
+
+// One vhost-user connection with one virtqueue.
+class CrqaVhostDev
+{
+public:
+    const int id;
+
+    CrqaVhostDev(int sock, int n) : id(n), sock_fd(sock) {}
+
+    ~CrqaVhostDev()
+    {
+        close(sock_fd);
+        for (int i = 0; i < rx_nfds; i++) close(rx_fds[i]);
+        if (vq.kick_fd >= 0) close(vq.kick_fd);
+        if (vq.call_fd >= 0) close(vq.call_fd);
+    }
+
+    CrqaVhostDev(const CrqaVhostDev &) = delete;
+    CrqaVhostDev &operator=(const CrqaVhostDev &) = delete;
+
+    int fd() const { return sock_fd; }
+    int kick_fd() const { return vq.kick_fd; }
+
+    // The front-end is gone: drop whatever is still being computed.
+    void shutdown()
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        reset_ring();
+        mem.reset();
+    }
+
+    // Read what the socket has and handle every message it completes; a
+    // partial one waits for the next call. False once the front-end has hung
+    // up or broken the protocol; the connection is then unusable.
+    bool handle_input()
+    {
+        const size_t hdr = offsetof(VhostUserMsg, u64);
+        uint8_t skip[256];
+
+        while (true) {
+            if (rx_off >= hdr && rx_off - hdr == rx_msg.size) {
+                bool ok = dispatch(rx_msg, rx_fds, rx_nfds);
+                for (int i = 0; i < rx_nfds; i++)
+                    if (rx_fds[i] >= 0) close(rx_fds[i]);
+                rx_nfds = 0;
+                rx_off = 0;
+                if (!ok)
+                    return false;
+                continue;
+            }
+
+            // header, the payload we understand, then the rest skipped; never
+            // past this message, so the fds that come are its own
+            size_t keep = rx_msg.size < sizeof(rx_msg.raw) ? rx_msg.size : sizeof(rx_msg.raw);
+            uint8_t *dst = (uint8_t *)&rx_msg + rx_off;
+            size_t want;
+            if (rx_off < hdr) {
+                want = hdr - rx_off;
+            } else if (rx_off < hdr + keep) {
+                want = hdr + keep - rx_off;
+            } else {
+                dst = skip;
+                want = hdr + rx_msg.size - rx_off;
+                if (want > sizeof(skip)) want = sizeof(skip);
+            }
+
+            ssize_t n = recv_some(dst, want);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (n <= 0) {
+                if (n < 0)
+                    perror("[vhost] recvmsg");
+                return false;
+            }
+            rx_off += n;
+        }
+    }
+
+    // Consume the kick counter.
+    void ack_kick()
+    {
+        uint64_t v;
+        if (vq.kick_fd >= 0)
+            while (read(vq.kick_fd, &v, sizeof(v)) < 0 && errno == EINTR)
+                ;
+    }
+
+    // Take the next available request. False when there is none or the
+    // ring is not running.
+    bool pop(CrqaVirtqElem &e)
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (!running())
+            return false;
+        uint16_t avail_idx = __atomic_load_n(&vq.avail[1], __ATOMIC_ACQUIRE);
+        if (avail_idx == vq.last_avail)
+            return false;
+        if ((uint16_t)(avail_idx - vq.last_avail) > vq.num) {
+            fprintf(stderr, "[vhost] device #%d: avail index %u runs %u ahead, ring stopped\n",
+                    id, avail_idx, (uint16_t)(avail_idx - vq.last_avail));
+            vq.started = false;
+            return false;
+        }
+
+        uint16_t head = vq.avail[2 + vq.last_avail % vq.num];
+        vq.last_avail++;
+        vq.inflight.push_back(head);
+
+        e.head = head;
+        e.generation = vq.generation;
+        e.mem = mem;
+        e.out.clear();
+        e.in.clear();
+        e.bad = !walk_chain(head, e);
+        if (e.bad) {
+            e.out.clear();
+            e.in.clear();
+        }
+        return true;
+    }
+
+    // Hand a request back with 'len' bytes written. Requests of a ring that
+    // was reset or failed since they were popped are dropped: the guest has
+    // them back already, or is gone.
+    void push(const CrqaVirtqElem &e, uint32_t len)
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (e.generation != vq.generation || !vq.used)
+            return;
+        std::vector<uint16_t>::iterator it = std::find(vq.inflight.begin(), vq.inflight.end(), e.head);
+        if (it != vq.inflight.end()) {
+            *it = vq.inflight.back();
+            vq.inflight.pop_back();
+        }
+        CrqaVringUsedElem *ring = (CrqaVringUsedElem *)(vq.used + 2);
+        ring[vq.used_idx % vq.num] = { e.head, len };
+        vq.used_idx++;
+        __atomic_store_n(&vq.used[1], vq.used_idx, __ATOMIC_RELEASE);
+    }
+
+    // Interrupt the guest for what push() made visible, unless it asked
+    // not to be.
+    void notify()
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        notify_locked();
+    }
+
+private:
+    void notify_locked()
+    {
+        if (vq.call_fd < 0 || !vq.avail)
+            return;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&vq.avail[0], __ATOMIC_RELAXED) & CRQA_VRING_AVAIL_F_NO_INTERRUPT)
+            return;
+        uint64_t one = 1;
+        write(vq.call_fd, &one, sizeof(one));
+    }
+
+    struct Vring {
+        uint32_t num = 0;
+        uint64_t desc_uva = 0, avail_uva = 0, used_uva = 0;
+        CrqaVringDesc *desc = nullptr;
+        uint16_t *avail = nullptr;          // flags, idx, ring[num]
+        uint16_t *used = nullptr;           // flags, idx, then CrqaVringUsedElem[num]
+        uint16_t last_avail = 0;
+        uint16_t used_idx = 0;
+        int kick_fd = -1;
+        int call_fd = -1;
+        bool started = false;               // kick fd received, not stopped since
+        bool enabled = false;
+        uint32_t generation = 0;
+        std::vector<uint16_t> inflight;     // heads popped and not pushed yet
+    };
+
+    int sock_fd;
+    VhostUserMsg rx_msg;                    // message being received, I/O thread only
+    size_t rx_off = 0;
+    int rx_fds[VHOST_USER_MAX_REGIONS];
+    int rx_nfds = 0;
+    std::mutex mtx;
+    std::shared_ptr<CrqaVhostMem> mem;
+    Vring vq;
+    uint64_t features = 0;
+
+    bool running() const { return vq.started && vq.enabled && vq.desc && vq.avail && vq.used; }
+
+    // One recvmsg() of up to 'len' bytes, keeping the fds that come with it.
+    ssize_t recv_some(void *dst, size_t len)
+    {
+        char ctl[CMSG_SPACE(VHOST_USER_MAX_REGIONS * sizeof(int))];
+        struct iovec iov = { dst, len };
+        struct msghdr mh = {};
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = ctl;
+        mh.msg_controllen = sizeof(ctl);
+
+        ssize_t n = recvmsg(sock_fd, &mh, MSG_CMSG_CLOEXEC);
+        if (n < 0)
+            return n;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+                continue;
+            int k = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            int *p = (int *)CMSG_DATA(c);
+            for (int i = 0; i < k; i++) {
+                if (rx_nfds < VHOST_USER_MAX_REGIONS) rx_fds[rx_nfds++] = p[i];
+                else close(p[i]);
+            }
+        }
+        return n;
+    }
+
+    bool reply(VhostUserMsg &msg, size_t size)
+    {
+        msg.flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+        msg.size = (uint32_t)size;
+        size_t len = offsetof(VhostUserMsg, u64) + size;
+        return send(sock_fd, &msg, len, MSG_NOSIGNAL) == (ssize_t)len;
+    }
+
+    bool reply_u64(VhostUserMsg &msg, uint64_t v)
+    {
+        msg.u64 = v;
+        return reply(msg, sizeof(msg.u64));
+    }
+
+    bool dispatch(VhostUserMsg &msg, int *fds, int nfds)
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+
+        switch (msg.request) {
+        case VHOST_USER_GET_FEATURES:
+            return reply_u64(msg, CRQA_VIRTIO_F_VERSION_1 | VHOST_USER_F_PROTOCOL_FEATURES);
+        case VHOST_USER_SET_FEATURES:
+            features = msg.u64;
+            // without protocol features a ring runs as soon as it is kicked
+            if (!(features & VHOST_USER_F_PROTOCOL_FEATURES))
+                vq.enabled = true;
+            return true;
+        case VHOST_USER_GET_PROTOCOL_FEATURES:
+            return reply_u64(msg, 0);
+        case VHOST_USER_SET_PROTOCOL_FEATURES:
+        case VHOST_USER_SET_OWNER:
+        case VHOST_USER_SET_VRING_ERR:
+            return true;
+        case VHOST_USER_RESET_OWNER:
+            reset_ring();
+            mem.reset();
+            return true;
+        case VHOST_USER_GET_QUEUE_NUM:
+            return reply_u64(msg, 1);
+        case VHOST_USER_SET_MEM_TABLE:
+            return set_mem_table(msg, fds, nfds);
+        case VHOST_USER_SET_VRING_NUM:
+            if (!queue_ok(msg.state.index)) return false;
+            if (msg.state.num == 0 || msg.state.num > 32768 || (msg.state.num & (msg.state.num - 1)))
+                return false;
+            if (msg.state.num != vq.num)
+                fail_inflight();
+            vq.num = msg.state.num;
+            return true;
+        case VHOST_USER_SET_VRING_ADDR:
+            if (!queue_ok(msg.addr.index)) return false;
+            // a ring elsewhere: what the old one still owes is failed there
+            if (msg.addr.desc != vq.desc_uva || msg.addr.avail != vq.avail_uva ||
+                msg.addr.used != vq.used_uva)
+                fail_inflight();
+            vq.desc_uva = msg.addr.desc;
+            vq.avail_uva = msg.addr.avail;
+            vq.used_uva = msg.addr.used;
+            return map_ring();
+        case VHOST_USER_SET_VRING_BASE:
+            if (!queue_ok(msg.state.index)) return false;
+            vq.last_avail = (uint16_t)msg.state.num;
+            return true;
+        case VHOST_USER_GET_VRING_BASE:
+            if (!queue_ok(msg.state.index)) return false;
+            // stop the ring; requests still computing complete with an error
+            // now, as last_avail counts them as done
+            fail_inflight();
+            vq.started = false;
+            msg.state.num = vq.last_avail;
+            if (vq.kick_fd >= 0) {
+                close(vq.kick_fd);
+                vq.kick_fd = -1;
+            }
+            return reply(msg, sizeof(msg.state));
+        case VHOST_USER_SET_VRING_KICK:
+        case VHOST_USER_SET_VRING_CALL: {
+            if (!queue_ok(msg.u64 & 0xff)) return false;
+            int nfd = -1;
+            if (!(msg.u64 & VHOST_USER_VRING_NOFD)) {
+                if (nfds < 1) return false;
+                nfd = fds[0];
+                fds[0] = -1;
+            }
+            int &slot = msg.request == VHOST_USER_SET_VRING_KICK ? vq.kick_fd : vq.call_fd;
+            if (slot >= 0) close(slot);
+            slot = nfd;
+            if (msg.request == VHOST_USER_SET_VRING_KICK) {
+                // carry on from what the guest has seen completed
+                if (vq.used)
+                    vq.used_idx = __atomic_load_n(&vq.used[1], __ATOMIC_RELAXED);
+                vq.started = true;
+            }
+            return true;
+        }
+        case VHOST_USER_SET_VRING_ENABLE:
+            if (!queue_ok(msg.state.index)) return false;
+            vq.enabled = msg.state.num != 0;
+            return true;
+        default:
+            fprintf(stderr, "[vhost] device #%d: unsupported request %u\n", id, msg.request);
+            return false;
+        }
+    }
+
+    bool queue_ok(uint64_t index)
+    {
+        if (index == 0)
+            return true;
+        fprintf(stderr, "[vhost] device #%d: no virtqueue %lu\n", id, (unsigned long)index);
+        return false;
+    }
+
+    // Complete every request still being computed with nothing written, an
+    // error to the driver, and drop their results when they come. For ring
+    // changes the requests cannot outlive; without this the guest waits for
+    // them forever.
+    void fail_inflight()
+    {
+        if (vq.inflight.empty())
+            return;
+        fprintf(stderr, "[vhost] device #%d: %zu requests in flight failed by a ring change\n",
+                id, vq.inflight.size());
+        if (vq.used) {
+            CrqaVringUsedElem *ring = (CrqaVringUsedElem *)(vq.used + 2);
+            for (uint16_t head : vq.inflight)
+                ring[vq.used_idx++ % vq.num] = { head, 0 };
+            __atomic_store_n(&vq.used[1], vq.used_idx, __ATOMIC_RELEASE);
+            notify_locked();
+        }
+        vq.inflight.clear();
+        vq.generation++;
+    }
+
+    void reset_ring()
+    {
+        int kick = vq.kick_fd, call = vq.call_fd;
+        uint32_t gen = vq.generation + 1;
+        if (kick >= 0) close(kick);
+        if (call >= 0) close(call);
+        vq = Vring();
+        vq.generation = gen;
+    }
+
+    bool set_mem_table(const VhostUserMsg &msg, int *fds, int nfds)
+    {
+        uint32_t n = msg.mem.nregions;
+        if (n > VHOST_USER_MAX_REGIONS || (int)n != nfds)
+            return false;
+
+        std::shared_ptr<CrqaVhostMem> m = std::make_shared<CrqaVhostMem>();
+        for (uint32_t i = 0; i < n; i++) {
+            const VhostUserMemRegion &r = msg.mem.regions[i];
+            size_t len = r.size + r.mmap_offset;
+            void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+            if (p == MAP_FAILED) {
+                perror("[vhost] mmap guest memory");
+                return false;
+            }
+            m->regions.push_back({ r.guest_addr, r.size, r.user_addr,
+                                   (uint8_t *)p + r.mmap_offset, p, len });
+        }
+        // requests in flight keep the old mapping and complete into the
+        // ring as remapped here
+        mem = m;
+        return vq.desc_uva ? map_ring() : true;
+    }
+
+    bool map_ring()
+    {
+        if (!mem || !vq.num)
+            return false;
+        vq.desc = (CrqaVringDesc *)mem->from_uva(vq.desc_uva, (uint64_t)vq.num * sizeof(CrqaVringDesc));
+        vq.avail = (uint16_t *)mem->from_uva(vq.avail_uva, 4 + 2ull * vq.num);
+        vq.used = (uint16_t *)mem->from_uva(vq.used_uva, 4 + (uint64_t)vq.num * sizeof(CrqaVringUsedElem));
+        if (!vq.desc || !vq.avail || !vq.used) {
+            fprintf(stderr, "[vhost] device #%d: ring outside guest memory\n", id);
+            vq.desc = nullptr;
+            vq.avail = vq.used = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    // Readable descriptors first, then writable ones, as virtio requires.
+    bool walk_chain(uint16_t head, CrqaVirtqElem &e)
+    {
+        uint16_t i = head;
+        for (int n = 0; ; n++) {
+            if (i >= vq.num || n >= CRQA_VRING_MAX_SEGS)
+                return false;
+            CrqaVringDesc d = vq.desc[i];
+            bool wr = d.flags & CRQA_VRING_DESC_F_WRITE;
+            if (!wr && !e.in.empty())
+                return false;
+            if (!mem->map_gpa(d.addr, d.len, wr ? e.in : e.out))
+                return false;
+            if (!(d.flags & CRQA_VRING_DESC_F_NEXT))
+                return true;
+            i = d.next;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef CRQA_WORKSPACE_H
+#define CRQA_WORKSPACE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/mman.h>
+#include "crqa_bitmap.h"
+#include "crqa_stream.h"
+#include "crqa_tiled.h"
+
+// -----------------------------------------------------------------------------
+// Per-worker scratch arena for the CRQA hot path.
+//
+// One mapping holds everything a request needs: both embeddings in
+// structure-of-arrays layout, the current and previous rows of threshold
+// bits, the open-run start rows and the diagonal and vertical line-length
+// histograms. It is sized on the first request and only remapped when a
+// later request needs more, so the steady state does no allocation at all.
+// With huge pages enabled the arena is backed by MAP_HUGETLB when the system
+// has them, otherwise it asks for transparent huge pages.
+// -----------------------------------------------------------------------------
+class CrqaWorkspace
+{
+public:
+    // Views into the arena, valid until the next reserve() that grows it
+    double *e1;                // m * len, e1[k*len + i]
+    double *e2;                // m * len
+    uint64_t *row;             // one row of threshold bits
+    CrqaStreamBuffers stream;  // previous row, open runs, histograms
+    CrqaLineStream lines;
+    CrqaTiledEngine *tiled;    // optional, takes over sweeps of long windows
+
+    explicit CrqaWorkspace(bool huge_pages = false)
+        : e1(nullptr), e2(nullptr), row(nullptr), stream(), tiled(nullptr), huge(huge_pages),
+          base(nullptr), mapped(0), cap_m(0), cap_len(0) {}
+
+    ~CrqaWorkspace() { release(); }
+
+    CrqaWorkspace(const CrqaWorkspace &) = delete;
+    CrqaWorkspace &operator=(const CrqaWorkspace &) = delete;
+
+    // Make room for an m-dimensional embedding of len points. Returns false
+    // only if the arena could not be mapped.
+    bool reserve(int m, int len)
+    {
+        if (base && m <= cap_m && len <= cap_len)
+            return true;
+
+        int new_m = m > cap_m ? m : cap_m;
+        int new_len = len > cap_len ? len : cap_len;
+        size_t bytes = layout(new_m, new_len, nullptr);
+
+        release();
+        if (!map(bytes))
+            return false;
+        layout(new_m, new_len, (uint8_t *)base);
+        cap_m = new_m;
+        cap_len = new_len;
+        return true;
+    }
+
+    bool huge_pages() const { return huge; }
+    size_t bytes() const { return mapped; }
+
+private:
+    static const size_t ALIGN = 64;
+    static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+    bool huge;
+    void *base;
+    size_t mapped;
+    int cap_m, cap_len;
+
+    static size_t align_up(size_t v, size_t a) { return (v + a - 1) & ~(a - 1); }
+
+    // Carve the arena (or just measure it when mem is null).
+    size_t layout(int m, int len, uint8_t *mem)
+    {
+        size_t off = 0;
+        auto take = [&](size_t n) -> uint8_t * {
+            uint8_t *p = mem ? mem + off : nullptr;
+            off = align_up(off + n, ALIGN);
+            return p;
+        };
+
+        e1 = (double *)take(sizeof(double) * m * len);
+        e2 = (double *)take(sizeof(double) * m * len);
+        row = (uint64_t *)take(sizeof(uint64_t) * RecurrenceBitmap::words_for(len));
+        stream.diag_start = (int *)take(sizeof(int) * CrqaStreamBuffers::diag_count(len, len));
+        stream.col_start = (int *)take(sizeof(int) * len);
+        stream.prev = (uint64_t *)take(sizeof(uint64_t) * RecurrenceBitmap::words_for(len));
+        stream.d_hist = (uint64_t *)take(sizeof(uint64_t) * CrqaStreamBuffers::diag_hist_count(len, len));
+        stream.v_hist = (uint64_t *)take(sizeof(uint64_t) * CrqaStreamBuffers::vert_hist_count(len, len));
+        return off;
+    }
+
+    bool map(size_t bytes)
+    {
+        void *p = MAP_FAILED;
+        if (huge) {
+            size_t hbytes = align_up(bytes, HUGE_PAGE);
+#ifdef MAP_HUGETLB
+            p = mmap(nullptr, hbytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+            if (p == MAP_FAILED) {
+                p = mmap(nullptr, hbytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+                if (p != MAP_FAILED)
+                    madvise(p, hbytes, MADV_HUGEPAGE);
+#endif
+            }
+            bytes = hbytes;
+        } else {
+            p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        if (p == MAP_FAILED)
+            return false;
+        base = p;
+        mapped = bytes;
+        return true;
+    }
+
+    void release()
+    {
+        if (base)
+            munmap(base, mapped);
+        base = nullptr;
+        mapped = 0;
+        cap_m = cap_len = 0;
+    }
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/io.h>
+#include <linux/slab.h>
 #include "crqa_ioctl.h" 
 #define BAR0 0
 #define CDEV_NAME "cpcidev_pci"
@@ -27,6 +28,45 @@ static int major;
 static struct class *cpcidev_class;
 static struct device *cpcidev_device;
 
+/* R, opcode and both signals of a window in one go: the samples through
+ * the window region (RAM on the device side), then three register writes */
+static long cpcidev_submit_window(void __user *uarg)
+{
+    struct crqa_ioctl_window *w;
+    u64 raw;
+
+    w = kmalloc(sizeof(*w), GFP_KERNEL);
+    if (!w)
+        return -ENOMEM;
+    if (copy_from_user(w, uarg, sizeof(*w))) {
+        kfree(w);
+        return -EFAULT;
+    }
+
+    memcpy_toio(mmio_base + CRQA_WINDOW_OFFSET + CRQA_WINDOW_SIG1, w->sig1, sizeof(w->sig1));
+    memcpy_toio(mmio_base + CRQA_WINDOW_OFFSET + CRQA_WINDOW_SIG2, w->sig2, sizeof(w->sig2));
+    memcpy(&raw, &w->R, sizeof(double));
+    iowrite64(raw, mmio_base + CRQA_REG_R);
+    iowrite32(1, mmio_base + CRQA_REG_WINDOW_LOAD);
+    /* last: the device takes the window as ready with the opcode */
+    iowrite32(w->opcode, mmio_base + CRQA_REG_OPCODE);
+
+    kfree(w);
+    return 0;
+}
+
+static long cpcidev_get_results(void __user *uarg)
+{
+    struct crqa_ioctl_results res;
+
+    /* the read computes; the metrics are then in the window region */
+    ioread64(mmio_base + CRQA_REG_EPSILON);
+    memcpy_fromio(&res, mmio_base + CRQA_WINDOW_OFFSET + CRQA_WINDOW_RESULTS, sizeof(res));
+    if (copy_to_user(uarg, &res, sizeof(res)))
+        return -EFAULT;
+    return 0;
+}
+
 static long cpcidev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     int idx;
@@ -146,6 +186,12 @@ static long cpcidev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg
 //            pr_info("cpcidev: IOCTL_GET_ENTROPY value=%f\n", value);
             break;
 
+        case IOCTL_SUBMIT_WINDOW:
+            return cpcidev_submit_window(uarg);
+
+        case IOCTL_GET_RESULTS:
+            return cpcidev_get_results(uarg);
+
         default:
             pr_info("cpcidev: Unknown ioctl command: 0x%x\n", cmd);
             return -EINVAL;
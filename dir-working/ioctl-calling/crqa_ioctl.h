@@ -0,0 +1,83 @@
+/* crqa_ioctl.h - ioctls of /dev/cpcidev_pci and the BAR 0 registers behind
+ * them, shared by the guest driver (crqa_driver.c), programs (main.c) and
+ * the QEMU device (psd.c; copy it next to psd.c in the QEMU tree). */
+#ifndef CRQA_IOCTL_H
+#define CRQA_IOCTL_H
+
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#else
+#include <sys/ioctl.h>
+#include <stdint.h>
+#endif
+
+#define CRQA_IOCTL_SAMPLES   512
+
+/*
+ * A window, one register access at a time: R, every sample as an index and
+ * value pair, the opcode, then IOCTL_GET_EPSILON runs the computation and
+ * the other IOCTL_GET_* read back its metrics.
+ */
+#define CRQA_IOCTL_MAGIC     'c'
+#define IOCTL_SET_R                 _IOW(CRQA_IOCTL_MAGIC, 1, double)
+#define IOCTL_SET_SIG1_IDX          _IOW(CRQA_IOCTL_MAGIC, 2, int)
+#define IOCTL_SET_SIG1_VAL          _IOW(CRQA_IOCTL_MAGIC, 3, double)
+#define IOCTL_SET_SIG2_IDX          _IOW(CRQA_IOCTL_MAGIC, 4, int)
+#define IOCTL_SET_SIG2_VAL          _IOW(CRQA_IOCTL_MAGIC, 5, double)
+#define IOCTL_SET_OPCODE            _IOW(CRQA_IOCTL_MAGIC, 6, int)
+#define IOCTL_GET_EPSILON           _IOR(CRQA_IOCTL_MAGIC, 7, double)
+#define IOCTL_GET_RECURRENCE_RATE   _IOR(CRQA_IOCTL_MAGIC, 8, double)
+#define IOCTL_GET_DETERMINISM       _IOR(CRQA_IOCTL_MAGIC, 9, double)
+#define IOCTL_GET_LAMINARITY        _IOR(CRQA_IOCTL_MAGIC, 10, double)
+#define IOCTL_GET_TRAPPING_TIME     _IOR(CRQA_IOCTL_MAGIC, 11, double)
+#define IOCTL_GET_MAX_DIAG_LINE     _IOR(CRQA_IOCTL_MAGIC, 12, double)
+#define IOCTL_GET_DIVERGENCE        _IOR(CRQA_IOCTL_MAGIC, 13, double)
+#define IOCTL_GET_ENTROPY           _IOR(CRQA_IOCTL_MAGIC, 14, double)
+
+/*
+ * The same in two calls: IOCTL_SUBMIT_WINDOW loads R, the opcode and both
+ * signals; IOCTL_GET_RESULTS runs the computation and returns all eight
+ * metrics. The samples and results travel through the window region of the
+ * BAR, guest RAM on the device side, so a window costs a few register
+ * accesses instead of one per sample.
+ */
+struct crqa_ioctl_window {
+    double   R;
+    int32_t  opcode;
+    int32_t  reserved;
+    double   sig1[CRQA_IOCTL_SAMPLES];
+    double   sig2[CRQA_IOCTL_SAMPLES];
+};
+
+/* in the order the SystemC server sends them */
+struct crqa_ioctl_results {
+    double epsilon;
+    double recurrence_rate;
+    double determinism;
+    double laminarity;
+    double trapping_time;
+    double max_diag_line;
+    double divergence;
+    double entropy;
+};
+
+#define IOCTL_SUBMIT_WINDOW  _IOW(CRQA_IOCTL_MAGIC, 15, struct crqa_ioctl_window)
+#define IOCTL_GET_RESULTS    _IOR(CRQA_IOCTL_MAGIC, 16, struct crqa_ioctl_results)
+
+/* BAR 0 */
+#define CRQA_REG_R           0x08       /* double */
+#define CRQA_REG_SIG1_IDX    0x18
+#define CRQA_REG_SIG1_VAL    0x20       /* double */
+#define CRQA_REG_SIG2_IDX    0x28
+#define CRQA_REG_SIG2_VAL    0x30       /* double */
+#define CRQA_REG_OPCODE      0x38
+#define CRQA_REG_EPSILON     0x40       /* read: computes, then the other metrics */
+#define CRQA_REG_WINDOW_LOAD 0x80       /* write: take both signals from the window region */
+#define CRQA_WINDOW_OFFSET   0x1000     /* window region: */
+#define CRQA_WINDOW_SIG1     0x0        /*   sig1[512] */
+#define CRQA_WINDOW_SIG2     0x1000     /*   sig2[512] */
+#define CRQA_WINDOW_RESULTS  0x2000     /*   struct crqa_ioctl_results of the last computation */
+#define CRQA_WINDOW_SIZE     0x3000
+
+#endif
@@ -14,7 +14,7 @@
 #define SIG1_FILE "systemc_input_FP1_F7.txt"
 #define SIG2_FILE "systemc_input_F7_T7.txt"
 
-#define N_SAMPLES 512
+#define N_SAMPLES CRQA_IOCTL_SAMPLES
 #include <time.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -89,28 +89,13 @@ void print_signal_stats(const char *name, double *signal, int n) {
 }
 
 /* Function to reset device state between runs */
-void reset_device_state(int fd) {
+void reset_device_state(int fd, struct crqa_ioctl_window *w) {
     printf("Resetting device state...\n");
 
-    // Set R to 0
-    double zero_R = 0.0;
-    ioctl(fd, IOCTL_SET_R, &zero_R);
-
-    // Set all signal values to 0
-    int zero_idx = 0;
-    double zero_val = 0.0;
-
-    for (int i = 0; i < N_SAMPLES; i++) {
-        ioctl(fd, IOCTL_SET_SIG1_IDX, &zero_idx);
-        ioctl(fd, IOCTL_SET_SIG1_VAL, &zero_val);
-
-        ioctl(fd, IOCTL_SET_SIG2_IDX, &zero_idx);
-        ioctl(fd, IOCTL_SET_SIG2_VAL, &zero_val);
-    }
-
-    // Set opcode to 0
-    int zero_opcode = 0;
-    ioctl(fd, IOCTL_SET_OPCODE, &zero_opcode);
+    // R, both signals and the opcode to 0
+    memset(w, 0, sizeof(*w));
+    if (ioctl(fd, IOCTL_SUBMIT_WINDOW, w) < 0)
+        perror("IOCTL_SUBMIT_WINDOW");
 
     printf("Device reset complete\n");
 }
@@ -124,31 +109,17 @@ int main(void) {
 
     double R = 0.15;
     int opcode = 42;
-    double *sig1 = NULL;
-    double *sig2 = NULL;
-    uint32_t *sig1_idx = NULL;
-    uint32_t *sig2_idx = NULL;
-
-    /* Variables for all CRQA metrics */
-    double epsilon = 0.0;
-    double recurrence_rate = 0.0;
-    double determinism = 0.0;
-    double laminarity = 0.0;
-    double trapping_time = 0.0;
-    double max_diag_line = 0.0;
-    double divergence = 0.0;
-    double entropy = 0.0;
-
-    int i, ret;
-    double cpu_time_used;
-
-    /* Allocate signals and index arrays */
-    sig1 = malloc(N_SAMPLES * sizeof(double));
-    sig2 = malloc(N_SAMPLES * sizeof(double));
-    sig1_idx = malloc(N_SAMPLES * sizeof(uint32_t));
-    sig2_idx = malloc(N_SAMPLES * sizeof(uint32_t));
-
-    if (!sig1 || !sig2 || !sig1_idx || !sig2_idx) {
+    struct crqa_ioctl_window *win = NULL;
+    double *sig1, *sig2;
+
+    /* All CRQA metrics */
+    struct crqa_ioctl_results res;
+
+    int ret = -1;
+
+    /* The window: R, opcode and both signals, handed over in one ioctl */
+    win = malloc(sizeof(*win));
+    if (!win) {
         fprintf(stderr, "malloc failed\n");
         goto cleanup;
     }
@@ -156,10 +127,12 @@ int main(void) {
     printf("=== CRQA PCI Device Test ===\n");
 
     /* Reset device first to clear any previous state */
-    reset_device_state(fd);
+    reset_device_state(fd, win);
 
     /* Load signals from files */
     printf("Loading signals from files...\n");
+    sig1 = win->sig1;
+    sig2 = win->sig2;
     int loaded1 = load_signal_from_file(SIG1_FILE, sig1, N_SAMPLES);
     int loaded2 = load_signal_from_file(SIG2_FILE, sig2, N_SAMPLES);
 
@@ -168,108 +141,30 @@ int main(void) {
         goto cleanup;
     }
 
-    /* Initialize index arrays */
-    for (i = 0; i < N_SAMPLES; i++) {
-        sig1_idx[i] = i;
-        sig2_idx[i] = i;
-    }
-
     /* Print signal statistics */
     print_signal_stats("Signal 1", sig1, N_SAMPLES);
     print_signal_stats("Signal 2", sig2, N_SAMPLES);
 
-    /* Set R */
-    printf("\nSetting R = %f\n", R);
-    ret = ioctl(fd, IOCTL_SET_R, &R);
-    if (ret < 0) {
-        perror("IOCTL_SET_R");
-        goto cleanup;
-    }
+    printf("\nR = %f\n", R);
+    win->R = R;
+    win->opcode = opcode;
 
     uint64_t start = now_ns();
-    /* Fill SIG1 */
-//    printf("Filling SIG1 array...\n");
-    for (i = 0; i < N_SAMPLES; i++) {
-        ret = ioctl(fd, IOCTL_SET_SIG1_IDX, &sig1_idx[i]);
-        if (ret < 0) {
-            perror("IOCTL_SET_SIG1_IDX");
-            break;
-        }
-
-        ret = ioctl(fd, IOCTL_SET_SIG1_VAL, &sig1[i]);
-        if (ret < 0) {
-            perror("IOCTL_SET_SIG1_VAL");
-            break;
-        }
-    }
 
-    if (ret < 0) goto cleanup;
- //   printf("SIG1 array filled successfully.\n");
-
-    /* Fill SIG2 */
-  //  printf("Filling SIG2 array...\n");
-    for (i = 0; i < N_SAMPLES; i++) {
-        ret = ioctl(fd, IOCTL_SET_SIG2_IDX, &sig2_idx[i]);
-        if (ret < 0) {
-            perror("IOCTL_SET_SIG2_IDX");
-            break;
-        }
-
-        ret = ioctl(fd, IOCTL_SET_SIG2_VAL, &sig2[i]);
-        if (ret < 0) {
-            perror("IOCTL_SET_SIG2_VAL");
-            break;
-        }
-    }
-
-    if (ret < 0) goto cleanup;
-   // printf("SIG2 array filled successfully.\n");
-
-    /* Set opcode - this signals that data is ready */
-///    printf("Setting opcode = %d (data ready)\n", opcode);
-    ret = ioctl(fd, IOCTL_SET_OPCODE, &opcode);
+    /* Upload the window; the opcode signals that data is ready */
+    ret = ioctl(fd, IOCTL_SUBMIT_WINDOW, win);
     if (ret < 0) {
-        perror("IOCTL_SET_OPCODE");
+        perror("IOCTL_SUBMIT_WINDOW");
         goto cleanup;
     }
 
-  //  printf("\n=== Starting CRQA Computation ===\n");
-
-
-    /* Read epsilon (triggers computation) */
-//    printf("Triggering computation...\n");
-    ret = ioctl(fd, IOCTL_GET_EPSILON, &epsilon);
+    /* Run the computation and read all metrics */
+    ret = ioctl(fd, IOCTL_GET_RESULTS, &res);
     if (ret < 0) {
-        perror("IOCTL_GET_EPSILON");
+        perror("IOCTL_GET_RESULTS");
         goto cleanup;
     }
 
-    /* Small delay to ensure computation completes */
-// usleep(5000); // 100ms delay
-
-    /* Read all other metrics */
-    printf("Reading CRQA metrics...\n");
-    ret = ioctl(fd, IOCTL_GET_RECURRENCE_RATE, &recurrence_rate);
-    if (ret < 0) perror("IOCTL_GET_RECURRENCE_RATE");
-
-    ret = ioctl(fd, IOCTL_GET_DETERMINISM, &determinism);
-    if (ret < 0) perror("IOCTL_GET_DETERMINISM");
-
-    ret = ioctl(fd, IOCTL_GET_LAMINARITY, &laminarity);
-    if (ret < 0) perror("IOCTL_GET_LAMINARITY");
-
-    ret = ioctl(fd, IOCTL_GET_TRAPPING_TIME, &trapping_time);
-    if (ret < 0) perror("IOCTL_GET_TRAPPING_TIME");
-
-    ret = ioctl(fd, IOCTL_GET_MAX_DIAG_LINE, &max_diag_line);
-    if (ret < 0) perror("IOCTL_GET_MAX_DIAG_LINE");
-
-    ret = ioctl(fd, IOCTL_GET_DIVERGENCE, &divergence);
-    if (ret < 0) perror("IOCTL_GET_DIVERGENCE");
-
-    ret = ioctl(fd, IOCTL_GET_ENTROPY, &entropy);
-    if (ret < 0) perror("IOCTL_GET_ENTROPY");
-
     /* End timing */
     
 	uint64_t end = now_ns();
@@ -283,24 +178,21 @@ int main(void) {
 
     printf("  Signal files: %s, %s\n", SIG1_FILE, SIG2_FILE);
     printf("\nMetrics:\n");
-    printf("  Epsilon (DET):               %10.6f\n", epsilon);
-    printf("  Recurrence Rate (RR):        %10.6f\n", recurrence_rate);
-    printf("  Determinism (DET):           %10.6f\n", determinism);
-    printf("  Laminarity (LAM):            %10.6f\n", laminarity);
-    printf("  Trapping Time (TT):          %10.6f\n", trapping_time);
-    printf("  Max Diagonal Line (MAXL):    %10.6f\n", max_diag_line);
-    printf("  Divergence (DIV):            %10.6f\n", divergence);
-    printf("  Entropy (ENTR):              %10.6f\n", entropy);
+    printf("  Epsilon (DET):               %10.6f\n", res.epsilon);
+    printf("  Recurrence Rate (RR):        %10.6f\n", res.recurrence_rate);
+    printf("  Determinism (DET):           %10.6f\n", res.determinism);
+    printf("  Laminarity (LAM):            %10.6f\n", res.laminarity);
+    printf("  Trapping Time (TT):          %10.6f\n", res.trapping_time);
+    printf("  Max Diagonal Line (MAXL):    %10.6f\n", res.max_diag_line);
+    printf("  Divergence (DIV):            %10.6f\n", res.divergence);
+    printf("  Entropy (ENTR):              %10.6f\n", res.entropy);
     printf("\nPerformance:\n");
-    printf("  Total time: %.3f seconds\n", cpu_time_used);
+    printf("  Total time: %.3f seconds\n", elapsed_ms / 1e3);
     printf("============================\n");
 
 cleanup:
     /* Cleanup */
-    if (sig1) free(sig1);
-    if (sig2) free(sig2);
-    if (sig1_idx) free(sig1_idx);
-    if (sig2_idx) free(sig2_idx);
+    free(win);
 
     if (fd >= 0) close(fd);
 
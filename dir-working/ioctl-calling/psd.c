@@ -18,6 +18,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include "crqa_ioctl.h"
 
 #define SOCKET_PATH "/tmp/crqa_socket"
 #define N_SAMPLES 512
@@ -30,6 +31,8 @@ DECLARE_INSTANCE_CHECKER(CpcidevState, CPCIDEV, TYPE_PCI_CUSTOM_DEVICE)
 struct CpcidevState {
     PCIDevice pdev;
     MemoryRegion mmio;
+    MemoryRegion window_mr;     /* RAM at CRQA_WINDOW_OFFSET */
+    uint8_t *window;
 
     uint32_t opcode;
     double R;
@@ -158,6 +161,7 @@ static int request_crqa_from_systemc(CpcidevState *s)
     s->max_diag_line = resp.max_diag_line;
     s->divergence = resp.divergence;
     s->entropy = resp.entropy;
+    memcpy(s->window + CRQA_WINDOW_RESULTS, &resp, sizeof(resp));
 
 //    printf("CRQAPCI: Received response from SystemC:\n");
 //    printf("  epsilon (DET):         %f\n", s->epsilon);
@@ -200,6 +204,7 @@ static uint64_t cpcidev_mmio_read(void *opaque, hwaddr addr, unsigned size)
   //              printf("CRQAPCI: Computation successful, epsilon=%f\n", s->epsilon);
             } else {
                 val = 0;
+                memset(s->window + CRQA_WINDOW_RESULTS, 0, sizeof(struct sc_response));
                 printf("CRQAPCI: Computation failed\n");
             }
             return val;
@@ -325,6 +330,14 @@ static void cpcidev_mmio_write(void *opaque, hwaddr addr, uint64_t val, unsigned
             break;
         }
 
+        case CRQA_REG_WINDOW_LOAD: { /* both signals at once, from the window region */
+            memcpy(s->sig1, s->window + CRQA_WINDOW_SIG1, sizeof(s->sig1));
+            memcpy(s->sig2, s->window + CRQA_WINDOW_SIG2, sizeof(s->sig2));
+            s->sig1_filled = 1;
+            s->sig2_filled = 1;
+            break;
+        }
+
         case 0x38: { /* opcode */
             s->opcode = (uint32_t)val;
 //            printf("  -> opcode = %u\n", s->opcode);
@@ -389,6 +402,13 @@ static void pci_cpcidev_realize(PCIDevice *pdev, Error **errp)
 
     memory_region_init_io(&s->mmio, OBJECT(s), &cpcidev_mmio_ops, s,
                           "crqa-mmio", 2 * MiB);
+
+    /* plain RAM: the guest fills and reads it without exits */
+    s->window = g_malloc0(CRQA_WINDOW_SIZE);
+    memory_region_init_ram_ptr(&s->window_mr, OBJECT(s), "crqa-window",
+                               CRQA_WINDOW_SIZE, s->window);
+    memory_region_add_subregion(&s->mmio, CRQA_WINDOW_OFFSET, &s->window_mr);
+
     pci_register_bar(pdev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &s->mmio);
 }
 
@@ -398,6 +418,7 @@ static void pci_cpcidev_uninit(PCIDevice *pdev)
     if (s->sockfd >= 0) {
         close(s->sockfd);
     }
+    g_free(s->window);
 }
 
 static void cpcidev_class_init(ObjectClass *class, const void *data)
@@ -0,0 +1,167 @@
+/* crqa_bar.h - BAR 0 layout of the crqa-pci-dev, shared by the QEMU device
+ * (psd.c), the guest driver (crqa_driver.c) and guest programs (main.c).
+ * Copy it next to psd.c in the QEMU tree, like crqa_proto.h. */
+#ifndef CRQA_BAR_H
+#define CRQA_BAR_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define CRQA_BAR_SIZE        (2 * 1024 * 1024)
+
+/*
+ * Submission/completion queues.
+ *
+ * The guest owns CRQA_QUEUE_DEPTH data buffers, each holding the two signals
+ * of one window, and as many result slots. To queue a window it fills a free
+ * buffer, writes a crqa_sqe naming that buffer at SQ[tail % depth], and after
+ * a write fence stores the new tail in CRQA_REG_SQ_TAIL; one doorbell may
+ * cover many entries. The device consumes entries (CRQA_REG_SQ_HEAD) and
+ * posts a crqa_cqe per window to the completion ring, in completion order.
+ * The results are then in the result slot of the buffer named by the cqe,
+ * and the buffer is the guest's again. New completions are published together, by moving
+ * CRQA_REG_CQ_TAIL, with one MSI per batch; the guest acknowledges what it
+ * has read by writing CRQA_REG_CQ_HEAD.
+ *
+ * Coalescing: a ring's interrupt is held back until CRQA_REG_COAL_COUNT of
+ * its completions are unsignalled, or the oldest of them has waited
+ * CRQA_REG_COAL_USEC microseconds (guest clock); 0 or 1 for the count
+ * signals every batch, 0 for the time leaves the count alone to release it.
+ * Completions the guest has acknowledged through
+ * CRQA_REG_CQ_HEAD by then are not signalled at all.
+ *
+ * Busy polling: every cqe carries a phase bit, CRQA_CQE_PHASE set in the
+ * entries of even laps of the ring ((index / depth) even) and clear in odd
+ * ones, written after the rest of the entry and its results. An entry whose
+ * phase matches the lap of the guest's head is a new completion, so the
+ * guest can spin on the ring in memory without reading CQ_TAIL, and
+ * acknowledge (CQ_HEAD) up to the entries it saw that way.
+ *
+ * All indices are free running 32-bit counters; an entry lives at
+ * index % CRQA_QUEUE_DEPTH. The device never has more windows outstanding
+ * than there is room for in the completion rings together, so no ring can
+ * overflow.
+ *
+ * There are CRQA_NUM_CQ completion rings, each with its CQ_TAIL/CQ_HEAD pair
+ * (CRQA_REG_CQN_*) and, with MSI-X, its own vector: an entry's completion
+ * goes to ring 'cq' and raises vector 'cq', so the driver can steer
+ * completions to the hart that consumes them. Under plain MSI everything
+ * raises the one vector. Ring 0 is the only one a program driving the
+ * queues itself needs (cq = 0).
+ *
+ * DMA mode: an entry with CRQA_SQE_DMA set does not use the data buffer in
+ * the BAR. Its samples and results live in the DMA area, guest memory the
+ * driver allocates and registers as a bus address and length in
+ * CRQA_REG_DMA_BASE_LO/HI and CRQA_REG_DMA_SIZE. The device fetches sig1[512]
+ * from sig1_off and sig2[512] from sig2_off, and stores the 8 results at
+ * result_off, all offsets into the area, by bus-master DMA. A recording can
+ * thus sit in the area once, with overlapping windows pointing into it.
+ * 'buf' still names a slot of its own per outstanding window (returned in
+ * the cqe); that slot's data buffer is the device's scratch space until
+ * then. Programs map the area at CRQA_MMAP_DMA of the device file.
+ */
+#define CRQA_QUEUE_DEPTH     128
+#define CRQA_NUM_CQ          4
+
+/* registers, 32 bits wide */
+#define CRQA_REG_SQ_TAIL     0x2000     /* W: doorbell, R: last value written */
+#define CRQA_REG_SQ_HEAD     0x2004     /* R: entries consumed by the device */
+#define CRQA_REG_CQ_TAIL     0x2008     /* R: completions published (ring 0) */
+#define CRQA_REG_CQ_HEAD     0x200c     /* W/R: completions read by the guest (ring 0) */
+#define CRQA_REG_QUEUE_DEPTH 0x2010     /* R: CRQA_QUEUE_DEPTH */
+#define CRQA_REG_DMA_BASE_LO 0x2014     /* W/R: bus address of the DMA area */
+#define CRQA_REG_DMA_BASE_HI 0x2018
+#define CRQA_REG_DMA_SIZE    0x201c     /* W/R: its length, 0 if none */
+#define CRQA_REG_NUM_CQ      0x2020     /* R: CRQA_NUM_CQ */
+#define CRQA_REG_COAL_COUNT  0x2024     /* W/R: completions per interrupt, default 0 */
+#define CRQA_REG_COAL_USEC   0x2028     /* W/R: longest wait for it, default 0 */
+#define CRQA_REG_CQ_STRIDE   0x100      /* ring q's pair, q * stride from ring 0's */
+#define CRQA_REG_CQN_TAIL(q) (CRQA_REG_CQ_TAIL + (q) * CRQA_REG_CQ_STRIDE)
+#define CRQA_REG_CQN_HEAD(q) (CRQA_REG_CQ_HEAD + (q) * CRQA_REG_CQ_STRIDE)
+
+/* guest RAM inside the BAR: what the device writes (output), then what the
+ * guest writes (input), on separate pages */
+#define CRQA_CQ_OFFSET       0x14000
+#define CRQA_CQ_STRIDE       0x800      /* ring q at CRQA_CQ_OFFSET + q * stride */
+#define CRQA_RESULTS_OFFSET  0x16000    /* result slot per data buffer */
+#define CRQA_RESULT_SIZE     0x40       /* eps, rr, det, l, lmax, div, ent, lam */
+#define CRQA_OUTPUT_END      (CRQA_RESULTS_OFFSET + CRQA_QUEUE_DEPTH * CRQA_RESULT_SIZE)
+#define CRQA_SQ_OFFSET       0x18000
+#define CRQA_DATA_OFFSET     0x20000
+#define CRQA_DATA_STRIDE     0x2000     /* sig1[512], sig2[512] */
+#define CRQA_DATA_SIG1       0x0
+#define CRQA_DATA_SIG2       0x1000
+#define CRQA_DATA_END        (CRQA_DATA_OFFSET + CRQA_QUEUE_DEPTH * CRQA_DATA_STRIDE)
+
+/*
+ * mmap offsets of the device file (crqa_driver.c), each a window of its own
+ * with the memory type that suits it:
+ *   CRQA_MMAP_BAR     the BAR from 0, uncached: registers and the legacy
+ *                     job slot, every access reaches the device in order
+ *   CRQA_MMAP_INPUT   CRQA_SQ_OFFSET..CRQA_DATA_END, write-combining:
+ *                     entries and samples stream out in bursts
+ *   CRQA_MMAP_OUTPUT  CRQA_CQ_OFFSET..CRQA_OUTPUT_END, cached: completions
+ *                     and results are read at memory speed. This relies on
+ *                     the region being RAM in QEMU (coherent with the guest
+ *                     caches); real hardware would return results with the
+ *                     DMA mode instead.
+ *   CRQA_MMAP_DMA     the DMA area, cached
+ * Offsets within a window are relative to its start.
+ *
+ * Ordering, with the RISC-V fences (x86: sfence / lfence):
+ *   1. fill the data buffer and the entry through CRQA_MMAP_INPUT (or the
+ *      DMA area), then  fence ow,ow  so every one of those writes, combined
+ *      or not, is visible before
+ *   2. the CRQA_REG_SQ_TAIL store through CRQA_MMAP_BAR.
+ *   3. read CRQA_REG_CQ_TAIL through CRQA_MMAP_BAR (or learn of it from the
+ *      MSI), then  fence ir,ir  before
+ *   4. reading cqes and results through CRQA_MMAP_OUTPUT (or the DMA area),
+ *      then  fence ir,ow  so they are read before
+ *   5. the CRQA_REG_CQ_HEAD store that lets the device reuse the slots.
+ */
+#define CRQA_MMAP_BAR        0x00000000
+#define CRQA_MMAP_INPUT      0x10000000
+#define CRQA_MMAP_OUTPUT     0x20000000
+#define CRQA_MMAP_DMA        0x40000000
+#define CRQA_REGS_SIZE       0x10000    /* of CRQA_MMAP_BAR, up to the legacy job slot */
+#define CRQA_LEGACY_DONE_TAG 0x12058    /* u64: id of the last legacy job done */
+
+/* cqe status besides the CRQA_STATUS_* codes of crqa_proto.h */
+#define CRQA_CQE_IO_ERROR    0x100      /* the device could not reach the server */
+#define CRQA_CQE_DMA_ERROR   0x101      /* offsets outside the DMA area, or DMA failed */
+
+/* crqa_cqe flags */
+#define CRQA_CQE_PHASE       0x1
+
+/* crqa_sqe flags */
+#define CRQA_SQE_DMA         0x1        /* samples and results in the DMA area */
+
+/* Zero for m, tau, min_diag or min_vert selects the server default. */
+struct crqa_sqe {
+    uint64_t id;            /* returned in the cqe */
+    double   R;
+    uint32_t opcode;
+    uint16_t buf;           /* slot, and unless CRQA_SQE_DMA the data buffer */
+    uint16_t flags;         /* CRQA_SQE_* */
+    uint16_t m;
+    uint16_t tau;
+    uint16_t min_diag;
+    uint16_t min_vert;
+    uint64_t sig1_off;      /* CRQA_SQE_DMA: offsets into the DMA area */
+    uint64_t sig2_off;
+    uint64_t result_off;
+    uint16_t cq;            /* completion ring, < CRQA_NUM_CQ */
+    uint16_t reserved[3];
+} __attribute__((packed));
+
+struct crqa_cqe {
+    uint64_t id;
+    uint16_t buf;
+    uint16_t flags;         /* CRQA_CQE_PHASE */
+    uint32_t status;
+} __attribute__((packed));
+
+#endif
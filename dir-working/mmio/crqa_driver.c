@@ -2,52 +2,378 @@
 #include <linux/pci.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include <linux/delay.h>
 #include <linux/io.h>
 #include <linux/mm.h>
 #include <linux/device.h>
 #include <linux/poll.h>
 #include <linux/wait.h>
+#include <linux/dma-mapping.h>
+#include <linux/moduleparam.h>
+#include <linux/eventfd.h>
+#include <linux/idr.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/io-64-nonatomic-lo-hi.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/sched/clock.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include "crqa_pci.h"
 
 #define CDEV_NAME "cpcidev_pci"
 #define QEMU_VENDOR_ID 0x1234
 #define QEMU_DEVICE_ID 0xdada
 
-static DECLARE_WAIT_QUEUE_HEAD(crqa_waitqueue);
-static atomic_t data_ready = ATOMIC_INIT(0);
+static unsigned int dma_size = 4 << 20;
+module_param(dma_size, uint, 0444);
+MODULE_PARM_DESC(dma_size, "Bytes of coherent memory for DMA-mode windows, 0 for none (default 4 MiB)");
 
+/* "spread": the kernel spreads the completion vectors over the CPUs and
+ * keeps them there; "none": left to irqbalance; otherwise a CPU list, ring
+ * q's vector going to its q-th CPU (wrapping around). */
+static char *irq_affinity = "spread";
+module_param(irq_affinity, charp, 0444);
+MODULE_PARM_DESC(irq_affinity, "Completion vector placement: spread, none or a CPU list (default spread)");
 
-static struct pci_dev *pdev_global;
+static unsigned int coal_count, coal_usec;
+module_param(coal_count, uint, 0444);
+MODULE_PARM_DESC(coal_count, "Completions per interrupt, 0 for every batch; needs coal_usec (default 0)");
+module_param(coal_usec, uint, 0444);
+MODULE_PARM_DESC(coal_usec, "Longest a completion waits for its coalesced interrupt, in us (default 0)");
+
+/* Hybrid polling: CRQA_IOC_WAIT and poll() spin this long on the rings in
+ * memory before sleeping for the interrupt. */
+static unsigned int poll_usec;
+module_param(poll_usec, uint, 0644);
+MODULE_PARM_DESC(poll_usec, "Busy-poll for completions this long before sleeping, in us (default 0)");
+
+#define CRQA_SIG_BYTES (CRQA_PROTO_SAMPLES * sizeof(double))
+#define CRQA_TAKE_BACK_MS 1000	/* longest a raw user's close waits for its windows */
+
+static DECLARE_WAIT_QUEUE_HEAD(crqa_waitqueue);	/* legacy jobs, raw queue users, any device */
+static DECLARE_WAIT_QUEUE_HEAD(crqa_room);	/* submitters waiting for a data buffer, any device */
+
+/* one open file; see crqa_pci.h */
+struct crqa_file {
+	spinlock_t lock;		/* the done ring, counters and eventfd */
+	wait_queue_head_t wq;
+	struct mutex submit_mutex;	/* one CRQA_IOC_SUBMIT at a time, for bounce */
+	struct mutex wait_mutex;	/* one CRQA_IOC_WAIT at a time */
+	struct crqa_dev *dev;		/* its device; for the group, read() and mmap's */
+	struct list_head node;		/* on dev->files */
+	struct address_space *mapping;	/* what its mmap()s are in */
+	bool group;			/* submits to every device */
+	unsigned int done_head, done_count, depth;
+	unsigned int inflight;
+	u64 seq;			/* last sequence number given */
+	u64 legacy_seen;
+	struct eventfd_ctx *ev;
+	bool closed;			/* freed by the last completion */
+	struct rcu_head rcu;		/* for that free, made under cd->lock */
+	double bounce[2 * CRQA_PROTO_SAMPLES];	/* samples on their way to the BAR */
+	struct crqa_pci_done done[];	/* completions not waited for, 'depth' of them */
+};
+
+/* one crqa-pci-dev instance, /dev/crqa<minor>. Its open files keep it
+ * around after crqa_remove(), 'removed' and with nothing mapped. */
+struct crqa_dev {
+	struct kref ref;		/* the crqa_devs[] entry, open files, crqa_pick() */
+	struct pci_dev *pdev;
+	int minor;
+	bool removed;			/* set with both io_rwsem and lock held */
+	struct rw_semaphore io_rwsem;	/* read: BAR writes outside 'lock', and mmap() */
+	struct mutex files_mutex;
+	struct list_head files;		/* open files, for their mappings */
+	void __iomem *bar;		/* registers and the output side */
+	void __iomem *input;		/* CRQA_SQ_OFFSET..CRQA_DATA_END, write-combining */
+	spinlock_t lock;		/* queue state below */
+	struct mutex sq_mutex;		/* submitters, writing the SQ in turn */
+	u64 legacy_seq;			/* legacy jobs done */
+	u64 legacy_tag;			/* CRQA_LEGACY_DONE_TAG when legacy_seq last moved */
+
+	/* Completion rings, one per vector; ring 0 with a single MSI. */
+	struct crqa_cq {
+		struct crqa_dev *cd;
+		u32 head;		/* next cqe to reap */
+	} cqs[CRQA_NUM_CQ];
+	unsigned int n_cq, n_irq;
+	u8 __percpu *cpu_cq;		/* ring whose vector is on this CPU */
+
+	/* The queues, when driven for CRQA_IOC_SUBMIT (raw_owner NULL). */
+	u32 sq_tail, sq_rung;		/* sq_rung: tail last written to the doorbell */
+	struct {
+		struct crqa_file *owner;	/* NULL if free */
+		u64 id, seq;
+		bool stale;			/* a closed raw user's window, until its cqe */
+	} slots[CRQA_QUEUE_DEPTH];
+	u16 free_slots[CRQA_QUEUE_DEPTH];
+	unsigned int n_free, jobs_inflight, n_stale;
+	struct crqa_file *raw_owner;	/* file driving the queues from user space */
+	u32 raw_sq, raw_cq[CRQA_NUM_CQ];	/* the queues when it took them */
+	void *dma_area;			/* DMA area, see crqa_bar.h */
+	dma_addr_t dma_handle;
+	size_t dma_len;
+	struct cdev *cdev;		/* apart: open inodes may outlive 'cd' */
+	struct device *device;
+};
+
+/* Instances by minor, under RCU; only probe and remove change it, each its
+ * own entry. The group node (CDEV_NAME) has the minor after the last
+ * instance's. */
+static struct crqa_dev __rcu *crqa_devs[CRQA_PCI_MAX_DEVS];
+static DEFINE_IDA(crqa_ida);
 static dev_t dev_num;
 static struct class *dev_class;
-static struct device *dev_device;
-static struct cdev cdev;
+static struct device *group_device;
+static struct cdev group_cdev;
 
-static int crqa_mmap(struct file *filp, struct vm_area_struct *vma)
+/* The devices 'cf' submits to: its own, or every instance for the group.
+ * Under rcu_read_lock(). */
+#define for_each_file_dev(cd, cf, i)						\
+	for ((i) = 0; (i) < CRQA_PCI_MAX_DEVS; (i)++)				\
+		if (!((cd) = (cf)->group ? rcu_dereference(crqa_devs[i]) :	\
+				(i) ? NULL : (cf)->dev)) {} else
+
+static void crqa_dev_free(struct kref *ref)
+{
+	struct crqa_dev *cd = container_of(ref, struct crqa_dev, ref);
+
+	free_percpu(cd->cpu_cq);
+	kfree(cd);
+}
+
+static void crqa_dev_put(struct crqa_dev *cd)
+{
+	kref_put(&cd->ref, crqa_dev_free);
+}
+
+/* Under rcu_read_lock(). */
+static struct crqa_dev *crqa_first_dev(void)
 {
-	resource_size_t start = pci_resource_start(pdev_global, 0);
+	struct crqa_dev *cd;
+	unsigned int i;
+
+	for (i = 0; i < CRQA_PCI_MAX_DEVS; i++) {
+		cd = rcu_dereference(crqa_devs[i]);
+		if (cd)
+			return cd;
+	}
+	return NULL;
+}
+
+static int crqa_map(struct crqa_file *cf, struct crqa_dev *cd, struct vm_area_struct *vma)
+{
+	resource_size_t start = pci_resource_start(cd->pdev, 0);
 	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
 	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long bar_off, len;
+	pgprot_t prot;
+
+	if (offset >= CRQA_MMAP_DMA) {
+		if (!cd->dma_area)
+			return -ENODEV;
+		vma->vm_pgoff -= CRQA_MMAP_DMA >> PAGE_SHIFT;
+		return dma_mmap_coherent(&cd->pdev->dev, vma, cd->dma_area, cd->dma_handle,
+					 cd->dma_len);
+	}
+
+	if (offset >= CRQA_MMAP_OUTPUT) {
+		/* completions and results, only ever read: cached */
+		offset -= CRQA_MMAP_OUTPUT;
+		bar_off = CRQA_CQ_OFFSET;
+		len = PAGE_ALIGN(CRQA_OUTPUT_END) - CRQA_CQ_OFFSET;
+		prot = vma->vm_page_prot;
+	} else if (offset >= CRQA_MMAP_INPUT) {
+		/* entries and samples, only ever written: write-combining */
+		offset -= CRQA_MMAP_INPUT;
+		bar_off = CRQA_SQ_OFFSET;
+		len = CRQA_DATA_END - CRQA_SQ_OFFSET;
+		prot = pgprot_writecombine(vma->vm_page_prot);
+	} else {
+		bar_off = 0;
+		len = CRQA_BAR_SIZE;
+		prot = pgprot_noncached(vma->vm_page_prot);
+	}
+	if (offset > len || size > len - offset)
+		return -EINVAL;
 
-	//set flag that data are not-ready. new mmap , new segment to process.
-	atomic_set(&data_ready, 0);
+	if (bar_off) {
+		/* the queues are this file's from now on */
+		unsigned int q;
+		int ret = 0;
 
+		spin_lock_irq(&cd->lock);
+		if (cd->raw_owner != cf && (cd->raw_owner || cd->jobs_inflight || cd->n_stale)) {
+			ret = -EBUSY;
+		} else if (!cd->raw_owner) {
+			/* all reaped: its windows are those past here */
+			cd->raw_sq = cd->sq_tail;
+			for (q = 0; q < CRQA_NUM_CQ; q++)
+				cd->raw_cq[q] = cd->cqs[q].head;
+			cd->raw_owner = cf;
+		}
+		spin_unlock_irq(&cd->lock);
+		if (ret)
+			return ret;
+	}
 
-	if (offset + size > 2*1024*1024) return -EINVAL;
+	vma->vm_page_prot = prot;
+	return remap_pfn_range(vma, vma->vm_start, (start + bar_off + offset) >> PAGE_SHIFT,
+			       size, vma->vm_page_prot);
+}
 
-	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+/* mmap windows, see crqa_bar.h. None once the device is removed, and
+ * crqa_remove() zaps those made before. */
+static int crqa_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct crqa_file *cf = filp->private_data;
+	struct crqa_dev *cd = cf->dev;
+	int ret = -ENODEV;
 
-	return remap_pfn_range(vma, vma->vm_start, (start + offset) >> PAGE_SHIFT, size, vma->vm_page_prot);
+	down_read(&cd->io_rwsem);
+	if (!cd->removed)
+		ret = crqa_map(cf, cd, vma);
+	up_read(&cd->io_rwsem);
+	return ret;
 }
 
-/* MSI interrupt handler */
+static void crqa_signal(struct eventfd_ctx *ev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	eventfd_signal(ev);
+#else
+	eventfd_signal(ev, 1);
+#endif
+}
+
+static void __iomem *crqa_cqe_addr(struct crqa_dev *cd, unsigned int q, u32 idx)
+{
+	return cd->bar + CRQA_CQ_OFFSET + q * CRQA_CQ_STRIDE +
+	       (idx % CRQA_QUEUE_DEPTH) * sizeof(struct crqa_cqe);
+}
+
+/* Whether cqe 'idx' of ring 'q' is a new completion: its phase is that of
+ * the lap 'idx' is on (crqa_bar.h). Memory, not a register: no VM exit. */
+static bool crqa_cqe_new(struct crqa_dev *cd, unsigned int q, u32 idx)
+{
+	u16 flags = readw(crqa_cqe_addr(cd, q, idx) + offsetof(struct crqa_cqe, flags));
+
+	return (flags & CRQA_CQE_PHASE) == ((idx / CRQA_QUEUE_DEPTH) & 1 ? 0 : CRQA_CQE_PHASE);
+}
+
+/* Data buffer 'buf' is done: free it and hand its completion to the file
+ * that submitted it, without results once the device is removed. Called
+ * with cd->lock held; the file's own lock nests inside it. A closed file
+ * goes with its last completion, by kvfree_rcu(): the group's done ring
+ * can be vmalloc'ed, and vfree() may sleep. */
+static void crqa_complete(struct crqa_dev *cd, unsigned int buf, u32 status)
+{
+	struct crqa_file *cf = cd->slots[buf].owner;
+	struct crqa_pci_done *d;
+	bool free_cf;
+
+	cd->slots[buf].owner = NULL;
+	cd->free_slots[cd->n_free++] = buf;
+	cd->jobs_inflight--;
+
+	spin_lock(&cf->lock);
+	cf->inflight--;
+	if (cf->closed) {
+		free_cf = !cf->inflight;
+		spin_unlock(&cf->lock);
+		if (free_cf)
+			kvfree_rcu(cf, rcu);
+		return;
+	}
+
+	d = &cf->done[(cf->done_head + cf->done_count) % cf->depth];
+	d->id = cd->slots[buf].id;
+	d->seq = cd->slots[buf].seq;
+	d->status = status;
+	d->reserved = 0;
+	if (cd->removed)
+		memset(d->res, 0, sizeof(d->res));
+	else
+		memcpy_fromio(d->res, cd->bar + CRQA_RESULTS_OFFSET + buf * CRQA_RESULT_SIZE,
+			      sizeof(d->res));
+	cf->done_count++;
+	if (cf->ev)
+		crqa_signal(cf->ev);
+	spin_unlock(&cf->lock);
+	wake_up_interruptible(&cf->wq);
+}
+
+/* Hand new completions of ring 'q' to the files that submitted them.
+ * Called with cd->lock held. */
+static void crqa_reap(struct crqa_dev *cd, unsigned int q)
+{
+	struct crqa_cq *cq = &cd->cqs[q];
+	u32 first = cq->head;
+
+	while (crqa_cqe_new(cd, q, cq->head)) {
+		struct crqa_cqe cqe;
+
+		rmb();		/* the phase before the rest of the entry */
+		memcpy_fromio(&cqe, crqa_cqe_addr(cd, q, cq->head), sizeof(cqe));
+		cq->head++;
+		if (cqe.buf >= CRQA_QUEUE_DEPTH)
+			continue;
+		if (cd->slots[cqe.buf].stale) {
+			/* its buffer is ours again */
+			cd->slots[cqe.buf].stale = false;
+			cd->n_stale--;
+			cd->free_slots[cd->n_free++] = cqe.buf;
+			continue;
+		}
+		/* left over from a raw user that went away */
+		if (!cd->slots[cqe.buf].owner)
+			continue;
+		crqa_complete(cd, cqe.buf, cqe.status);
+	}
+	if (cq->head == first)
+		return;
+	writel(cq->head, cd->bar + CRQA_REG_CQN_HEAD(q));
+	wake_up_interruptible(&crqa_room);
+}
+
+/* What ring 'q' has for us, and on ring 0 a legacy job done. Called with
+ * cd->lock held, for the interrupt or a busy poll. */
+static void crqa_check_ring(struct crqa_dev *cd, unsigned int q)
+{
+	if (cd->removed)
+		return;
+	if (q == 0) {
+		u64 tag = readq(cd->bar + CRQA_LEGACY_DONE_TAG);
+
+		if (tag != cd->legacy_tag) {
+			cd->legacy_tag = tag;
+			cd->legacy_seq++;
+		}
+	}
+	if (!cd->raw_owner)
+		crqa_reap(cd, q);
+}
+
+/* MSI/MSI-X interrupt handler, dev_id is the ring of the vector */
 static irqreturn_t crqa_irq_handler(int irq, void *dev_id)
 {
-	struct cdev *dev = dev_id;
-	pr_info("PSD MSI interrupt received on IRQ %d\n", irq);
+	struct crqa_cq *cq = dev_id;
+	struct crqa_dev *cd = cq->cd;
+	unsigned long flags;
 
+	pr_debug("PSD MSI interrupt received on IRQ %d\n", irq);
 
-	//set flag that data are ready now
-	atomic_set(&data_ready, 1);
+	spin_lock_irqsave(&cd->lock, flags);
+	crqa_check_ring(cd, cq - cd->cqs);
+	spin_unlock_irqrestore(&cd->lock, flags);
 
 	//wake up any waiting process on those
 	wake_up_interruptible(&crqa_waitqueue);
@@ -55,39 +381,764 @@ static irqreturn_t crqa_irq_handler(int irq, void *dev_id)
 	return IRQ_HANDLED;
 }
 
-static unsigned int crqa_poll(struct file *filp, poll_table *wait)
+/* /dev/crqa<minor> is that instance; the group node has a done ring deep
+ * enough for all of them. */
+static int crqa_open(struct inode *inode, struct file *filp)
 {
-	unsigned int mask = 0;
+	bool group = inode->i_cdev == &group_cdev;
+	unsigned int depth = group ? CRQA_PCI_MAX_DEVS * CRQA_QUEUE_DEPTH : CRQA_QUEUE_DEPTH;
+	struct crqa_dev *cd;
+	struct crqa_file *cf;
 
-	/* Register wait queue */
-	poll_wait(filp, &crqa_waitqueue, wait);
+	rcu_read_lock();
+	cd = group ? crqa_first_dev() : rcu_dereference(crqa_devs[iminor(inode)]);
+	if (cd)
+		kref_get(&cd->ref);
+	rcu_read_unlock();
+	if (!cd)
+		return -ENODEV;
+	cf = kvzalloc(struct_size(cf, done, depth), GFP_KERNEL);
+	if (!cf) {
+		crqa_dev_put(cd);
+		return -ENOMEM;
+	}
+	spin_lock_init(&cf->lock);
+	init_waitqueue_head(&cf->wq);
+	mutex_init(&cf->submit_mutex);
+	mutex_init(&cf->wait_mutex);
+	cf->dev = cd;
+	cf->group = group;
+	cf->depth = depth;
+	cf->legacy_seen = READ_ONCE(cd->legacy_seq);
+	cf->mapping = filp->f_mapping;
+	mutex_lock(&cd->files_mutex);
+	list_add(&cf->node, &cd->files);
+	mutex_unlock(&cd->files_mutex);
+	filp->private_data = cf;
+	return 0;
+}
+
+/* Windows the raw user queued that have not completed: its entries less
+ * the cqes reaped since it took the queues. Called with cd->lock held. */
+static u32 crqa_raw_left(struct crqa_dev *cd)
+{
+	u32 left = cd->sq_tail - cd->raw_sq;
+	unsigned int q;
+
+	for (q = 0; q < CRQA_NUM_CQ; q++)
+		left -= cd->cqs[q].head - cd->raw_cq[q];
+	return left;
+}
+
+/* Up to 'left' data buffers still named by the raw user's entries (the
+ * last CRQA_QUEUE_DEPTH of them) without a cqe since: out of free_slots
+ * until crqa_reap() sees their cqes. Called with cd->lock held. */
+static void crqa_raw_retire(struct crqa_dev *cd, u32 left)
+{
+	s16 out[CRQA_QUEUE_DEPTH] = {};
+	unsigned int q, b;
+	u32 i, n;
+
+	n = min_t(u32, cd->sq_tail - cd->raw_sq, CRQA_QUEUE_DEPTH);
+	for (i = cd->sq_tail - n; i != cd->sq_tail; i++) {
+		b = readw(cd->bar + CRQA_SQ_OFFSET + (i % CRQA_QUEUE_DEPTH) * sizeof(struct crqa_sqe) +
+			  offsetof(struct crqa_sqe, buf));
+		if (b < CRQA_QUEUE_DEPTH)
+			out[b]++;
+	}
+	for (q = 0; q < CRQA_NUM_CQ; q++) {
+		n = min_t(u32, cd->cqs[q].head - cd->raw_cq[q], CRQA_QUEUE_DEPTH);
+		for (i = cd->cqs[q].head - n; i != cd->cqs[q].head; i++) {
+			b = readw(crqa_cqe_addr(cd, q, i) + offsetof(struct crqa_cqe, buf));
+			if (b < CRQA_QUEUE_DEPTH)
+				out[b]--;
+		}
+	}
+
+	/* every buffer was free while the raw user had the queues */
+	cd->n_free = 0;
+	for (b = CRQA_QUEUE_DEPTH; b-- > 0;) {
+		if (out[b] > 0 && cd->n_stale < left) {
+			cd->slots[b].stale = true;
+			cd->n_stale++;
+		} else {
+			cd->free_slots[cd->n_free++] = b;
+		}
+	}
+}
+
+/* Take the queues back where the closing raw user left them. Its windows
+ * still out complete to no one, but their data buffers must not be handed
+ * out under the device: wait a while for the entries to be consumed and
+ * their cqes to come in (discarding them), then retire the buffers of
+ * whatever is left. Submitters get EBUSY meanwhile. */
+static void crqa_take_back(struct crqa_dev *cd)
+{
+	unsigned long end = jiffies + msecs_to_jiffies(CRQA_TAKE_BACK_MS);
+	unsigned int q;
+	u32 left = 0;
+
+	spin_lock_irq(&cd->lock);
+	if (!cd->removed) {
+		cd->sq_tail = cd->sq_rung = readl(cd->bar + CRQA_REG_SQ_TAIL);
+		for (q = 0; q < CRQA_NUM_CQ; q++)
+			cd->cqs[q].head = readl(cd->bar + CRQA_REG_CQN_HEAD(q));
+	}
+	while (!cd->removed) {
+		for (q = 0; q < CRQA_NUM_CQ; q++)
+			crqa_reap(cd, q);
+		left = crqa_raw_left(cd);
+		if (!left || !time_before(jiffies, end))
+			break;
+		spin_unlock_irq(&cd->lock);
+		msleep(1);
+		spin_lock_irq(&cd->lock);
+	}
+	if (left && !cd->removed) {
+		dev_warn(&cd->pdev->dev, "%u windows of a closed raw user still out\n", left);
+		crqa_raw_retire(cd, left);
+	}
+	cd->raw_owner = NULL;
+	spin_unlock_irq(&cd->lock);
+	wake_up_interruptible(&crqa_room);
+}
+
+static int crqa_release(struct inode *inode, struct file *filp)
+{
+	struct crqa_file *cf = filp->private_data;
+	struct crqa_dev *cd = cf->dev;
+	struct eventfd_ctx *ev;
+	bool free_now;
+
+	/* only this file sets or clears it */
+	if (READ_ONCE(cd->raw_owner) == cf)
+		crqa_take_back(cd);
+
+	mutex_lock(&cd->files_mutex);
+	list_del(&cf->node);
+	mutex_unlock(&cd->files_mutex);
+
+	spin_lock_irq(&cf->lock);
+	ev = cf->ev;
+	cf->ev = NULL;
+	cf->closed = true;
+	free_now = !cf->inflight;
+	spin_unlock_irq(&cf->lock);
+
+	if (ev)
+		eventfd_ctx_put(ev);
+	if (free_now)
+		kvfree(cf);
+	crqa_dev_put(cd);
+	return 0;
+}
+
+/* Where the next job of 'cf' goes: its device, or for the group the
+ * instance with the fewest jobs in flight, which also has the most free
+ * data buffers. Instances a raw user drives are left out. Returned with a
+ * reference, for crqa_dev_put(). */
+static struct crqa_dev *crqa_pick(struct crqa_file *cf)
+{
+	struct crqa_dev *cd, *best = NULL;
+	unsigned int i;
+
+	if (!cf->group) {
+		kref_get(&cf->dev->ref);
+		return cf->dev;
+	}
+	rcu_read_lock();
+	for_each_file_dev(cd, cf, i) {
+		if (READ_ONCE(cd->raw_owner))
+			continue;
+		if (!best || READ_ONCE(cd->jobs_inflight) < READ_ONCE(best->jobs_inflight))
+			best = cd;
+	}
+	if (best)
+		kref_get(&best->ref);
+	rcu_read_unlock();
+	return best;
+}
+
+/* A free data buffer of 'cd' for 'cf', or -EAGAIN; its completion must also
+ * fit in the file's done ring. */
+static int crqa_get_slot(struct crqa_dev *cd, struct crqa_file *cf,
+			 const struct crqa_pci_job *job, u64 *seq)
+{
+	int slot = -EAGAIN;
+
+	spin_lock_irq(&cd->lock);
+	if (cd->removed) {
+		slot = -ENODEV;
+	} else if (cd->raw_owner) {
+		slot = -EBUSY;
+	} else if (cd->n_free) {
+		spin_lock(&cf->lock);
+		if (cf->inflight + cf->done_count < cf->depth) {
+			slot = cd->free_slots[--cd->n_free];
+			cd->slots[slot].owner = cf;
+			cd->slots[slot].id = job->id;
+			cd->slots[slot].seq = *seq = ++cf->seq;
+			cf->inflight++;
+			cd->jobs_inflight++;
+		}
+		spin_unlock(&cf->lock);
+	}
+	spin_unlock_irq(&cd->lock);
+	return slot;
+}
+
+static bool crqa_slot_free(struct crqa_file *cf)
+{
+	struct crqa_dev *cd;
+	unsigned int i;
+	bool ret = false;
+
+	rcu_read_lock();
+	for_each_file_dev(cd, cf, i)
+		if (READ_ONCE(cd->n_free) || READ_ONCE(cd->raw_owner) || READ_ONCE(cd->removed))
+			ret = true;
+	rcu_read_unlock();
+	return ret;
+}
+
+static bool crqa_done_room(struct crqa_file *cf)
+{
+	return READ_ONCE(cf->inflight) + READ_ONCE(cf->done_count) < cf->depth;
+}
+
+/* Entries and samples went through the write-combining mapping: flush them
+ * out before the doorbell. Called with cd->sq_mutex and io_rwsem held. */
+static void crqa_ring(struct crqa_dev *cd)
+{
+	if (cd->sq_rung == cd->sq_tail)
+		return;
+	wmb();
+	writel(cd->sq_tail, cd->bar + CRQA_REG_SQ_TAIL);
+	cd->sq_rung = cd->sq_tail;
+}
+
+/* Ring every device 'cf' queued on since the last time, one doorbell each. */
+static void crqa_ring_all(struct crqa_file *cf, unsigned long *queued_on)
+{
+	struct crqa_dev *cd;
+	unsigned int i;
+
+	rcu_read_lock();
+	for_each_file_dev(cd, cf, i) {
+		if (!test_and_clear_bit(cd->minor, queued_on))
+			continue;
+		kref_get(&cd->ref);
+		rcu_read_unlock();
+
+		down_read(&cd->io_rwsem);
+		mutex_lock(&cd->sq_mutex);
+		if (!cd->removed)
+			crqa_ring(cd);
+		mutex_unlock(&cd->sq_mutex);
+		up_read(&cd->io_rwsem);
+		crqa_dev_put(cd);
+
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+}
+
+static long crqa_submit(struct crqa_file *cf, struct crqa_pci_submit __user *uarg)
+{
+	DECLARE_BITMAP(queued_on, CRQA_PCI_MAX_DEVS) = {};
+	struct crqa_pci_submit sub;
+	struct crqa_pci_job __user *ujobs;
+	u32 queued = 0;
+	u64 seq = 0;
+	long ret = 0;
+
+	if (copy_from_user(&sub, uarg, sizeof(sub)))
+		return -EFAULT;
+	ujobs = u64_to_user_ptr(sub.jobs);
+
+	mutex_lock(&cf->submit_mutex);
+	while (queued < sub.count) {
+		struct crqa_pci_job job;
+		struct crqa_sqe sqe = {};
+		struct crqa_dev *cd;
+		int slot;
+
+		if (copy_from_user(&job, ujobs + queued, sizeof(job)) ||
+		    copy_from_user(cf->bounce, u64_to_user_ptr(job.sig1), CRQA_SIG_BYTES) ||
+		    copy_from_user(cf->bounce + CRQA_PROTO_SAMPLES, u64_to_user_ptr(job.sig2),
+				   CRQA_SIG_BYTES)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		cd = crqa_pick(cf);
+		if (!cd) {
+			ret = -EBUSY;		/* every instance driven raw, or gone */
+			break;
+		}
+		/* crqa_remove() waits for the job to be on the queue, then fails it */
+		down_read(&cd->io_rwsem);
+		slot = crqa_get_slot(cd, cf, &job, &seq);
+		if (slot < 0) {
+			up_read(&cd->io_rwsem);
+			crqa_dev_put(cd);
+		}
+		if (slot == -EAGAIN && !(sub.flags & CRQA_SUBMIT_NONBLOCK) && crqa_done_room(cf)) {
+			/* buffers come back once the devices see what is queued */
+			crqa_ring_all(cf, queued_on);
+			ret = wait_event_interruptible(crqa_room, crqa_slot_free(cf));
+			if (ret)
+				break;
+			continue;
+		}
+		if (slot < 0) {
+			ret = slot;
+			break;
+		}
+
+		memcpy_toio(cd->input + CRQA_DATA_OFFSET - CRQA_SQ_OFFSET + slot * CRQA_DATA_STRIDE,
+			    cf->bounce, sizeof(cf->bounce));
+		/* completions come back on the vector of the submitting CPU */
+		sqe.id = job.id;
+		sqe.R = job.R;
+		sqe.opcode = job.opcode;
+		sqe.buf = slot;
+		sqe.m = job.m;
+		sqe.tau = job.tau;
+		sqe.min_diag = job.min_diag;
+		sqe.min_vert = job.min_vert;
+		sqe.cq = *per_cpu_ptr(cd->cpu_cq, raw_smp_processor_id());
+
+		mutex_lock(&cd->sq_mutex);
+		memcpy_toio(cd->input + (cd->sq_tail % CRQA_QUEUE_DEPTH) * sizeof(sqe), &sqe,
+			    sizeof(sqe));
+		/* another submitter may ring for it: out of our write-combining
+		 * buffers before the tail covers it */
+		wmb();
+		cd->sq_tail++;
+		mutex_unlock(&cd->sq_mutex);
+		up_read(&cd->io_rwsem);
+		__set_bit(cd->minor, queued_on);
+		crqa_dev_put(cd);
+		queued++;
+	}
+	crqa_ring_all(cf, queued_on);
+	mutex_unlock(&cf->submit_mutex);
+
+	if (!queued)
+		return ret;
+	sub.count = queued;
+	sub.seq = seq;
+	return copy_to_user(uarg, &sub, sizeof(sub)) ? -EFAULT : 0;
+}
+
+/* The raw owner's ring heads: the one thing only the registers know, so
+ * read once per poll() and not per spin. 0s once the device is gone. */
+static void crqa_raw_heads(struct crqa_dev *cd, u32 *heads)
+{
+	unsigned int q;
+
+	spin_lock_irq(&cd->lock);
+	for (q = 0; q < CRQA_NUM_CQ; q++)
+		heads[q] = cd->removed ? 0 : readl(cd->bar + CRQA_REG_CQN_HEAD(q));
+	spin_unlock_irq(&cd->lock);
+}
+
+/* Whether a ring has a new cqe at the raw owner's 'heads': its phase bit,
+ * not the CQ tail register. */
+static bool crqa_raw_ready(struct crqa_dev *cd, const u32 *heads)
+{
+	bool new = false;
+	unsigned int q;
 
-	/* Check if data is ready */
-	if (atomic_read(&data_ready)) {
-		mask |= POLLIN | POLLRDNORM;  /* Data available to read */
+	spin_lock_irq(&cd->lock);
+	for (q = 0; !cd->removed && q < CRQA_NUM_CQ && !new; q++)
+		new = crqa_cqe_new(cd, q, heads[q]);
+	spin_unlock_irq(&cd->lock);
+	return new;
+}
+
+/* Hybrid polling: spin up to poll_usec, reaping the rings from memory, until
+ * 'cf' has 'min' completions (raw owner: a new cqe at a ring's head, from
+ * 'heads' if the caller has read them) or a legacy job is done. Then the
+ * caller sleeps as usual if it must. */
+static void crqa_busy_poll(struct crqa_file *cf, u32 min, const u32 *heads)
+{
+	u32 usec = READ_ONCE(poll_usec), own[CRQA_NUM_CQ];
+	struct crqa_dev *cd, *home = cf->dev;
+	bool raw = READ_ONCE(home->raw_owner) == cf;
+	unsigned int q, i;
+	u64 end;
+
+	if (!usec)
+		return;
+	if (raw && !heads) {
+		crqa_raw_heads(home, own);
+		heads = own;
 	}
 
+	end = local_clock() + (u64)usec * NSEC_PER_USEC;
+	do {
+		rcu_read_lock();
+		for_each_file_dev(cd, cf, i) {
+			spin_lock_irq(&cd->lock);
+			for (q = 0; q < cd->n_cq; q++)
+				crqa_check_ring(cd, q);
+			spin_unlock_irq(&cd->lock);
+		}
+		rcu_read_unlock();
+
+		if (READ_ONCE(cf->done_count) >= min ||
+		    READ_ONCE(home->legacy_seq) != cf->legacy_seen)
+			return;
+		/* fewer in flight than asked for */
+		if (min > 1 && !READ_ONCE(cf->inflight))
+			return;
+		if (raw && (READ_ONCE(home->removed) || crqa_raw_ready(home, heads)))
+			return;
+		cpu_relax();
+	} while (local_clock() < end && !need_resched());
+}
+
+static bool crqa_wait_done(struct crqa_file *cf, u32 min)
+{
+	return READ_ONCE(cf->done_count) >= min || !READ_ONCE(cf->inflight);
+}
+
+static long crqa_wait(struct crqa_file *cf, struct crqa_pci_wait __user *uarg)
+{
+	struct crqa_pci_wait w;
+	struct crqa_pci_done __user *udone;
+	unsigned int head, n, first;
+	long ret;
+
+	if (copy_from_user(&w, uarg, sizeof(w)))
+		return -EFAULT;
+	if (!w.max)
+		return -EINVAL;
+	udone = u64_to_user_ptr(w.done);
+
+	if (!crqa_wait_done(cf, min(w.min, w.max)))
+		crqa_busy_poll(cf, min(w.min, w.max), NULL);
+	ret = wait_event_interruptible_timeout(cf->wq, crqa_wait_done(cf, min(w.min, w.max)),
+					       w.timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT :
+					       msecs_to_jiffies(w.timeout_ms));
+	if (ret < 0)
+		return ret;
+
+	/* the interrupt only appends, so the entries can be copied unlocked */
+	mutex_lock(&cf->wait_mutex);
+	spin_lock_irq(&cf->lock);
+	head = cf->done_head;
+	n = min(cf->done_count, w.max);
+	spin_unlock_irq(&cf->lock);
+	if (!n && !cf->group && READ_ONCE(cf->dev->removed)) {
+		mutex_unlock(&cf->wait_mutex);
+		return -ENODEV;
+	}
+
+	first = min(n, cf->depth - head);
+	if (copy_to_user(udone, &cf->done[head], first * sizeof(*udone)) ||
+	    copy_to_user(udone + first, &cf->done[0], (n - first) * sizeof(*udone))) {
+		mutex_unlock(&cf->wait_mutex);
+		return -EFAULT;
+	}
+
+	spin_lock_irq(&cf->lock);
+	cf->done_head = (head + n) % cf->depth;
+	cf->done_count -= n;
+	spin_unlock_irq(&cf->lock);
+	mutex_unlock(&cf->wait_mutex);
+
+	return put_user(n, &uarg->count);
+}
+
+static long crqa_set_eventfd(struct crqa_file *cf, int32_t __user *uarg)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+	int32_t fd;
+
+	if (get_user(fd, uarg))
+		return -EFAULT;
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	spin_lock_irq(&cf->lock);
+	old = cf->ev;
+	cf->ev = ctx;
+	spin_unlock_irq(&cf->lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+static long crqa_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct crqa_file *cf = filp->private_data;
+
+	switch (cmd) {
+	case CRQA_IOC_SUBMIT:
+		return crqa_submit(cf, (void __user *)arg);
+	case CRQA_IOC_WAIT:
+		return crqa_wait(cf, (void __user *)arg);
+	case CRQA_IOC_SET_EVENTFD:
+		return crqa_set_eventfd(cf, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* legacy job interrupts since the last read() */
+static ssize_t crqa_read(struct file *filp, char __user *buf, size_t len, loff_t *off)
+{
+	struct crqa_file *cf = filp->private_data;
+	struct crqa_dev *cd = cf->dev;
+	u64 seq;
+
+	if (len < sizeof(seq))
+		return -EINVAL;
+	if ((filp->f_flags & O_NONBLOCK) && READ_ONCE(cd->legacy_seq) == cf->legacy_seen &&
+	    !READ_ONCE(cd->removed))
+		return -EAGAIN;
+	if (wait_event_interruptible(crqa_waitqueue, READ_ONCE(cd->legacy_seq) != cf->legacy_seen ||
+				     READ_ONCE(cd->removed)))
+		return -ERESTARTSYS;
+
+	seq = READ_ONCE(cd->legacy_seq);
+	if (seq == cf->legacy_seen)
+		return -ENODEV;
+	cf->legacy_seen = seq;
+	return copy_to_user(buf, &seq, sizeof(seq)) ? -EFAULT : sizeof(seq);
+}
+
+static __poll_t crqa_poll_mask(struct crqa_file *cf, const u32 *heads)
+{
+	struct crqa_dev *cd, *home = cf->dev;
+	__poll_t mask = 0;
+	unsigned int i;
+
+	/* completions of this file, or a legacy job done */
+	if (READ_ONCE(cf->done_count) || READ_ONCE(home->legacy_seq) != cf->legacy_seen)
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	/* or, driving the queues ourselves, completions in a ring */
+	if (heads && READ_ONCE(home->raw_owner) == cf && crqa_raw_ready(home, heads))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	/* a device of its own that is gone */
+	if (!cf->group && READ_ONCE(home->removed))
+		mask |= EPOLLERR | EPOLLHUP;
+
+	rcu_read_lock();
+	for_each_file_dev(cd, cf, i)
+		if (!READ_ONCE(cd->raw_owner) && READ_ONCE(cd->n_free) && !READ_ONCE(cd->removed))
+			mask |= EPOLLOUT | EPOLLWRNORM;
+	rcu_read_unlock();
+
+	return mask;
+}
+
+static __poll_t crqa_poll(struct file *filp, poll_table *wait)
+{
+	struct crqa_file *cf = filp->private_data;
+	u32 buf[CRQA_NUM_CQ], *heads = NULL;
+	__poll_t mask;
+
+	/* Register wait queues */
+	poll_wait(filp, &crqa_waitqueue, wait);
+	poll_wait(filp, &cf->wq, wait);
+	poll_wait(filp, &crqa_room, wait);
+
+	/* raw owner: the heads it has consumed up to, for all checks below */
+	if (READ_ONCE(cf->dev->raw_owner) == cf) {
+		crqa_raw_heads(cf->dev, buf);
+		heads = buf;
+	}
+	mask = crqa_poll_mask(cf, heads);
+	/* about to sleep for completions: spin for them a while first */
+	if (!(mask & EPOLLIN) && !poll_does_not_wait(wait)) {
+		crqa_busy_poll(cf, 1, heads);
+		mask = crqa_poll_mask(cf, heads);
+	}
 	return mask;
 }
 
+/* Allocate the DMA area and register it with the device. Without one the
+ * device still works, with the data buffers in the BAR only. */
+static void crqa_dma_setup(struct crqa_dev *cd)
+{
+	struct pci_dev *pdev = cd->pdev;
+
+	if (!dma_size)
+		return;
+	if (dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64)) &&
+	    dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32))) {
+		dev_warn(&pdev->dev, "no usable DMA mask, BAR mode only\n");
+		return;
+	}
+
+	cd->dma_len = PAGE_ALIGN(dma_size);
+	cd->dma_area = dma_alloc_coherent(&pdev->dev, cd->dma_len, &cd->dma_handle, GFP_KERNEL);
+	if (!cd->dma_area) {
+		dev_warn(&pdev->dev, "no %zu-byte DMA area, BAR mode only\n", cd->dma_len);
+		return;
+	}
+	pci_set_master(pdev);
+	writel(lower_32_bits(cd->dma_handle), cd->bar + CRQA_REG_DMA_BASE_LO);
+	writel(upper_32_bits(cd->dma_handle), cd->bar + CRQA_REG_DMA_BASE_HI);
+	writel(cd->dma_len, cd->bar + CRQA_REG_DMA_SIZE);
+	dev_info(&pdev->dev, "%zu-byte DMA area at %pad\n", cd->dma_len, &cd->dma_handle);
+}
+
+static void crqa_dma_teardown(struct crqa_dev *cd)
+{
+	if (!cd->dma_area)
+		return;
+	writel(0, cd->bar + CRQA_REG_DMA_SIZE);
+	pci_clear_master(cd->pdev);
+	dma_free_coherent(&cd->pdev->dev, cd->dma_len, cd->dma_area, cd->dma_handle);
+	cd->dma_area = NULL;
+}
+
 static const struct file_operations fops = {
 	.owner = THIS_MODULE,
+	.open = crqa_open,
+	.release = crqa_release,
+	.read = crqa_read,
+	.unlocked_ioctl = crqa_ioctl,
 	.mmap  = crqa_mmap,
 	.poll = crqa_poll,
+	.llseek = noop_llseek,
 };
 
 
+static void crqa_irq_teardown(struct crqa_dev *cd)
+{
+	while (cd->n_irq) {
+		int irq = pci_irq_vector(cd->pdev, --cd->n_irq);
+
+		irq_set_affinity_hint(irq, NULL);
+		free_irq(irq, &cd->cqs[cd->n_irq]);
+	}
+	pci_free_irq_vectors(cd->pdev);
+	cd->n_cq = 1;
+}
+
+/* A vector per completion ring: MSI-X if the device offers it, else one
+ * MSI (or INTx) for ring 0 alone. Each CPU submits to the ring whose vector
+ * it is in the affinity of, so its completions come back to it. */
+static int crqa_irq_setup(struct crqa_dev *cd)
+{
+	struct pci_dev *pdev = cd->pdev;
+	struct irq_affinity affd = {};
+	bool spread = !strcmp(irq_affinity, "spread");
+	cpumask_var_t cpus;
+	unsigned int q;
+	int nvec, cpu, ret = 0;
+
+	if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
+	if (!spread && strcmp(irq_affinity, "none") &&
+	    (cpulist_parse(irq_affinity, cpus) || !cpumask_intersects(cpus, cpu_online_mask))) {
+		dev_warn(&pdev->dev, "bad irq_affinity \"%s\", using none\n", irq_affinity);
+		cpumask_clear(cpus);
+	}
+	cpumask_and(cpus, cpus, cpu_online_mask);
+
+	nvec = pci_alloc_irq_vectors_affinity(pdev, 1, CRQA_NUM_CQ,
+					      PCI_IRQ_MSIX | PCI_IRQ_MSI | PCI_IRQ_INTX |
+					      (spread ? PCI_IRQ_AFFINITY : 0),
+					      spread ? &affd : NULL);
+	if (nvec < 0) {
+		ret = nvec;
+		goto out;
+	}
+	cd->n_cq = pdev->msix_enabled ? nvec : 1;
+
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(cd->cpu_cq, cpu) = cpu % cd->n_cq;
+
+	cpu = -1;
+	for (q = 0; q < cd->n_cq; q++) {
+		int irq = pci_irq_vector(pdev, q);
+		const struct cpumask *mask = NULL;
+		unsigned int c;
+
+		ret = request_irq(irq, crqa_irq_handler, 0, dev_name(cd->device), &cd->cqs[q]);
+		if (ret)
+			goto err_irq;
+		cd->n_irq++;
+
+		if (spread) {
+			mask = pci_irq_get_affinity(pdev, q);
+		} else if (!cpumask_empty(cpus)) {
+			cpu = cpumask_next(cpu, cpus);
+			if (cpu >= nr_cpu_ids)
+				cpu = cpumask_first(cpus);
+			mask = cpumask_of(cpu);
+			irq_set_affinity_hint(irq, mask);
+		}
+		if (mask)
+			for_each_cpu(c, mask)
+				*per_cpu_ptr(cd->cpu_cq, c) = q;
+
+		// Check which CPUs this IRQ is targeting
+		if (irq_get_irq_data(irq))
+			dev_info(&pdev->dev, "completion ring %u on IRQ %d, affinity %*pbl\n", q, irq,
+				 cpumask_pr_args(irq_data_get_affinity_mask(irq_get_irq_data(irq))));
+	}
+	dev_info(&pdev->dev, "%u completion vectors (%s)\n", cd->n_cq,
+		 pdev->msix_enabled ? "MSI-X" : pdev->msi_enabled ? "MSI" : "INTx");
+	goto out;
+
+err_irq:
+	crqa_irq_teardown(cd);
+out:
+	free_cpumask_var(cpus);
+	return ret;
+}
+
 static int crqa_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 {
+	struct crqa_dev *cd;
 	int ret;
 	uint16_t msi_data;
 	uint32_t msi_addr_lo, msi_addr_hi = 0;
 	uint8_t msi_flags;
 	int msi_cap;
+	unsigned int q;
 
+	cd = kzalloc(sizeof(*cd), GFP_KERNEL);
+	if (!cd)
+		return -ENOMEM;
+	kref_init(&cd->ref);
+	cd->pdev = pdev;
+	cd->n_cq = 1;
+	init_rwsem(&cd->io_rwsem);
+	mutex_init(&cd->files_mutex);
+	INIT_LIST_HEAD(&cd->files);
+	spin_lock_init(&cd->lock);
+	mutex_init(&cd->sq_mutex);
+	for (q = 0; q < CRQA_NUM_CQ; q++)
+		cd->cqs[q].cd = cd;
+	cd->cpu_cq = alloc_percpu(u8);
+	if (!cd->cpu_cq) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+	cd->minor = ida_alloc_max(&crqa_ida, CRQA_PCI_MAX_DEVS - 1, GFP_KERNEL);
+	if (cd->minor < 0) {
+		ret = cd->minor;
+		goto err_percpu;
+	}
+	pci_set_drvdata(pdev, cd);
 
 	ret = pci_enable_device(pdev);
-	if (ret) return ret;
+	if (ret) goto err_ida;
 	printk(KERN_ALERT " CRQA: device enabled\n");
 
 	//check for MSI capability
@@ -107,93 +1158,139 @@ static int crqa_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	ret = pci_request_region(pdev, 0, "crqa");
 	if (ret) goto err_disable;
 
-	pdev_global = pdev;
-
-	dev_class = class_create("crqa");
-	if (IS_ERR(dev_class)) {
-		ret = PTR_ERR(dev_class);
+	cd->bar = pci_iomap(pdev, 0, 0);
+	if (!cd->bar) {
+		ret = -ENOMEM;
 		goto err_region;
 	}
+	cd->input = ioremap_wc(pci_resource_start(pdev, 0) + CRQA_SQ_OFFSET,
+			       CRQA_DATA_END - CRQA_SQ_OFFSET);
+	if (!cd->input) {
+		ret = -ENOMEM;
+		goto err_iomap;
+	}
+	cd->sq_tail = cd->sq_rung = readl(cd->bar + CRQA_REG_SQ_TAIL);
+	for (q = 0; q < CRQA_NUM_CQ; q++)
+		cd->cqs[q].head = readl(cd->bar + CRQA_REG_CQN_HEAD(q));
+	cd->legacy_tag = readq(cd->bar + CRQA_LEGACY_DONE_TAG);
+	/* a count with no time limit would leave the end of a burst unsignalled,
+	 * and its waiters asleep */
+	if (coal_count > 1 && !coal_usec)
+		dev_warn(&pdev->dev, "coal_count %u needs coal_usec, interrupting every batch\n",
+			 coal_count);
+	else
+		writel(coal_count, cd->bar + CRQA_REG_COAL_COUNT);
+	writel(coal_usec, cd->bar + CRQA_REG_COAL_USEC);
+	for (cd->n_free = 0; cd->n_free < CRQA_QUEUE_DEPTH; cd->n_free++)
+		cd->free_slots[cd->n_free] = CRQA_QUEUE_DEPTH - 1 - cd->n_free;
+	printk(KERN_INFO "CRQA: %u-entry submission/completion queues\n",
+	       readl(cd->bar + CRQA_REG_QUEUE_DEPTH));
+	crqa_dma_setup(cd);
 
-	ret = alloc_chrdev_region(&dev_num, 0, 1, CDEV_NAME);
-	if (ret) goto err_class;
-
-	cdev_init(&cdev, &fops);
-	ret = cdev_add(&cdev, dev_num, 1);
-	if (ret) goto err_chrdev;
+	cd->cdev = cdev_alloc();
+	if (!cd->cdev) {
+		ret = -ENOMEM;
+		goto err_dma;
+	}
+	cd->cdev->owner = THIS_MODULE;
+	cd->cdev->ops = &fops;
+	ret = cdev_add(cd->cdev, MKDEV(MAJOR(dev_num), cd->minor), 1);
+	if (ret) {
+		kobject_put(&cd->cdev->kobj);
+		goto err_dma;
+	}
 
-	dev_device = device_create(dev_class, &pdev->dev, dev_num, NULL, CDEV_NAME);
-	if (IS_ERR(dev_device)) {
-		ret = PTR_ERR(dev_device);
+	cd->device = device_create(dev_class, &pdev->dev, MKDEV(MAJOR(dev_num), cd->minor),
+				   cd, "crqa%d", cd->minor);
+	if (IS_ERR(cd->device)) {
+		ret = PTR_ERR(cd->device);
 		goto err_cdev;
 	}
 
-	ret = pci_enable_msi(pdev);
+	ret = crqa_irq_setup(cd);
 	if (ret) {
-		dev_warn(&pdev->dev, "MSI not available, falling back to legacy IRQ\n");
-	} else {
-		printk(KERN_INFO "CRQA: MSI enabled successfully\n");
-
+		dev_warn(&pdev->dev, "no interrupts (%d), completions only by polling\n", ret);
+	} else if (pdev->msi_enabled && msi_cap) {
 		// Read MSI config after enabling
-		if (msi_cap) {
-			pci_read_config_byte(pdev, msi_cap + PCI_MSI_FLAGS, &msi_flags);
-			printk(KERN_INFO "CRQA: MSI flags after: 0x%02x (enabled: %d)\n", msi_flags, msi_flags & PCI_MSI_FLAGS_ENABLE);
-			pci_read_config_dword(pdev, msi_cap + PCI_MSI_ADDRESS_LO, &msi_addr_lo);
-			if (msi_flags & PCI_MSI_FLAGS_64BIT) {
-				pci_read_config_dword(pdev, msi_cap + PCI_MSI_ADDRESS_HI, &msi_addr_hi);
-			}
-			pci_read_config_word(pdev, msi_cap + ((msi_flags & PCI_MSI_FLAGS_64BIT) ? PCI_MSI_DATA_64 : PCI_MSI_DATA_32),&msi_data);
-
-			printk(KERN_INFO "CRQA: MSI address: 0x%08x%08x\n", msi_addr_hi, msi_addr_lo);
-			printk(KERN_INFO "CRQA: MSI data: 0x%04x (vector: %d)\n", msi_data, msi_data & 0xFF);
-		}
-
-		// Get MSI IRQ information
-		printk(KERN_INFO "CRQA: Assigned IRQ: %d\n", pdev->irq);
-
-		// Check which CPU this IRQ is targeting
-		struct irq_data *irq_data = irq_get_irq_data(pdev->irq);
-		if (irq_data) {
-			const struct cpumask *mask = irq_data_get_affinity_mask(irq_data);
-			printk(KERN_INFO "CRQA: IRQ affinity: %*pbl\n",
-			       cpumask_pr_args(mask));
+		pci_read_config_byte(pdev, msi_cap + PCI_MSI_FLAGS, &msi_flags);
+		printk(KERN_INFO "CRQA: MSI flags after: 0x%02x (enabled: %d)\n", msi_flags, msi_flags & PCI_MSI_FLAGS_ENABLE);
+		pci_read_config_dword(pdev, msi_cap + PCI_MSI_ADDRESS_LO, &msi_addr_lo);
+		if (msi_flags & PCI_MSI_FLAGS_64BIT) {
+			pci_read_config_dword(pdev, msi_cap + PCI_MSI_ADDRESS_HI, &msi_addr_hi);
 		}
+		pci_read_config_word(pdev, msi_cap + ((msi_flags & PCI_MSI_FLAGS_64BIT) ? PCI_MSI_DATA_64 : PCI_MSI_DATA_32),&msi_data);
 
-
-	}
-	printk(KERN_ALERT"LKM: ret: %d  Success pci enable MSI\n", ret);
-
-	ret = request_irq(pdev->irq, crqa_irq_handler, 0, "crqa_pci", pdev);
-	if (ret)
-	{
-		printk(KERN_INFO "error requesting MSI,,,,\n");
+		printk(KERN_INFO "CRQA: MSI address: 0x%08x%08x\n", msi_addr_hi, msi_addr_lo);
+		printk(KERN_INFO "CRQA: MSI data: 0x%04x (vector: %d)\n", msi_data, msi_data & 0xFF);
 	}
 
+	/* it can be opened, and the group submits to it, from now on */
+	rcu_assign_pointer(crqa_devs[cd->minor], cd);
 
-	dev_info(&pdev->dev, "CRQA zero-copy device ready\n");
+	dev_info(&pdev->dev, "CRQA zero-copy device ready as /dev/crqa%d\n", cd->minor);
 	return 0;
 
 err_cdev:
-	cdev_del(&cdev);
-err_chrdev:
-	unregister_chrdev_region(dev_num, 1);
-err_class:
-	class_destroy(dev_class);
+	cdev_del(cd->cdev);
+err_dma:
+	crqa_dma_teardown(cd);
+	iounmap(cd->input);
+err_iomap:
+	pci_iounmap(pdev, cd->bar);
 err_region:
 	pci_release_region(pdev, 0);
 err_disable:
 	pci_disable_device(pdev);
+err_ida:
+	ida_free(&crqa_ida, cd->minor);
+err_percpu:
+	free_percpu(cd->cpu_cq);
+err_free:
+	kfree(cd);
 	return ret;
 }
 
+/* The instance goes, its open files stay: what they have in flight fails
+ * with CRQA_CQE_IO_ERROR, their mappings are zapped, and from then on
+ * everything but close() fails with ENODEV (the group goes on without it). */
 static void crqa_remove(struct pci_dev *pdev)
 {
-	device_destroy(dev_class, dev_num);
-	cdev_del(&cdev);
-	unregister_chrdev_region(dev_num, 1);
-	class_destroy(dev_class);
+	struct crqa_dev *cd = pci_get_drvdata(pdev);
+	struct crqa_file *cf;
+	unsigned int buf;
+
+	RCU_INIT_POINTER(crqa_devs[cd->minor], NULL);
+	synchronize_rcu();
+	device_destroy(dev_class, MKDEV(MAJOR(dev_num), cd->minor));
+	cdev_del(cd->cdev);
+
+	/* submitters and mmap() are out of the BAR once we have it. Closed
+	 * files whose last job fails here go by kvfree_rcu(), not under the
+	 * lock (crqa_complete()). */
+	down_write(&cd->io_rwsem);
+	spin_lock_irq(&cd->lock);
+	cd->removed = true;
+	for (buf = 0; buf < CRQA_QUEUE_DEPTH; buf++)
+		if (cd->slots[buf].owner)
+			crqa_complete(cd, buf, CRQA_CQE_IO_ERROR);
+	spin_unlock_irq(&cd->lock);
+	up_write(&cd->io_rwsem);
+
+	mutex_lock(&cd->files_mutex);
+	list_for_each_entry(cf, &cd->files, node)
+		unmap_mapping_range(cf->mapping, 0, 0, 1);
+	mutex_unlock(&cd->files_mutex);
+	wake_up_interruptible(&crqa_waitqueue);
+	wake_up_interruptible(&crqa_room);
+
+	crqa_irq_teardown(cd);
+	crqa_dma_teardown(cd);
+	iounmap(cd->input);
+	pci_iounmap(pdev, cd->bar);
 	pci_release_region(pdev, 0);
 	pci_disable_device(pdev);
+	ida_free(&crqa_ida, cd->minor);
+	crqa_dev_put(cd);
 }
 
 static const struct pci_device_id crqa_ids[] = {
@@ -209,7 +1306,57 @@ static struct pci_driver crqa_driver = {
 	.remove   = crqa_remove,
 };
 
-module_pci_driver(crqa_driver);
+/* The class, the minors of every instance and the group node exist before
+ * the first device is probed. */
+static int __init crqa_init(void)
+{
+	dev_t group_num;
+	int ret;
+
+	dev_class = class_create("crqa");
+	if (IS_ERR(dev_class))
+		return PTR_ERR(dev_class);
+
+	ret = alloc_chrdev_region(&dev_num, 0, CRQA_PCI_MAX_DEVS + 1, "crqa");
+	if (ret) goto err_class;
+	group_num = MKDEV(MAJOR(dev_num), CRQA_PCI_MAX_DEVS);
+
+	cdev_init(&group_cdev, &fops);
+	ret = cdev_add(&group_cdev, group_num, 1);
+	if (ret) goto err_chrdev;
+
+	group_device = device_create(dev_class, NULL, group_num, NULL, CDEV_NAME);
+	if (IS_ERR(group_device)) {
+		ret = PTR_ERR(group_device);
+		goto err_cdev;
+	}
+
+	ret = pci_register_driver(&crqa_driver);
+	if (ret) goto err_device;
+	return 0;
+
+err_device:
+	device_destroy(dev_class, group_num);
+err_cdev:
+	cdev_del(&group_cdev);
+err_chrdev:
+	unregister_chrdev_region(dev_num, CRQA_PCI_MAX_DEVS + 1);
+err_class:
+	class_destroy(dev_class);
+	return ret;
+}
+
+static void __exit crqa_exit(void)
+{
+	pci_unregister_driver(&crqa_driver);
+	device_destroy(dev_class, MKDEV(MAJOR(dev_num), CRQA_PCI_MAX_DEVS));
+	cdev_del(&group_cdev);
+	unregister_chrdev_region(dev_num, CRQA_PCI_MAX_DEVS + 1);
+	class_destroy(dev_class);
+}
+
+module_init(crqa_init);
+module_exit(crqa_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("You");
@@ -0,0 +1,107 @@
+/* crqa_pci.h - user interface of /dev/crqa<n> and /dev/cpcidev_pci,
+ * shared by the guest driver (crqa_driver.c) and programs. */
+#ifndef CRQA_PCI_H
+#define CRQA_PCI_H
+
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#else
+#include <sys/ioctl.h>
+#include <stdint.h>
+#endif
+#include "crqa_bar.h"
+#include "crqa_proto.h"
+
+/*
+ * Every crqa-pci-dev instance is a device of its own, /dev/crqa0 up to
+ * /dev/crqa<CRQA_PCI_MAX_DEVS - 1>, numbered in probe order.
+ *
+ * /dev/cpcidev_pci is the group of all of them: CRQA_IOC_SUBMIT sends each
+ * job to the instance with the fewest jobs in flight (leaving out those
+ * driven from user space), and CRQA_IOC_WAIT, the eventfd and poll() cover
+ * the completions from all of them. The sequence numbers are the file's,
+ * across instances. read() and mmap() there are those of the first
+ * instance, so programs written for a single device run unchanged.
+ *
+ * When an instance is unplugged, the jobs it has in flight complete with
+ * CRQA_CQE_IO_ERROR, its mappings go away, and its files fail with ENODEV
+ * (POLLERR | POLLHUP from poll()) until closed. The group goes on with the
+ * other instances.
+ */
+#define CRQA_PCI_DEV         "/dev/cpcidev_pci"
+#define CRQA_PCI_DEV_FMT     "/dev/crqa%u"
+#define CRQA_PCI_MAX_DEVS    16
+
+/*
+ * Every open file is a context of its own, so several programs can share the
+ * device. The driver owns the submission/completion queues on their behalf:
+ *
+ * CRQA_IOC_SUBMIT queues 'count' jobs, copying their samples into free data
+ * buffers, with one doorbell for the batch. Each job gets the file's next
+ * sequence number (from 1); the last one is returned in 'seq'. Without
+ * CRQA_SUBMIT_NONBLOCK it waits for free buffers, otherwise it stops early
+ * (EAGAIN if nothing was queued). 'count' returns the jobs queued.
+ *
+ * CRQA_IOC_WAIT returns up to 'max' completions of this file, in completion
+ * order, waiting up to timeout_ms (-1: forever) until there are at least
+ * 'min' of them or nothing else is in flight.
+ *
+ * CRQA_IOC_SET_EVENTFD registers an eventfd signalled for every completion
+ * of this file (-1 unregisters), to fold the device into an epoll loop;
+ * poll() on the file reports POLLIN for completions waiting too, and
+ * POLLOUT for free data buffers.
+ *
+ * Mapping CRQA_MMAP_INPUT or CRQA_MMAP_OUTPUT instead drives the queues from
+ * user space (crqa_bar.h); that file then has them to itself until it is
+ * closed, and the ioctls fail with EBUSY meanwhile. close() waits up to a
+ * second for the windows it left queued.
+ *
+ * read() returns, as a uint64_t, how many legacy (TRIGGER_REG) jobs the
+ * driver has seen complete, once that has changed since the last read() of
+ * this file.
+ */
+struct crqa_pci_job {
+    uint64_t id;                /* returned in crqa_pci_done */
+    double   R;
+    uint32_t opcode;
+    uint16_t m;                 /* 0: server default, as in crqa_sqe */
+    uint16_t tau;
+    uint16_t min_diag;
+    uint16_t min_vert;
+    uint32_t reserved;
+    uint64_t sig1;              /* user pointers to double[CRQA_PROTO_SAMPLES] */
+    uint64_t sig2;
+};
+
+#define CRQA_SUBMIT_NONBLOCK 0x1
+
+struct crqa_pci_submit {
+    uint64_t jobs;              /* user pointer to struct crqa_pci_job[count] */
+    uint32_t count;             /* in: jobs, out: jobs queued */
+    uint32_t flags;             /* CRQA_SUBMIT_* */
+    uint64_t seq;               /* out: sequence number of the last job queued */
+};
+
+struct crqa_pci_done {
+    uint64_t id;
+    uint64_t seq;               /* sequence number given at submission */
+    uint32_t status;            /* crqa_cqe status */
+    uint32_t reserved;
+    double   res[8];            /* eps, rr, det, l, lmax, div, ent, lam */
+};
+
+struct crqa_pci_wait {
+    uint64_t done;              /* user pointer to struct crqa_pci_done[max] */
+    uint32_t max;
+    uint32_t min;
+    int32_t  timeout_ms;
+    uint32_t count;             /* out: completions returned */
+};
+
+#define CRQA_IOC_MAGIC       'Q'
+#define CRQA_IOC_SUBMIT      _IOWR(CRQA_IOC_MAGIC, 1, struct crqa_pci_submit)
+#define CRQA_IOC_WAIT        _IOWR(CRQA_IOC_MAGIC, 2, struct crqa_pci_wait)
+#define CRQA_IOC_SET_EVENTFD _IOW(CRQA_IOC_MAGIC, 3, int32_t)
+
+#endif
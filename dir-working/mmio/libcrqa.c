@@ -0,0 +1,363 @@
+// libcrqa.c - the crqa-pci-dev submission/completion rings behind libcrqa.h
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include "libcrqa.h"
+
+#define SIG_BYTES     (CRQA_PROTO_SAMPLES * sizeof(double))
+#define INPUT_SIZE    (CRQA_DATA_END - CRQA_SQ_OFFSET)
+#define OUTPUT_SIZE   (CRQA_OUTPUT_END - CRQA_CQ_OFFSET)
+
+/* The fences of the ordering rules in crqa_bar.h */
+#if defined(__riscv)
+#define fence_ow_ow() asm volatile("fence ow,ow" ::: "memory")
+#define fence_ir_ir() asm volatile("fence ir,ir" ::: "memory")
+#define fence_ir_ow() asm volatile("fence ir,ow" ::: "memory")
+#elif defined(__x86_64__) || defined(__i386__)
+#define fence_ow_ow() asm volatile("sfence" ::: "memory")
+#define fence_ir_ir() asm volatile("lfence" ::: "memory")
+#define fence_ir_ow() asm volatile("mfence" ::: "memory")
+#else
+#define fence_ow_ow() __sync_synchronize()
+#define fence_ir_ir() __sync_synchronize()
+#define fence_ir_ow() __sync_synchronize()
+#endif
+
+struct crqa {
+	int fd;
+	uint8_t *bar;			/* registers, uncached */
+	uint8_t *input;			/* entries and data buffers, write-combining */
+	uint8_t *output;		/* completions and results, cached */
+	uint8_t *dma;			/* DMA area, NULL if none */
+	size_t dma_size;
+	size_t dma_results;		/* result slot per buffer from here, the program's before */
+
+	uint32_t sq_tail, sq_rung;	/* sq_rung: tail last written to the doorbell */
+	uint32_t cq_head;		/* ring 0, the only one used */
+	uint64_t seq;			/* last job number given */
+
+	struct {
+		uint64_t user, seq;	/* seq 0: not ours */
+		bool dma;
+	} slots[CRQA_QUEUE_DEPTH];
+	uint16_t free_bufs[CRQA_QUEUE_DEPTH];
+	unsigned int n_free;
+
+	/* completions for crqa_wait_any(), when there is no callback */
+	struct crqa_result done[CRQA_QUEUE_DEPTH];
+	unsigned int done_head, done_count;
+
+	crqa_callback fn;
+	void *arg;
+};
+
+static inline uint32_t reg_read(uint8_t *base, unsigned reg) {
+	return *(volatile uint32_t *)(base + reg);
+}
+
+static inline void reg_write(uint8_t *base, unsigned reg, uint32_t val) {
+	*(volatile uint32_t *)(base + reg) = val;
+}
+
+struct crqa *crqa_open(const char *dev)
+{
+	struct crqa *c = calloc(1, sizeof(*c));
+	int err;
+
+	if (!c)
+		return NULL;
+	c->fd = open(dev ? dev : CRQA_PCI_DEV, O_RDWR | O_CLOEXEC);
+	if (c->fd < 0) {
+		free(c);
+		return NULL;
+	}
+
+	// Registers uncached, what we write write-combining, what the device
+	// writes cached (see crqa_bar.h)
+	c->bar = mmap(NULL, CRQA_REGS_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, c->fd, CRQA_MMAP_BAR);
+	c->input = mmap(NULL, INPUT_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, c->fd, CRQA_MMAP_INPUT);
+	c->output = mmap(NULL, OUTPUT_SIZE, PROT_READ, MAP_SHARED, c->fd, CRQA_MMAP_OUTPUT);
+	if (c->bar == MAP_FAILED || c->input == MAP_FAILED || c->output == MAP_FAILED)
+		goto fail;
+
+	if (reg_read(c->bar, CRQA_REG_QUEUE_DEPTH) != CRQA_QUEUE_DEPTH) {
+		errno = ENODEV;
+		goto fail;
+	}
+
+	// Carry on from wherever a previous program left the rings
+	c->sq_tail = c->sq_rung = reg_read(c->bar, CRQA_REG_SQ_TAIL);
+	c->cq_head = reg_read(c->bar, CRQA_REG_CQ_HEAD);
+	if (reg_read(c->bar, CRQA_REG_SQ_HEAD) != c->sq_tail ||
+	    reg_read(c->bar, CRQA_REG_CQ_TAIL) != c->cq_head) {
+		errno = EBUSY;
+		goto fail;
+	}
+
+	// The DMA area, less a result slot per buffer at its end
+	c->dma_size = reg_read(c->bar, CRQA_REG_DMA_SIZE);
+	if (c->dma_size > CRQA_QUEUE_DEPTH * CRQA_RESULT_SIZE) {
+		c->dma = mmap(NULL, c->dma_size, PROT_READ|PROT_WRITE, MAP_SHARED, c->fd, CRQA_MMAP_DMA);
+		if (c->dma == MAP_FAILED)
+			c->dma = NULL;
+		c->dma_results = (c->dma_size - CRQA_QUEUE_DEPTH * CRQA_RESULT_SIZE) &
+		                 ~(size_t)(CRQA_RESULT_SIZE - 1);
+	}
+
+	for (int b = CRQA_QUEUE_DEPTH - 1; b >= 0; b--)
+		c->free_bufs[c->n_free++] = b;
+	return c;
+
+fail:
+	err = errno;
+	crqa_close(c);
+	errno = err;
+	return NULL;
+}
+
+void crqa_close(struct crqa *c)
+{
+	// Windows still queued complete to no one (the driver takes the
+	// queues back when the file is closed)
+	if (c->dma)
+		munmap(c->dma, c->dma_size);
+	if (c->output && c->output != MAP_FAILED)
+		munmap(c->output, OUTPUT_SIZE);
+	if (c->input && c->input != MAP_FAILED)
+		munmap(c->input, INPUT_SIZE);
+	if (c->bar && c->bar != MAP_FAILED)
+		munmap(c->bar, CRQA_REGS_SIZE);
+	close(c->fd);
+	free(c);
+}
+
+/* Whether cqe 'idx' of ring 0 is a new completion: its phase is that of the
+ * lap 'idx' is on. Read from memory, so no exit to the device. */
+static bool crqa_cqe_new(struct crqa *c, uint32_t idx)
+{
+	volatile struct crqa_cqe *cq = (volatile struct crqa_cqe *)c->output;
+	uint16_t flags = cq[idx % CRQA_QUEUE_DEPTH].flags;
+
+	return (flags & CRQA_CQE_PHASE) == ((idx / CRQA_QUEUE_DEPTH) & 1 ? 0 : CRQA_CQE_PHASE);
+}
+
+/* Hand every new completion to the callback or the done list, then let
+ * the device have the entries back. Returns how many. */
+static unsigned int crqa_reap(struct crqa *c)
+{
+	struct crqa_cqe *cq = (struct crqa_cqe *)c->output;
+	uint32_t first = c->cq_head;
+	unsigned int n = 0;
+
+	while (crqa_cqe_new(c, c->cq_head)) {
+		fence_ir_ir();		// the phase before the rest of the entry
+		struct crqa_cqe e = cq[c->cq_head % CRQA_QUEUE_DEPTH];
+		c->cq_head++;
+		if (e.buf >= CRQA_QUEUE_DEPTH || !c->slots[e.buf].seq)
+			continue;	// left over from an earlier program
+
+		struct crqa_result r = {
+			.user = c->slots[e.buf].user,
+			.seq = c->slots[e.buf].seq,
+			.status = e.status,
+		};
+		const uint8_t *res = c->slots[e.buf].dma ?
+			c->dma + c->dma_results + e.buf * CRQA_RESULT_SIZE :
+			c->output + CRQA_RESULTS_OFFSET - CRQA_CQ_OFFSET + e.buf * CRQA_RESULT_SIZE;
+		memcpy(r.res, res, sizeof(r.res));
+
+		c->slots[e.buf].seq = 0;
+		c->free_bufs[c->n_free++] = e.buf;
+		n++;
+
+		if (c->fn) {
+			c->fn(c, &r, c->arg);
+		} else {
+			// room is kept by crqa_submit()
+			c->done[(c->done_head + c->done_count) % CRQA_QUEUE_DEPTH] = r;
+			c->done_count++;
+		}
+	}
+	if (c->cq_head != first) {
+		// Results read; the device may reuse the completion entries
+		fence_ir_ow();
+		reg_write(c->bar, CRQA_REG_CQ_HEAD, c->cq_head);
+	}
+	return n;
+}
+
+/* Combined writes of entries and samples must land before the doorbell */
+static void crqa_ring(struct crqa *c)
+{
+	if (c->sq_rung == c->sq_tail)
+		return;
+	fence_ow_ow();
+	reg_write(c->bar, CRQA_REG_SQ_TAIL, c->sq_tail);
+	c->sq_rung = c->sq_tail;
+}
+
+/* Sleep until the device raises its MSI for a batch of completions */
+static int crqa_sleep(struct crqa *c, int timeout_ms)
+{
+	struct pollfd pfd = {
+		.fd = c->fd,
+		.events = POLLIN
+	};
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+void crqa_set_callback(struct crqa *c, crqa_callback fn, void *arg)
+{
+	c->fn = fn;
+	c->arg = arg;
+
+	// what was kept for crqa_wait_any() goes to the callback too
+	while (fn && c->done_count) {
+		struct crqa_result r = c->done[c->done_head];
+
+		c->done_head = (c->done_head + 1) % CRQA_QUEUE_DEPTH;
+		c->done_count--;
+		fn(c, &r, arg);
+	}
+}
+
+void *crqa_dma_area(struct crqa *c, size_t *size)
+{
+	if (size)
+		*size = c->dma ? c->dma_results : 0;
+	return c->dma;
+}
+
+/* Offset of sig[CRQA_PROTO_SAMPLES] in the program's part of the DMA area */
+static bool crqa_dma_off(struct crqa *c, const double *sig, uint64_t *off)
+{
+	uintptr_t p = (uintptr_t)sig, base = (uintptr_t)c->dma;
+
+	if (!c->dma || p < base || c->dma_results < SIG_BYTES || p - base > c->dma_results - SIG_BYTES)
+		return false;
+	*off = p - base;
+	return true;
+}
+
+int crqa_submit(struct crqa *c, const struct crqa_job *jobs, unsigned int count, uint64_t *seq)
+{
+	unsigned int queued = 0;
+	int err = 0;
+
+	while (queued < count) {
+		const struct crqa_job *j = &jobs[queued];
+
+		if (!c->n_free) {
+			// buffers come back once the device sees what is queued
+			crqa_ring(c);
+			if (crqa_reap(c))
+				continue;
+			if (crqa_sleep(c, -1) < 0) {
+				err = errno;
+				break;
+			}
+			continue;
+		}
+		// without a callback, every completion must fit in the done list
+		if (!c->fn && c->done_count >= c->n_free) {
+			err = EAGAIN;
+			break;
+		}
+
+		uint16_t b = c->free_bufs[--c->n_free];
+		struct crqa_sqe e = {
+			.id = ++c->seq,
+			.R = j->R,
+			.opcode = j->opcode,
+			.buf = b,
+			.m = j->m,
+			.tau = j->tau,
+			.min_diag = j->min_diag,
+			.min_vert = j->min_vert,
+			.cq = 0,
+		};
+
+		uint64_t off1, off2;
+		if (crqa_dma_off(c, j->sig1, &off1) && crqa_dma_off(c, j->sig2, &off2)) {
+			e.flags = CRQA_SQE_DMA;
+			e.sig1_off = off1;
+			e.sig2_off = off2;
+			e.result_off = c->dma_results + b * CRQA_RESULT_SIZE;
+		} else {
+			uint8_t *data = c->input + CRQA_DATA_OFFSET - CRQA_SQ_OFFSET + b * CRQA_DATA_STRIDE;
+			memcpy(data + CRQA_DATA_SIG1, j->sig1, SIG_BYTES);
+			memcpy(data + CRQA_DATA_SIG2, j->sig2, SIG_BYTES);
+		}
+		c->slots[b].user = j->user;
+		c->slots[b].seq = e.id;
+		c->slots[b].dma = e.flags & CRQA_SQE_DMA;
+		((struct crqa_sqe *)c->input)[c->sq_tail % CRQA_QUEUE_DEPTH] = e;
+		c->sq_tail++;
+		queued++;
+
+		// the device starts on this half while we fill the next
+		if (c->sq_tail - c->sq_rung >= CRQA_LIB_BATCH)
+			crqa_ring(c);
+	}
+	crqa_ring(c);
+
+	if (seq)
+		*seq = c->seq;
+	if (!queued && count) {
+		errno = err;
+		return -1;
+	}
+	return queued;
+}
+
+int crqa_wait_any(struct crqa *c, struct crqa_result *out, unsigned int max, int timeout_ms)
+{
+	unsigned int n;
+
+	if (!c->fn && (!out || !max)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	n = crqa_reap(c);
+	while (!n && !c->done_count) {
+		int ret;
+
+		if (c->n_free == CRQA_QUEUE_DEPTH)
+			return 0;	// nothing in flight
+		ret = crqa_sleep(c, timeout_ms);
+		if (ret <= 0)
+			return ret;
+		n = crqa_reap(c);
+	}
+	if (c->fn)
+		return n;
+
+	for (n = 0; n < max && c->done_count; n++) {
+		out[n] = c->done[c->done_head];
+		c->done_head = (c->done_head + 1) % CRQA_QUEUE_DEPTH;
+		c->done_count--;
+	}
+	return n;
+}
+
+unsigned int crqa_inflight(struct crqa *c)
+{
+	return CRQA_QUEUE_DEPTH - c->n_free + c->done_count;
+}
+
+int crqa_fd(struct crqa *c)
+{
+	return c->fd;
+}
@@ -0,0 +1,94 @@
+/* libcrqa.h - queue CRQA windows on a crqa-pci-dev from user space
+ *
+ * The library maps the device file and drives its submission/completion
+ * rings itself (crqa_bar.h), so programs deal in jobs and results rather
+ * than offsets, fences and doorbells:
+ *
+ *	struct crqa *c = crqa_open(NULL);
+ *	crqa_set_callback(c, done, arg);
+ *	crqa_submit(c, jobs, n_jobs, NULL);
+ *	while (crqa_inflight(c))
+ *		crqa_wait_any(c, NULL, 0, -1);
+ *	crqa_close(c);
+ *
+ * crqa_submit() copies the samples into free data buffers and rings the
+ * doorbell every CRQA_LIB_BATCH windows, so the device computes on one half
+ * of the buffers while the next half is being filled. Jobs are numbered in
+ * submission order, from 1. Completions come back in completion order, to
+ * the callback if one is set, otherwise through crqa_wait_any().
+ *
+ * Samples already in the DMA area (crqa_dma_area()) are not copied at all:
+ * the device reads them there, and overlapping windows of one recording
+ * just point into it.
+ *
+ * A struct crqa has the device's queues to itself while it is open (other
+ * files get EBUSY from CRQA_IOC_SUBMIT) and is not thread-safe. Callbacks
+ * must not call crqa_submit() or crqa_wait_any().
+ *
+ * No shared object: build libcrqa.c into the program (cc main.c libcrqa.c).
+ */
+#ifndef LIBCRQA_H
+#define LIBCRQA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "crqa_bar.h"
+#include "crqa_pci.h"
+
+#define CRQA_LIB_BATCH  (CRQA_QUEUE_DEPTH / 2)  /* windows per doorbell */
+
+struct crqa;
+
+struct crqa_job {
+	uint64_t user;			/* returned in its crqa_result */
+	double   R;
+	uint32_t opcode;
+	uint16_t m;			/* 0: server default, as in crqa_sqe */
+	uint16_t tau;
+	uint16_t min_diag;
+	uint16_t min_vert;
+	const double *sig1;		/* CRQA_PROTO_SAMPLES each */
+	const double *sig2;
+};
+
+struct crqa_result {
+	uint64_t user;
+	uint64_t seq;			/* job number given at submission */
+	uint32_t status;		/* 0, CRQA_STATUS_* or CRQA_CQE_* */
+	double   res[8];		/* eps, rr, det, l, lmax, div, ent, lam */
+};
+
+typedef void (*crqa_callback)(struct crqa *c, const struct crqa_result *r, void *arg);
+
+/* Opens 'dev' (NULL: CRQA_PCI_DEV) and maps it. NULL with errno set on
+ * failure; EBUSY if the queues are in use. */
+struct crqa *crqa_open(const char *dev);
+void crqa_close(struct crqa *c);
+
+/* Deliver every completion to 'fn' from now on, NULL to keep them for
+ * crqa_wait_any(). */
+void crqa_set_callback(struct crqa *c, crqa_callback fn, void *arg);
+
+/* The part of the DMA area that is the program's, NULL if the driver has
+ * none. */
+void *crqa_dma_area(struct crqa *c, size_t *size);
+
+/* Queues 'count' jobs, waiting for free data buffers as needed (and
+ * delivering the completions that free them). Without a callback it stops
+ * early once completions not yet collected would fill CRQA_QUEUE_DEPTH.
+ * Returns the jobs queued, -1 with errno if none; '*seq' is the number of
+ * the last one. */
+int crqa_submit(struct crqa *c, const struct crqa_job *jobs, unsigned int count, uint64_t *seq);
+
+/* Waits up to timeout_ms (-1: forever) for a completion, then hands over
+ * every completion there is: to the callback, or up to 'max' into 'out'.
+ * Returns how many, 0 on timeout or with nothing in flight, -1 on error. */
+int crqa_wait_any(struct crqa *c, struct crqa_result *out, unsigned int max, int timeout_ms);
+
+/* Jobs queued and not yet handed over. */
+unsigned int crqa_inflight(struct crqa *c);
+
+/* The device file, to poll() for POLLIN along with other files. */
+int crqa_fd(struct crqa *c);
+
+#endif
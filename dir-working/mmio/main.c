@@ -1,25 +1,24 @@
-// main_smart.c - Smart DMA handling
+// main.c - queue CRQA windows on the crqa-pci-dev through libcrqa
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/mman.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
-#include <poll.h>
+#include "libcrqa.h"
 
 static inline uint64_t now_ns() {
 	struct timespec ts;
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
-#define DMA_OFFSET    0x10000
-#define TRIGGER_REG   0x1000
-#define TRIGGER_MAGIC 0xDEADBEEFDEADBEEFULL
 #define N_SAMPLES     512
+#define MAX_SAMPLES   (1 << 20)
+#define WINDOW_STEP   (N_SAMPLES / 2)
+#define R_FIRST       0.05
+#define R_STEP        0.05
 
+/* Returns the number of samples read (the rest of signal is zeroed). */
 static int load_signal_from_file(const char *filename, double *signal, int max_samples) {
 	FILE *fp = fopen(filename, "r");
 	if (!fp) {
@@ -37,175 +36,147 @@ static int load_signal_from_file(const char *filename, double *signal, int max_s
 	}
 	fclose(fp);
 
+	int n = i;
 	for (; i < max_samples; i++) signal[i] = 0.0;
-	printf("Loaded %d samples from %s\n", i, filename);
-	return 0;
+	printf("Loaded %d samples from %s\n", n, filename);
+	return n;
+}
+
+struct run {
+	int n_radii;
+	int done, failed;
+};
+
+static void print_result(struct crqa *c, const struct crqa_result *r, void *arg) {
+	struct run *run = arg;
+	const double *res = r->res;
+
+	(void)c;
+
+	if (r->status) {
+		printf("job %4lu: failed, status %u\n", (unsigned long)r->user, r->status);
+		run->failed++;
+	} else {
+		printf("job %4lu (window %4lu, R=%.2f): eps=%.6f RR=%.6f DET=%.6f L=%.6f "
+		       "Lmax=%.0f DIV=%.6f ENTR=%.6f LAM=%.6f\n",
+		       (unsigned long)r->user, (unsigned long)r->user / run->n_radii,
+		       R_FIRST + (r->user % run->n_radii) * R_STEP,
+		       res[0], res[1], res[2], res[3], res[4], res[5], res[6], res[7]);
+	}
+	run->done++;
 }
 
 int main(int argc, char *argv[]) {
 	const char *sig1_file = "systemc_input_F7_T7.txt";
 	const char *sig2_file = "systemc_input_FP1_F7.txt";
+	int n_radii = 8;
 
 	if (argc >= 3) {
 		sig1_file = argv[1];
 		sig2_file = argv[2];
 	}
+	if (argc >= 4) {
+		n_radii = atoi(argv[3]);
+		if (n_radii < 1) n_radii = 1;
+	}
 
-	double sig1[N_SAMPLES], sig2[N_SAMPLES];
-
-	printf("Loading signals...\n");
-	if (load_signal_from_file(sig1_file, sig1, N_SAMPLES) < 0 ||
-	                load_signal_from_file(sig2_file, sig2, N_SAMPLES) < 0) {
+	double *sig1 = malloc(MAX_SAMPLES * sizeof(double));
+	double *sig2 = malloc(MAX_SAMPLES * sizeof(double));
+	if (!sig1 || !sig2) {
+		perror("malloc");
 		return 1;
 	}
 
-	// Open device
-	int fd = open("/dev/cpcidev_pci", O_RDWR);
-	if (fd < 0) {
-		perror("open /dev/cpcidev_pci");
+	printf("Loading signals...\n");
+	int n1 = load_signal_from_file(sig1_file, sig1, MAX_SAMPLES);
+	int n2 = load_signal_from_file(sig2_file, sig2, MAX_SAMPLES);
+	if (n1 < 0 || n2 < 0) {
 		return 1;
 	}
 
-	// Map memory
-	void *base = mmap(NULL, 2*1024*1024, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if (base == MAP_FAILED) {
-		perror("mmap");
-		close(fd);
+	// Every window of WINDOW_STEP stride, each at n_radii radii
+	int len = n1 < n2 ? n1 : n2;
+	int n_windows = len > N_SAMPLES ? (len - N_SAMPLES) / WINDOW_STEP + 1 : 1;
+	int n_jobs = n_windows * n_radii;
+
+	struct crqa *c = crqa_open(NULL);
+	if (!c) {
+		perror("crqa_open " CRQA_PCI_DEV);
 		return 1;
 	}
 
-	uint8_t *dma = (uint8_t*)base + DMA_OFFSET;
-	volatile uint64_t *trigger = (volatile uint64_t*)((uint8_t*)base + TRIGGER_REG);
-
-	// Read current state and determine next ID
-	uint64_t current_id = *(uint64_t*)(dma + 16);
-	printf("\nCurrent DMA state:\n");
-	printf("  ID in DMA: %lu\n", current_id);
-	printf("  R value: %f\n", *(double*)dma);
-	printf("  Opcode: %u\n", *(uint32_t*)(dma + 8));
-
-	// Determine what ID to use
-	uint64_t use_id;
-	if (current_id == 0) {
-		use_id = 1;
-		printf("DMA appears fresh, starting with ID=1\n");
+	// DMA mode if the DMA area holds both recordings: they are put there
+	// once and every window points into them. Otherwise libcrqa copies
+	// each window into the BAR. A recording shorter than a window is its
+	// zero-padded N_SAMPLES.
+	size_t rec_bytes = (size_t)(len > N_SAMPLES ? len : N_SAMPLES) * sizeof(double);
+	size_t dma_size;
+	double *dma = crqa_dma_area(c, &dma_size);
+	const double *rec1 = sig1, *rec2 = sig2;
+	if (dma && dma_size >= 2 * rec_bytes) {
+		memcpy(dma, sig1, rec_bytes);
+		memcpy((uint8_t *)dma + rec_bytes, sig2, rec_bytes);
+		rec1 = dma;
+		rec2 = (double *)((uint8_t *)dma + rec_bytes);
+		printf("DMA mode: %zu-byte recordings in the %zu-byte DMA area\n", rec_bytes, dma_size);
 	} else {
-		use_id = current_id;
-		printf("Using existing ID=%lu from DMA\n", use_id);
+		printf("BAR mode: DMA area of %zu bytes, %zu needed\n", dma_size, 2 * rec_bytes);
 	}
 
-	printf("Checking if previous computation is in progress...\n");
-	int check_timeout = 100; // 100ms
-	while (*(uint64_t*)(dma + 16) != use_id && check_timeout-- > 0) {
-		printf("  Waiting for ID to stabilize... (current: %lu, expected: %lu)\n",
-		       *(uint64_t*)(dma + 16), use_id);
-		usleep(1000);
+	struct crqa_job *jobs = malloc((size_t)n_jobs * sizeof(*jobs));
+	if (!jobs) {
+		perror("malloc");
+		return 1;
+	}
+	for (int j = 0; j < n_jobs; j++) {
+		int w = j / n_radii;
+		int r = j % n_radii;
+
+		jobs[j] = (struct crqa_job){
+			.user = j,
+			.R = R_FIRST + r * R_STEP,
+			.opcode = 42,
+			.sig1 = rec1 + w * WINDOW_STEP,
+			.sig2 = rec2 + w * WINDOW_STEP,
+		};
 	}
 
-	// Write our parameters
-	printf("\nSetting up computation:\n");
-	printf("  R = 0.15\n");
-	printf("  Opcode = 42\n");
-	printf("  ID = %lu\n", use_id);
+	printf("\nQueueing %d windows x %d radii = %d jobs (queue depth %u)\n",
+	       n_windows, n_radii, n_jobs, CRQA_QUEUE_DEPTH);
+
+	struct run run = { .n_radii = n_radii };
+	crqa_set_callback(c, print_result, &run);
 
 	uint64_t start = now_ns();
 
-	*(double*)dma = 0.15;
-	*(uint32_t*)(dma + 8) = 42;
-	*(uint64_t*)(dma + 16) = use_id;
-
-	// Copy signals
-	memcpy(dma + 24, sig1, sizeof(sig1));
-	memcpy(dma + 24 + sizeof(sig1), sig2, sizeof(sig2));
-        
-	// BEFORE triggering computation:
-	printf("Clearing previous results!!!!!!!!!!!!!!...\n");
-	double *res_area = (double*)(dma + 24 + 8192);
-	memset(res_area, 0, 8 * sizeof(double));
-
-	// Memory barrier
-	asm volatile("fence w,w" ::: "memory");
-	// Trigger computation
-	printf("\nSending trigger...\n");
-	*trigger = TRIGGER_MAGIC;
-	asm volatile("fence w,w" ::: "memory");
-
-	// Wait for completion (ID should increment)
-	//printf("Waiting for computation (ID should change from %lu)...\n", use_id);
-
-	uint64_t start_id = use_id;
-
-	struct pollfd pfd = {
-		.fd = fd,
-		.events = POLLIN
-	};
-
-	printf("Waiting for CRQA completion (max 10 seconds)...\n");
-
-	int poll_result = poll(&pfd, 1, 10000);  // 10 second timeout
-	if (poll_result < 0) {
-		perror("poll failed");
-		// Handle error
-	} else if (poll_result == 0) {
-		printf("TIMEOUT: No interrupt received within 10 seconds\n");
-		// You can check if ID changed anyway (fallback)
-		if (*(uint64_t*)(dma + 16) != start_id) {
-			printf("ID changed without interrupt - reading results anyway\n");
-		} else {
-			printf("Computation seems to have failed\n");
-			goto cleanup;
+	// Returns once every job is queued, results of the first ones
+	// printed along the way
+	if (crqa_submit(c, jobs, n_jobs, NULL) < 0)
+		perror("crqa_submit");
+
+	while (crqa_inflight(c)) {
+		int n = crqa_wait_any(c, NULL, 0, 10000);  // 10 second timeout
+		if (n < 0) {
+			perror("crqa_wait_any");
+			break;
 		}
-	} else {
-		// poll succeeded
-		if (pfd.revents & POLLIN) {
-			printf("Device signaled data is ready!\n");
-		} else {
-			printf("Unexpected poll event: 0x%x\n", pfd.revents);
+		if (n == 0) {
+			printf("TIMEOUT: %u of %d jobs outstanding after 10 seconds\n",
+			       crqa_inflight(c), n_jobs);
+			break;
 		}
 	}
 
+	uint64_t end = now_ns();
+	double elapsed_ms = (end - start) / 1e6;
+	printf("\n=== %d of %d jobs complete, %d failed ===\n", run.done, n_jobs, run.failed);
+	printf("Total time = %.3f ms (%.3f ms per job)\n", elapsed_ms,
+	       run.done ? elapsed_ms / run.done : 0.0);
 
+	crqa_close(c);
+	free(jobs);
+	free(sig1);
+	free(sig2);
 
-	uint64_t final_id = *(uint64_t*)(dma + 16);
-	if (final_id != start_id) {
-
-		uint64_t end = now_ns();
-		double elapsed_ms = (end - start) / 1e6;
-		printf("CRQA cycle time = %.3f ms\n", elapsed_ms);
-
-		double *res = (double*)(dma + 24 + 8192);
-		printf("\n=== COMPUTATION COMPLETE ===\n");
-		printf("ID changed: %lu -> %lu\n", start_id, final_id);
-		printf("Execution time: %d ms\n", timeout);
-		printf("\n=== CRQA RESULTS ===\n");
-		printf("Epsilon = %.6f\n", res[0]);
-		printf("RR      = %.6f\n", res[1]);
-		printf("DET     = %.6f\n", res[2]);
-		printf("L       = %.6f\n", res[3]);
-		printf("L_max   = %.6f\n", res[4]);
-		printf("DIV     = %.6f\n", res[5]);
-		printf("ENTR    = %.6f\n", res[6]);
-		printf("LAM     = %.6f\n", res[7]);
-
-		// Save the final state for next run
-		printf("\nNext run should use ID = %lu\n", final_id);
-	} else {
-		printf("\nCOMPUTATION FAILED\n");
-		printf("ID unchanged: %lu\n", final_id);
-		printf("Possible issues:\n");
-		printf("  1. SystemC server not running\n");
-		printf("  2. QEMU device not loaded\n");
-		printf("  3. Socket connection failed\n");
-
-		// Try to diagnose
-		printf("\nDebug info:\n");
-		printf("  Trigger register: 0x%lx\n", *trigger);
-		printf("  DMA ID field: %lu\n", final_id);
-	}
-
-	// Cleanup
-	munmap(base, 2*1024*1024);
-	close(fd);
-
-	return (final_id != start_id) ? 0 : 1;
+	return (run.done == n_jobs && run.failed == 0) ? 0 : 1;
 }
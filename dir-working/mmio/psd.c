@@ -1,28 +1,46 @@
 /* psd.c - QEMU PCI Device - CRQA Accelerator */
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qapi/error.h"
 #include "hw/pci/pci.h"
+#include "hw/pci/pci_device.h"
 #include "hw/pci/msi.h"
+#include "hw/pci/msix.h"
 #include "hw/irq.h"
+#include "hw/qdev-properties.h"
 #include "qom/object.h"
 #include "qemu/module.h"
-#include "hw/riscv/msi_harts.h"
-#include "hw/intc/riscv_imsic.h" 
+#include "qemu/memfd.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qemu/event_notifier.h"
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
+#include "crqa_proto.h"
+#include "crqa_bar.h"
 
 #define SOCKET_PATH      "/tmp/crqa_socket"
-#define N_SAMPLES        512
+#define N_SAMPLES        CRQA_PROTO_SAMPLES
 #define BUFFER_OFFSET    0x10000        /* shared buffer starts at 64 KB */
 #define BUFFER_SIZE      (16 * 1024)    /* 16 KB shared buffer */
 #define TRIGGER_REG      0x1000
 #define TRIGGER_MAGIC    0xDEADBEEFDEADBEEFULL
+#define RESULT_OFFSET    (24 + 8192)    /* 8 doubles of the last completion */
+#define DONE_TAG_OFFSET  (RESULT_OFFSET + 64)   /* job id those results belong to */
+#define CRQA_MAX_INFLIGHT 32            /* request frames outstanding at SystemC */
+#define RAM_SIZE         (CRQA_DATA_END - BUFFER_OFFSET)  /* job slot, queues, data buffers */
+#define CRQA_QUEUE_TAG   (1ULL << 63)   /* frame tags of queued windows */
+#define CRQA_CONNECT_ATTEMPTS 3         /* before waiting work is failed */
+#define CRQA_RECONNECT_MS    100        /* backoff step between attempts */
+
+QEMU_BUILD_BUG_ON(BUFFER_OFFSET + DONE_TAG_OFFSET != CRQA_LEGACY_DONE_TAG);
 
 #define TYPE_PCI_CRQADEV "crqa-pci-dev"
 
@@ -33,120 +51,185 @@ struct CrqaDevState {
     PCIDevice parent_obj;
     MemoryRegion mmio;
     MemoryRegion buffer_mr;     /* renamed from dma_mr */
-    uint8_t *buffer;            /* renamed from dma_buf */
+    uint8_t *buffer;            /* renamed from dma_buf; RAM_SIZE bytes at BUFFER_OFFSET */
+    int buffer_fd;              /* memfd behind buffer, shared with SystemC; -1 if inline */
     uint64_t trigger_counter;
+    char *socket_path;          /* "socket" property, SOCKET_PATH by default */
     int sockfd;                 /* persistent socket */
     int eventfd;		/* used for the notification mechanism (SystemC--> QEMU) */
+    unsigned connect_failures;  /* attempts since the last connection */
+    QEMUTimer *reconnect_timer;
   
     QEMUBH *irq_bh;
     bool pending_irq; 
 
+    /* TRIGGER_REG doorbell (an ioeventfd) and the job it accepted; its
+     * samples go out straight from the job slot */
+    EventNotifier trigger_notifier;
+    bool     legacy_pending;    /* accepted, not all sent to SystemC yet */
+    uint64_t legacy_tag;
     double   R;
     uint32_t opcode;
-    double   sig1[N_SAMPLES];
-    double   sig2[N_SAMPLES];
-    double   results[8];
+
+    /* frame tags sent to SystemC and not answered yet */
+    uint64_t inflight[CRQA_MAX_INFLIGHT];
+    unsigned n_inflight;
+
+    /* submission/completion queues, see crqa_bar.h */
+    uint32_t sq_tail;           /* last doorbell */
+    uint32_t sq_head;           /* next entry to consume */
+    struct {
+        uint32_t prod;          /* completions written to the ring */
+        uint32_t tail;          /* completions published to the guest */
+        uint32_t head;          /* completions read by the guest */
+        uint32_t signalled;     /* completions an interrupt was raised for */
+    } cq[CRQA_NUM_CQ];
+    uint32_t coal_count;        /* CRQA_REG_COAL_* */
+    uint32_t coal_usec;
+    QEMUTimer *coal_timer;      /* oldest unsignalled completion waited enough */
+    uint32_t q_outstanding;     /* queued windows at SystemC */
+    uint64_t q_seq;
+    QEMUBH *submit_bh;          /* SQ/CQ doorbells are served from here */
+    struct {
+        uint64_t tag;           /* frame carrying the window, 0 if idle */
+        uint64_t id;
+        uint32_t pos;           /* window index within that frame */
+        uint16_t cq;            /* completion ring of the entry */
+        bool     dma;           /* results go to dma_result */
+        uint64_t dma_result;
+    } qbuf[CRQA_QUEUE_DEPTH];
+    uint64_t dma_base;          /* DMA area registered by the driver */
+    uint32_t dma_size;
+
+    /* frame being sent: header and windows here, samples gathered from the
+     * BAR. What the non-blocking socket does not take at once is finished
+     * by crqa_tx_ready(); no other frame starts until then. */
+    struct crqa_frame_hdr tx_hdr;
+    union {
+        struct crqa_window win[CRQA_QUEUE_DEPTH];
+        struct crqa_shm_window shm[CRQA_QUEUE_DEPTH];
+    } tx;
+    struct iovec tx_iov[2 + 2 * CRQA_QUEUE_DEPTH];
+    unsigned tx_pos, tx_cnt;    /* iovecs left to send, 0 if idle */
+    bool tx_legacy;             /* the frame is the accepted trigger */
+
+    /* response frame being received (the socket is non-blocking); results
+     * beyond what a frame of ours can carry are discarded */
+    struct {
+        struct crqa_frame_hdr hdr;
+        union {
+            struct crqa_window_result res[CRQA_QUEUE_DEPTH];
+            uint32_t status[CRQA_QUEUE_DEPTH];  /* zero-copy frames */
+        };
+    } __attribute__((packed)) rx;
+    size_t rx_off;              /* bytes of the current frame received */
+
+    /* matched responses waiting for the IRQ bottom half */
+    struct {
+        uint64_t tag;
+        double   results[8];
+    } done[CRQA_MAX_INFLIGHT];
+    unsigned done_head, done_count;
 };
 
-static void crqa_irq_bh(void *opaque)
+/* One interrupt on 'vector': MSI-X vector per completion ring if the driver
+ * enabled MSI-X, else the single MSI. */
+static void crqa_raise_msi(PCIDevice *pdev, unsigned vector)
 {
-    CrqaDevState *s = opaque;
-    PCIDevice *pdev = PCI_DEVICE(s);
-    
-    if (!s->pending_irq) {
-        return;
+    if (msix_enabled(pdev)) {
+        msix_notify(pdev, vector);
+    } else if (msi_enabled(pdev)) {
+        MSIMessage msg = msi_get_message(pdev, 0);
+
+        stl_le_phys(&address_space_memory, msg.address, msg.data);
     }
+}
 
-    s->pending_irq = false;
+/* Interrupts for the rings with enough unsignalled completions (all that
+ * have any once the coalescing timer 'expired'), plus vector 0 if 'raise'.
+ * The others wait for the timer, or with coal_usec 0 for the count alone. */
+static void crqa_raise_rings(CrqaDevState *s, bool raise, bool expired)
+{
+    PCIDevice *pdev = PCI_DEVICE(s);
+    bool msix = msix_enabled(pdev);
+    bool waiting = false;
 
-    if (!msi_enabled(pdev)) {
-        /* case where driver not ready yet */
-        return;
-    }
+    for (unsigned q = 0; q < CRQA_NUM_CQ; q++) {
+        uint32_t pending = s->cq[q].tail - s->cq[q].signalled;
 
-    //testing
-    /*
-     MSIMessage msg = msi_get_message(pdev, 0);
-     printf("CRQA_DEV: MSI message - address: 0x%"PRIx64", data: 0x%x\n", msg.address, msg.data);
-        // Check if address is in IMSIC range
-     if ((msg.address & 0xffffffff) != 0x28000000) {
-        printf("CRQA_DEV: WARNING: MSI address 0x%"PRIx64" not in IMSIC range!\n", msg.address);
-     }
-    */ 
-    //copy results and do MSI.
-    // Check what results SystemC sent
-    printf("SystemC results stored in s->results:\n");
-    for (int i = 0; i < 8; i++) {
-        printf("  results[%d] = %f\n", i, s->results[i]);
+        if (pending == 0) {
+            continue;
+        }
+        if (pending < s->coal_count && !expired) {
+            waiting = true;
+            continue;
+        }
+        s->cq[q].signalled = s->cq[q].tail;
+        if (msix && q) {
+            crqa_raise_msi(pdev, q);
+        } else {
+            raise = true;
+        }
     }
+    if (raise) {
+        crqa_raise_msi(pdev, 0);
+    }
+    if (waiting && s->coal_usec && !timer_pending(s->coal_timer)) {
+        timer_mod(s->coal_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  (int64_t)s->coal_usec * SCALE_US);
+    }
+}
 
+static void crqa_coal_expired(void *opaque)
+{
+    crqa_raise_rings(opaque, false, true);
+}
 
-    uint8_t *buf = s->buffer;
-    double *res = (double *)(buf + 24 + 8192);
-
-    memcpy(res, s->results, sizeof(s->results));
-//    s->trigger_counter++;
-//    *(uint64_t *)(buf + 16) = s->trigger_counter;
+static void crqa_irq_bh(void *opaque)
+{
+    CrqaDevState *s = opaque;
     
-    // Check what's in the buffer AFTER copying
-    printf("Buffer results AFTER copy:\n");
-    for (int i = 0; i < 8; i++) {
-        printf("  buffer[%d] = %f\n", i, res[i]);
+    if (!s->pending_irq) {
+        return;
     }
-    
-
-    printf("=== CRQA IRQ BH ===\n");
-
-    if (msi_enabled(pdev)) {
-        MSIMessage msg = msi_get_message(pdev, 0);
-
-        printf("Current MSI config:\n");
-        printf("  Address: 0x%"PRIx64"\n", msg.address);
-        printf("  Data: 0x%x\n", msg.data);
 
-	stl_le_phys(&address_space_memory,msg.address, msg.data);
-/*
-        // Test: Try MSI to hart 0
-        printf("\nTesting MSI to hart 0 (address 0x28000000):\n");
-        MSIMessage test_msg_0;
-        test_msg_0.address = 0x28000000;
-        test_msg_0.data = msg.data;  // Your vector
+    s->pending_irq = false;
 
-        printf("  Writing to 0x28000000...\n");
-        stl_le_phys(&address_space_memory, test_msg_0.address, test_msg_0.data);
+    /* without MSI (driver not ready yet) results are still published */
 
-        // Test: Try MSI to hart 1
-        printf("\nTesting MSI to hart 1 (address 0x28001000):\n");
-        MSIMessage test_msg_1;
-        test_msg_1.address = 0x28001000;
-        test_msg_1.data = msg.data;
+    //copy results in arrival order, then one MSI for the whole batch.
+    bool raise = false;
+    while (s->done_count > 0) {
+        unsigned i = s->done_head;
+        uint8_t *buf = s->buffer;
+        double *res = (double *)(buf + RESULT_OFFSET);
 
-        printf("  Writing to 0x28001000...\n");
-        stl_le_phys(&address_space_memory, test_msg_1.address, test_msg_1.data);
+        memcpy(res, s->done[i].results, sizeof(s->done[i].results));
+        *(uint64_t *)(buf + DONE_TAG_OFFSET) = s->done[i].tag;
+        s->done_head = (i + 1) % CRQA_MAX_INFLIGHT;
+        s->done_count--;
 
-        // Also try the configured address
-//        printf("\nTrying configured address:\n");
- //       msi_notify(pdev, 0);
-*/
+        printf("CRQAPCI: job %lu done: eps=%f RR=%f DET=%f LAM=%f\n",
+               s->done[i].tag, res[0], res[1], res[2], res[7]);
+        raise = true;
     }
 
-   
-    //MSI notify
-/*     
-    if (msi_enabled(pdev)) {
-	printf("CRQA_DEV: calling msi_notify()\n");
-        msi_notify(pdev, 0);
+    /* completion entries are already in their rings; publish each ring's
+     * together, signalled on its own MSI-X vector (legacy jobs share ring
+     * 0's) or all on the one MSI, as coalescing allows */
+    for (unsigned q = 0; q < CRQA_NUM_CQ; q++) {
+        s->cq[q].tail = s->cq[q].prod;
     }
-*/    
-    //working for SMP 1 triggers an MSI observable in linux kernel driver.
-    //printf("test\n");
-    //riscv_imsic_set_pending(msi_harts[0], 5);
+    crqa_raise_rings(s, raise, false);
 }
 
-static int send_eventfd(int sock, int eventfd)
+/* Hand SystemC our eventfd and, if the buffer is a memfd, the buffer. */
+static int send_eventfd(int sock, int eventfd, int buffer_fd)
 {
     struct msghdr msg = {};
-    char buf[CMSG_SPACE(sizeof(int))];
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    int fds[2] = { eventfd, buffer_fd };
+    int nfds = buffer_fd >= 0 ? 2 : 1;
     struct iovec iov;
     char dummy = 'E';
 
@@ -156,122 +239,520 @@ static int send_eventfd(int sock, int eventfd)
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
     msg.msg_control = buf;
-    msg.msg_controllen = sizeof(buf);
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
 
     struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
     cmsg->cmsg_level = SOL_SOCKET;
     cmsg->cmsg_type  = SCM_RIGHTS;
-    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_len   = CMSG_LEN(nfds * sizeof(int));
 
-    memcpy(CMSG_DATA(cmsg), &eventfd, sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
 
     if (sendmsg(sock, &msg, 0) < 0) {
         perror("sendmsg(eventfd)");
         return -1;
     }
 
-    printf("QEMU: sent eventfd %d to SystemC\n", eventfd);
+    printf("QEMU: sent eventfd %d%s to SystemC\n", eventfd,
+           buffer_fd >= 0 ? " and shared buffer" : "");
     return 0;
 }
 
-/* ────────────────────────────────────────────────────────────────────── */
-static int connect_to_systemc(CrqaDevState *s)
+/* Write a completion entry to ring 'q'; the BH publishes it. */
+static void crqa_post_cqe(CrqaDevState *s, unsigned q, uint16_t buf, uint64_t id,
+                          uint32_t status)
+{
+    struct crqa_cqe *cq = (struct crqa_cqe *)(s->buffer + CRQA_CQ_OFFSET + q * CRQA_CQ_STRIDE - BUFFER_OFFSET);
+    struct crqa_cqe *e = &cq[s->cq[q].prod % CRQA_QUEUE_DEPTH];
+
+    e->id = id;
+    e->buf = buf;
+    e->status = status;
+    /* the phase last: it tells a polling guest the entry is complete */
+    smp_wmb();
+    e->flags = (s->cq[q].prod / CRQA_QUEUE_DEPTH) & 1 ? 0 : CRQA_CQE_PHASE;
+    s->cq[q].prod++;
+    s->pending_irq = true;
+}
+
+/* Completion ring named by a submission entry; a bad one gets the
+ * CRQA_STATUS_BAD_REQ completion on ring 0. */
+static unsigned crqa_sqe_cq(const struct crqa_sqe *e)
+{
+    return e->cq < CRQA_NUM_CQ ? e->cq : 0;
+}
+
+/* Queue the results of a legacy job for the BH. */
+static void crqa_post_done(CrqaDevState *s, uint64_t tag, const struct crqa_window_result *res)
+{
+    if (s->done_count == CRQA_MAX_INFLIGHT) {
+        /* BH has not run for a whole window of completions */
+        printf("CRQAPCI: completion of job %lu overwritten\n", s->done[s->done_head].tag);
+        s->done_head = (s->done_head + 1) % CRQA_MAX_INFLIGHT;
+        s->done_count--;
+    }
+    unsigned slot = (s->done_head + s->done_count) % CRQA_MAX_INFLIGHT;
+    s->done[slot].tag = tag;
+    memcpy(s->done[slot].results, &res->eps, sizeof(s->done[slot].results));
+    s->done_count++;
+    s->pending_irq = true;
+}
+
+/* Drop the connection. Legacy requests still in flight on it are lost;
+ * queued windows complete with CRQA_CQE_IO_ERROR. */
+static void crqa_disconnect(CrqaDevState *s)
 {
-    // if socket is already created, we execute here.
     if (s->sockfd >= 0) {
-	printf("sockfd: %d\n",s->sockfd);
-        int error = 0;
-        socklen_t len = sizeof(error);
-        int ret = getsockopt(s->sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
-        if (ret == 0 && error == 0)
-	{
-	    printf("QEMU crqa-dev: sockfd already alive\n");
-            return 0;
-	}
+        qemu_set_fd_handler(s->sockfd, NULL, NULL, NULL);
         close(s->sockfd);
-        s->sockfd = -1;
     }
+    s->sockfd = -1;
+    s->n_inflight = 0;
+    s->rx_off = 0;
+    s->tx_cnt = 0;              /* an accepted trigger is sent again */
+    s->tx_legacy = false;
+
+    for (unsigned b = 0; b < CRQA_QUEUE_DEPTH; b++) {
+        if (s->qbuf[b].tag) {
+            s->qbuf[b].tag = 0;
+            crqa_post_cqe(s, s->qbuf[b].cq, b, s->qbuf[b].id, CRQA_CQE_IO_ERROR);
+        }
+    }
+    s->q_outstanding = 0;
+    if (s->pending_irq) {
+        qemu_bh_schedule(s->irq_bh);
+    }
+}
+
+static void crqa_tx_ready(void *opaque);
+
+/* Send what is left of the tx frame. Returns 1 once it is all out, 0 if
+ * the socket is full (crqa_tx_ready() carries on when it drains) and -1
+ * on error. */
+static int crqa_tx_flush(CrqaDevState *s)
+{
+    while (s->tx_cnt > 0) {
+        struct msghdr msg = {
+            .msg_iov = s->tx_iov + s->tx_pos,
+            .msg_iovlen = s->tx_cnt,
+        };
+        ssize_t n = sendmsg(s->sockfd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                qemu_set_fd_handler(s->sockfd, NULL, crqa_tx_ready, s);
+                return 0;
+            }
+            return -1;
+        }
+        while (s->tx_cnt > 0 && (size_t)n >= s->tx_iov[s->tx_pos].iov_len) {
+            n -= s->tx_iov[s->tx_pos].iov_len;
+            s->tx_pos++;
+            s->tx_cnt--;
+        }
+        if (s->tx_cnt > 0) {
+            struct iovec *iov = &s->tx_iov[s->tx_pos];
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+/* Submission entries that can go out now: whichever rings they complete
+ * to, there must be room for all of them. */
+static uint32_t crqa_queue_take(CrqaDevState *s)
+{
+    uint32_t room = CRQA_QUEUE_DEPTH - s->q_outstanding;
+
+    for (unsigned q = 0; q < CRQA_NUM_CQ; q++) {
+        room -= s->cq[q].prod - s->cq[q].head;
+    }
+    uint32_t avail = s->sq_tail - s->sq_head;
+
+    return avail < room ? avail : room;
+}
+
+/* The accepted trigger is out of the job slot (or failed): advancing the id
+ * hands the slot back to the guest. */
+static void crqa_legacy_sent(CrqaDevState *s)
+{
+    s->legacy_pending = false;
+    s->trigger_counter++;
+    *(uint64_t *)(s->buffer + 16) = s->trigger_counter;
+}
+
+/* SystemC stayed unreachable: the accepted trigger completes with zero
+ * results and submitted windows with CRQA_CQE_IO_ERROR. */
+static void crqa_fail_pending(CrqaDevState *s)
+{
+    struct crqa_sqe *sq = (struct crqa_sqe *)(s->buffer + CRQA_SQ_OFFSET - BUFFER_OFFSET);
+    uint32_t take = crqa_queue_take(s);
+
+    if (s->legacy_pending) {
+        static const struct crqa_window_result none;
+        printf("CRQAPCI: job %lu failed, SystemC unreachable\n", s->legacy_tag);
+        crqa_legacy_sent(s);
+        crqa_post_done(s, s->legacy_tag, &none);
+    }
+    if (take) {
+        printf("CRQAPCI: failing %u queued windows, SystemC unreachable\n", take);
+    }
+    for (uint32_t i = 0; i < take; i++) {
+        struct crqa_sqe *e = &sq[(s->sq_head + i) % CRQA_QUEUE_DEPTH];
+        crqa_post_cqe(s, crqa_sqe_cq(e), e->buf, e->id, CRQA_CQE_IO_ERROR);
+    }
+    s->sq_head += take;
+    if (s->pending_irq) {
+        qemu_bh_schedule(s->irq_bh);
+    }
+}
+
+static void crqa_connect_failed(CrqaDevState *s, int err)
+{
+    if (++s->connect_failures < CRQA_CONNECT_ATTEMPTS) {
+        printf("CRQAPCI: SystemC not reachable (%s), retry %u/%d in %d ms\n", strerror(err),
+               s->connect_failures, CRQA_CONNECT_ATTEMPTS - 1,
+               CRQA_RECONNECT_MS * s->connect_failures);
+        timer_mod(s->reconnect_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  CRQA_RECONNECT_MS * s->connect_failures);
+        return;
+    }
+    printf("CRQAPCI: Failed to connect to SystemC after %d attempts\n", CRQA_CONNECT_ATTEMPTS);
+    s->connect_failures = 0;
+    crqa_fail_pending(s);
+}
 
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+/* ────────────────────────────────────────────────────────────────────── */
+/* Make sure the socket is up, without ever waiting for SystemC: a
+ * non-blocking AF_UNIX connect succeeds or fails on the spot (EAGAIN with
+ * the listen backlog full). On failure a retry is scheduled and false
+ * returned; the caller leaves its work pending for crqa_reconnect(). */
+static bool crqa_connect(CrqaDevState *s)
+{
+    if (s->sockfd >= 0) {
+        return true;
+    }
+    if (timer_pending(s->reconnect_timer)) {
+        return false;           /* backing off */
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd < 0) {
         printf("CRQAPCI: socket() failed: %s\n", strerror(errno));
-        return -1;
+        crqa_connect_failed(s, errno);
+        return false;
     }
 
-    /*making non-blocking the socket.*/
-    int flags = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-
     struct sockaddr_un addr = { .sun_family = AF_UNIX };
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path)-1);
+    strncpy(addr.sun_path, s->socket_path, sizeof(addr.sun_path)-1);
 
-    printf("CRQAPCI: Connecting to SystemC at %s...\n", SOCKET_PATH);
-    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        printf("CRQAPCI: connect() failed: %s\n", strerror(errno));
+    printf("CRQAPCI: Connecting to SystemC at %s...\n", s->socket_path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        send_eventfd(fd, s->eventfd, s->buffer_fd) < 0) {
+        int err = errno;
         close(fd);
-        return -1;
+        crqa_connect_failed(s, err);
+        return false;
     }
 
     printf("CRQAPCI: Connected to SystemC (fd=%d)\n", fd);
+    s->sockfd = fd;
+    s->connect_failures = 0;
+    return true;
+}
 
-    
-    /* SEND EVENTFD ONCE */
-    send_eventfd(fd, s->eventfd);
+/* Start sending the frame set up in tx_hdr and tx_iov[1..cnt-1]. */
+static void crqa_tx_start(CrqaDevState *s, uint64_t tag, int cnt)
+{
+    s->tx_iov[0] = (struct iovec){ &s->tx_hdr, sizeof(s->tx_hdr) };
+    s->tx_pos = 0;
+    s->tx_cnt = cnt;
+    s->inflight[s->n_inflight++] = tag;
+    crqa_tx_ready(s);
+}
 
+/* Send the accepted trigger as a one-window frame, once connected and no
+ * other frame is being sent. */
+static void crqa_send_legacy(CrqaDevState *s)
+{
+    if (!s->legacy_pending || s->tx_cnt || s->n_inflight == CRQA_MAX_INFLIGHT ||
+        !crqa_connect(s)) {
+        return;
+    }
 
-    s->sockfd = fd;
-    return 0;
+    uint8_t *buf = s->buffer;
+    int iovcnt;
+
+    if (s->buffer_fd >= 0) {
+        /* doorbell: where the window lives in the shared buffer */
+        s->tx.shm[0] = (struct crqa_shm_window){
+            .w = { .R = s->R, .n = N_SAMPLES, .opcode = s->opcode },
+            .sig1_off = 24,
+            .sig2_off = 24 + 4096,
+            .result_off = RESULT_OFFSET,
+        };
+        crqa_frame_hdr_init(&s->tx_hdr, s->legacy_tag, 1, crqa_shm_payload_len(1));
+        s->tx_hdr.flags = CRQA_FRAME_SHM;
+        s->tx_iov[1] = (struct iovec){ &s->tx.shm[0], sizeof(s->tx.shm[0]) };
+        iovcnt = 2;
+    } else {
+        /* one frame holding one window, the samples gathered from the job
+         * slot; m, tau and min lengths left to the server */
+        s->tx.win[0] = (struct crqa_window){ .R = s->R, .n = N_SAMPLES, .opcode = s->opcode };
+        crqa_frame_hdr_init(&s->tx_hdr, s->legacy_tag, 1, crqa_request_payload_len(&s->tx.win[0], 1));
+        s->tx_iov[1] = (struct iovec){ &s->tx.win[0], sizeof(s->tx.win[0]) };
+        s->tx_iov[2] = (struct iovec){ buf + 24, N_SAMPLES * sizeof(double) };
+        s->tx_iov[3] = (struct iovec){ buf + 24 + 4096, N_SAMPLES * sizeof(double) };
+        iovcnt = 4;
+    }
+    s->tx_legacy = true;
+    crqa_tx_start(s, s->legacy_tag, iovcnt);
 }
 
-static int request_crqa(CrqaDevState *s)
+static bool crqa_dma_range_ok(CrqaDevState *s, uint64_t off, uint64_t len)
 {
-    if (connect_to_systemc(s) < 0) {
-        printf("CRQAPCI: Failed to connect to SystemC\n");
-        return -1;
+    return off <= s->dma_size && len <= s->dma_size - off;
+}
+
+/* Fetch the samples of a DMA-mode entry into its slot's data buffer, from
+ * where they go out like those of any other window. */
+static uint32_t crqa_dma_fetch(CrqaDevState *s, const struct crqa_sqe *e, uint8_t *data)
+{
+    PCIDevice *pdev = PCI_DEVICE(s);
+    const dma_addr_t sig_len = N_SAMPLES * sizeof(double);
+
+    if (!crqa_dma_range_ok(s, e->sig1_off, sig_len) ||
+        !crqa_dma_range_ok(s, e->sig2_off, sig_len) ||
+        !crqa_dma_range_ok(s, e->result_off, 8 * sizeof(double))) {
+        printf("CRQAPCI: queued job %lu outside the %u-byte DMA area\n", e->id, s->dma_size);
+        return CRQA_CQE_DMA_ERROR;
     }
+    if (pci_dma_read(pdev, s->dma_base + e->sig1_off, data + CRQA_DATA_SIG1, sig_len) != MEMTX_OK ||
+        pci_dma_read(pdev, s->dma_base + e->sig2_off, data + CRQA_DATA_SIG2, sig_len) != MEMTX_OK) {
+        printf("CRQAPCI: DMA read for queued job %lu failed\n", e->id);
+        return CRQA_CQE_DMA_ERROR;
+    }
+    return CRQA_STATUS_OK;
+}
 
-    struct {
-        double   R;
-        double   sig1[N_SAMPLES];
-        double   sig2[N_SAMPLES];
-        int32_t  opcode;
-        int32_t  ready;
-    } __attribute__((packed)) msg = {
-        .R = s->R,
-        .opcode = s->opcode,
-        .ready = 1
-    };
-    memcpy(msg.sig1, s->sig1, sizeof(msg.sig1));
-    memcpy(msg.sig2, s->sig2, sizeof(msg.sig2));
+/* Send every submission entry the completion ring has room for, as one
+ * frame. Called from the doorbell BH and whenever completions free up room. */
+static void crqa_queue_submit(CrqaDevState *s)
+{
+    struct crqa_sqe *sq = (struct crqa_sqe *)(s->buffer + CRQA_SQ_OFFSET - BUFFER_OFFSET);
+    uint32_t take = crqa_queue_take(s);
 
-    ssize_t n = write(s->sockfd, &msg, sizeof(msg));
-    if (n != sizeof(msg)) {
-        printf("CRQAPCI: Write failed (%zd bytes): %s\n", n, strerror(errno));
-        close(s->sockfd);
-        s->sockfd = -1;
-        return -1;
+    if (take == 0 || s->n_inflight == CRQA_MAX_INFLIGHT || s->tx_cnt) {
+        return;
+    }
+    if (!crqa_connect(s)) {
+        return;                 /* entries stay in the ring until connected */
     }
 
-    /*
-    n = read(s->sockfd, &s->results, sizeof(s->results));
-    if (n != sizeof(s->results)) {
-        printf("CRQAPCI: Read failed (%zd bytes): %s\n", n, strerror(errno));
-        close(s->sockfd);
-        s->sockfd = -1;
-        return -1;
+    uint64_t tag = CRQA_QUEUE_TAG | ++s->q_seq;
+    uint32_t count = 0;
+    int iovcnt = 2;
+
+    for (uint32_t i = 0; i < take; i++) {
+        struct crqa_sqe e = sq[(s->sq_head + i) % CRQA_QUEUE_DEPTH];
+        unsigned q = crqa_sqe_cq(&e);
+        if (e.buf >= CRQA_QUEUE_DEPTH || s->qbuf[e.buf].tag || e.cq != q) {
+            printf("CRQAPCI: queued job %lu names bad or busy buffer %u, or ring %u\n",
+                   e.id, e.buf, e.cq);
+            crqa_post_cqe(s, q, e.buf, e.id, CRQA_STATUS_BAD_REQ);
+            continue;
+        }
+
+        uint64_t data = CRQA_DATA_OFFSET + (uint64_t)e.buf * CRQA_DATA_STRIDE - BUFFER_OFFSET;
+        if (e.flags & CRQA_SQE_DMA) {
+            uint32_t status = crqa_dma_fetch(s, &e, s->buffer + data);
+            if (status != CRQA_STATUS_OK) {
+                crqa_post_cqe(s, q, e.buf, e.id, status);
+                continue;
+            }
+        }
+        struct crqa_window w = {
+            .R = e.R, .n = N_SAMPLES, .m = e.m, .tau = e.tau,
+            .min_diag = e.min_diag, .min_vert = e.min_vert, .opcode = e.opcode,
+        };
+        if (s->buffer_fd >= 0) {
+            s->tx.shm[count].w = w;
+            s->tx.shm[count].sig1_off = data + CRQA_DATA_SIG1;
+            s->tx.shm[count].sig2_off = data + CRQA_DATA_SIG2;
+            s->tx.shm[count].result_off = CRQA_RESULTS_OFFSET + (uint64_t)e.buf * CRQA_RESULT_SIZE - BUFFER_OFFSET;
+        } else {
+            /* the guest leaves the buffer alone until the cqe, so the
+             * samples go out straight from it */
+            s->tx.win[count] = w;
+            s->tx_iov[iovcnt++] = (struct iovec){ s->buffer + data + CRQA_DATA_SIG1, N_SAMPLES * sizeof(double) };
+            s->tx_iov[iovcnt++] = (struct iovec){ s->buffer + data + CRQA_DATA_SIG2, N_SAMPLES * sizeof(double) };
+        }
+        s->qbuf[e.buf].tag = tag;
+        s->qbuf[e.buf].id = e.id;
+        s->qbuf[e.buf].pos = count++;
+        s->qbuf[e.buf].cq = q;
+        s->qbuf[e.buf].dma = e.flags & CRQA_SQE_DMA;
+        s->qbuf[e.buf].dma_result = s->dma_base + e.result_off;
+    }
+    s->sq_head += take;
+
+    if (count == 0) {
+        qemu_bh_schedule(s->irq_bh);
+        return;
+    }
+
+    if (s->buffer_fd >= 0) {
+        crqa_frame_hdr_init(&s->tx_hdr, tag, count, crqa_shm_payload_len(count));
+        s->tx_hdr.flags = CRQA_FRAME_SHM;
+        s->tx_iov[1] = (struct iovec){ s->tx.shm, count * sizeof(s->tx.shm[0]) };
+    } else {
+        crqa_frame_hdr_init(&s->tx_hdr, tag, count, crqa_request_payload_len(s->tx.win, count));
+        s->tx_iov[1] = (struct iovec){ s->tx.win, count * sizeof(s->tx.win[0]) };
+    }
+
+    s->q_outstanding += count;
+    crqa_tx_start(s, tag, iovcnt);
+    if (s->pending_irq) {
+        qemu_bh_schedule(s->irq_bh);
     }
-   */
-    //printf("CRQAPCI: Got results: epsilon=%.6f, RR=%.6f, DET=%.6f, L=%.6f\n",
-     //      s->results[0], s->results[1], s->results[2], s->results[3]);
+}
+
+/* Socket writable (or a frame just set up): carry on sending the tx frame,
+ * then whatever waited for it. */
+static void crqa_tx_ready(void *opaque)
+{
+    CrqaDevState *s = opaque;
+    int ret = crqa_tx_flush(s);
+    int err = errno;
 
-    return 0;   /* socket intentionally left open */
+    if (ret == 0) {
+        return;
+    }
+    qemu_set_fd_handler(s->sockfd, NULL, NULL, NULL);
+    if (ret < 0) {
+        printf("CRQAPCI: Write of job %lu failed: %s\n", s->tx_hdr.tag, strerror(err));
+        crqa_disconnect(s);
+        crqa_connect_failed(s, err);    /* an accepted trigger stays pending */
+        return;
+    }
+    if (s->tx_legacy) {
+        s->tx_legacy = false;
+        crqa_legacy_sent(s);
+    }
+    crqa_send_legacy(s);
+    crqa_queue_submit(s);
+}
+
+static void crqa_submit_bh(void *opaque)
+{
+    crqa_queue_submit(opaque);
+}
+
+/* Backoff expired: connect and send whatever waited for the connection. */
+static void crqa_reconnect(void *opaque)
+{
+    CrqaDevState *s = opaque;
+
+    if (!s->legacy_pending && s->sq_tail == s->sq_head) {
+        s->connect_failures = 0;        /* nothing left to send */
+        return;
+    }
+    if (crqa_connect(s)) {
+        crqa_send_legacy(s);
+        crqa_queue_submit(s);
+    }
+}
+
+/* TRIGGER_REG doorbell, run from the main loop. The guest's store returned
+ * as soon as the ioeventfd was signalled; its id advances once the job has
+ * left the slot (sent, or failed) and the MSI and DONE_TAG_OFFSET tell it
+ * is done. A trigger that cannot be accepted yet leaves the id unchanged
+ * and the guest triggers again. */
+static void crqa_trigger(EventNotifier *e)
+{
+    CrqaDevState *s = container_of(e, CrqaDevState, trigger_notifier);
+    uint8_t *buf = s->buffer;
+    double   *R      = (double   *)buf;
+    uint32_t *opcode = (uint32_t *)(buf + 8);
+    uint64_t *id     = (uint64_t *)(buf + 16);
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+    if (*id != s->trigger_counter) {
+        printf("CRQAPCI: Ignoring trigger - ID mismatch (expected %lu, got %lu)\n",
+               s->trigger_counter, *id);
+        return;
+    }
+    if (s->legacy_pending) {
+        printf("CRQAPCI: job %lu not sent yet, trigger for job %lu deferred\n",
+               s->legacy_tag, *id);
+        return;
+    }
+    if (s->n_inflight == CRQA_MAX_INFLIGHT) {
+        printf("CRQAPCI: %u requests in flight, trigger for job %lu deferred\n",
+               s->n_inflight, *id);
+        return;
+    }
+    /* Zero-copy: SystemC reads the samples out of the buffer itself, so the
+     * single job area must stay untouched until the job completes. */
+    if (s->buffer_fd >= 0 && s->n_inflight > 0) {
+        printf("CRQAPCI: job %lu still using the shared buffer, trigger for job %lu deferred\n",
+               s->inflight[0], *id);
+        return;
+    }
+
+    /* results arrive later, tagged with this id */
+    s->R = *R;
+    s->opcode = *opcode;
+    s->legacy_tag = *id;
+    s->legacy_pending = true;
+    crqa_send_legacy(s);
 }
 
 /* ────────────────────────────────────────────────────────────────────── */
+/* Which completion ring register 'addr' is: CRQA_REG_CQ_TAIL or _HEAD of
+ * ring *q, or 0. */
+static hwaddr crqa_cq_reg(hwaddr addr, unsigned *q)
+{
+    hwaddr off = addr - CRQA_REG_CQ_TAIL;
+
+    if (addr < CRQA_REG_CQ_TAIL || off / CRQA_REG_CQ_STRIDE >= CRQA_NUM_CQ) {
+        return 0;
+    }
+    *q = off / CRQA_REG_CQ_STRIDE;
+    switch (off % CRQA_REG_CQ_STRIDE) {
+    case 0: return CRQA_REG_CQ_TAIL;
+    case CRQA_REG_CQ_HEAD - CRQA_REG_CQ_TAIL: return CRQA_REG_CQ_HEAD;
+    }
+    return 0;
+}
+
 static uint64_t crqa_mmio_read(void *opaque, hwaddr addr, unsigned size)
 {
     CrqaDevState *s = opaque;
 
+    switch (addr) {
+    case CRQA_REG_SQ_TAIL:     return s->sq_tail;
+    case CRQA_REG_SQ_HEAD:     return s->sq_head;
+    case CRQA_REG_QUEUE_DEPTH: return CRQA_QUEUE_DEPTH;
+    case CRQA_REG_NUM_CQ:      return CRQA_NUM_CQ;
+    case CRQA_REG_COAL_COUNT:  return s->coal_count;
+    case CRQA_REG_COAL_USEC:   return s->coal_usec;
+    case CRQA_REG_DMA_BASE_LO: return (uint32_t)s->dma_base;
+    case CRQA_REG_DMA_BASE_HI: return s->dma_base >> 32;
+    case CRQA_REG_DMA_SIZE:    return s->dma_size;
+    }
+
+    unsigned q;
+    switch (crqa_cq_reg(addr, &q)) {
+    case CRQA_REG_CQ_TAIL:     return s->cq[q].tail;
+    case CRQA_REG_CQ_HEAD:     return s->cq[q].head;
+    }
+
     if (addr >= BUFFER_OFFSET && addr < BUFFER_OFFSET + BUFFER_SIZE) {
         uint8_t *ptr = s->buffer + (addr - BUFFER_OFFSET);
         switch (size) {
@@ -289,43 +770,68 @@ static void crqa_mmio_write(void *opaque, hwaddr addr, uint64_t val, unsigned si
     CrqaDevState *s = opaque;
     //printf("CRQAPCI dev: mmio write *************** %lx\n", addr);
     if (addr == TRIGGER_REG && size == 8 && val == TRIGGER_MAGIC) {
-        uint8_t *buf = s->buffer;
-        double   *R      = (double   *)buf;
-        uint32_t *opcode = (uint32_t *)(buf + 8);
-        uint64_t *id     = (uint64_t *)(buf + 16);
-        double   *sig1   = (double   *)(buf + 24);
-        double   *sig2   = (double   *)(buf + 24 + 4096);
-        double   *res    = (double   *)(buf + 24 + 8192);
-
-        if (*id == s->trigger_counter) {
-            //printf("CRQAPCI: Trigger received – running CRQA (R=%.2f, opcode=%u)\n", *R, *opcode);
-            s->R = *R;
-            s->opcode = *opcode;
-            memcpy(s->sig1, sig1, sizeof(s->sig1));
-            memcpy(s->sig2, sig2, sizeof(s->sig2));
-
-            int retries = 3;
-            while (retries-- > 0) {
-                if (request_crqa(s) == 0) {
-                    memcpy(res, s->results, sizeof(s->results));
-                    s->trigger_counter++;
-                    *id = s->trigger_counter;
-                    //printf("CRQAPCI: CRQA completed successfully\n");
-                    return;
-                }
-                printf("CRQAPCI: Retry %d/3\n", 3 - retries);
-                usleep(100000);
-            }
-            printf("CRQAPCI: CRQA failed after retries\n");
-            s->trigger_counter++;
-            *id = s->trigger_counter;
-        } else {
-            printf("CRQAPCI: Ignoring trigger - ID mismatch (expected %lu, got %lu)\n",
-                   s->trigger_counter, *id);
+        /* normally caught by the ioeventfd before it gets here */
+        event_notifier_set(&s->trigger_notifier);
+        return;
+    }
+
+    if (addr == CRQA_REG_SQ_TAIL && size == 4) {
+        if ((uint32_t)val - s->sq_head > CRQA_QUEUE_DEPTH) {
+            printf("CRQAPCI: Ignoring SQ doorbell %u (head %u)\n", (uint32_t)val, s->sq_head);
+            return;
         }
+        s->sq_tail = val;
+        qemu_bh_schedule(s->submit_bh);
         return;
     }
 
+    unsigned q;
+    if (crqa_cq_reg(addr, &q) == CRQA_REG_CQ_HEAD && size == 4) {
+        /* a polling guest may read entries before they are published */
+        if ((uint32_t)val - s->cq[q].head > s->cq[q].prod - s->cq[q].head) {
+            printf("CRQAPCI: Ignoring CQ %u head %u (tail %u)\n", q, (uint32_t)val, s->cq[q].prod);
+            return;
+        }
+        s->cq[q].head = val;
+        /* what the guest has read needs no interrupt */
+        if ((int32_t)(val - s->cq[q].tail) > 0) {
+            s->cq[q].tail = val;
+        }
+        if ((int32_t)(val - s->cq[q].signalled) > 0) {
+            s->cq[q].signalled = val;
+        }
+        qemu_bh_schedule(s->submit_bh);     /* room for more outstanding windows */
+        return;
+    }
+
+    if (size == 4) {
+        switch (addr) {
+        case CRQA_REG_DMA_BASE_LO:
+            s->dma_base = (s->dma_base & ~0xffffffffULL) | (uint32_t)val;
+            return;
+        case CRQA_REG_DMA_BASE_HI:
+            s->dma_base = (s->dma_base & 0xffffffffULL) | (uint64_t)val << 32;
+            return;
+        case CRQA_REG_DMA_SIZE:
+            s->dma_size = val;
+            printf("CRQAPCI: DMA area of %u bytes at 0x%"PRIx64"\n", s->dma_size, s->dma_base);
+            return;
+        case CRQA_REG_COAL_COUNT:
+        case CRQA_REG_COAL_USEC:
+            if (addr == CRQA_REG_COAL_COUNT) {
+                s->coal_count = val;
+            } else {
+                s->coal_usec = val;
+            }
+            if (!s->coal_usec) {
+                timer_del(s->coal_timer);   /* nothing held back expires now */
+            }
+            printf("CRQAPCI: interrupt per %u completions or %u us\n", s->coal_count, s->coal_usec);
+            crqa_raise_rings(s, false, false);  /* what the new limits release */
+            return;
+        }
+    }
+
     if (addr >= BUFFER_OFFSET && addr < BUFFER_OFFSET + BUFFER_SIZE) {
         uint8_t *ptr = s->buffer + (addr - BUFFER_OFFSET);
         switch (size) {
@@ -357,6 +863,93 @@ static const MemoryRegionOps mmio_ops = {
 };
 
 
+/* Response frame for queued windows: their results go to their result
+ * slots (SystemC already wrote them there for zero-copy frames), and on to the
+ * DMA area for DMA-mode windows, and one cqe each to the completion ring.
+ * 'nres' results, or for a zero-copy frame 'nst' window statuses, were
+ * received. */
+static void crqa_complete_queued(CrqaDevState *s, const struct crqa_frame_hdr *hdr,
+                                 const struct crqa_window_result *res, uint32_t nres,
+                                 const uint32_t *st, uint32_t nst)
+{
+    for (unsigned b = 0; b < CRQA_QUEUE_DEPTH; b++) {
+        if (s->qbuf[b].tag != hdr->tag) {
+            continue;
+        }
+        uint8_t *result = s->buffer + CRQA_RESULTS_OFFSET + b * CRQA_RESULT_SIZE - BUFFER_OFFSET;
+        uint32_t pos = s->qbuf[b].pos;
+        uint32_t status = hdr->status;
+        if (s->buffer_fd >= 0) {
+            if (pos < nst) {
+                status = st[pos];
+            } else if (status == CRQA_STATUS_OK) {
+                status = CRQA_STATUS_BAD_REQ;
+            }
+        } else if (status == CRQA_STATUS_OK) {
+            if (pos < nres) {
+                memcpy(result, &res[pos].eps, 8 * sizeof(double));
+                status = res[pos].status;
+            } else {
+                status = CRQA_STATUS_BAD_REQ;
+            }
+        }
+        if (s->qbuf[b].dma && status == CRQA_STATUS_OK &&
+            pci_dma_write(PCI_DEVICE(s), s->qbuf[b].dma_result, result,
+                          8 * sizeof(double)) != MEMTX_OK) {
+            printf("CRQAPCI: DMA write for queued job %lu failed\n", s->qbuf[b].id);
+            status = CRQA_CQE_DMA_ERROR;
+        }
+        s->qbuf[b].tag = 0;
+        s->q_outstanding--;
+        crqa_post_cqe(s, s->qbuf[b].cq, b, s->qbuf[b].id, status);
+    }
+}
+
+/* The response frame for job hdr->tag is complete: retire the job and queue
+ * its results (res, or zeros if the frame has none) for the BH. Zero-copy
+ * frames bring window statuses (st) instead. */
+static void crqa_complete(CrqaDevState *s, const struct crqa_frame_hdr *hdr,
+                          const struct crqa_window_result *res, uint32_t nres,
+                          const uint32_t *st, uint32_t nst)
+{
+    static const struct crqa_window_result none;
+    unsigned i;
+
+    for (i = 0; i < s->n_inflight; i++) {
+        if (s->inflight[i] == hdr->tag) {
+            break;
+        }
+    }
+    if (i == s->n_inflight) {
+        printf("CRQAPCI: response for unknown job %lu dropped\n", hdr->tag);
+        return;
+    }
+    s->inflight[i] = s->inflight[--s->n_inflight];
+
+    if (hdr->tag & CRQA_QUEUE_TAG) {
+        crqa_complete_queued(s, hdr, res, nres, st, nst);
+        return;
+    }
+    res = nres ? res : NULL;
+
+    struct crqa_window_result shared;
+    if (!res && s->buffer_fd >= 0 && hdr->status != CRQA_STATUS_BAD_REQ) {
+        /* zero-copy frame: SystemC wrote the results into the buffer */
+        memset(&shared, 0, sizeof(shared));
+        shared.status = nst ? st[0] : hdr->status;
+        memcpy(&shared.eps, s->buffer + RESULT_OFFSET, sizeof(s->done[0].results));
+        res = &shared;
+    }
+    if (!res) {
+        res = &none;
+    }
+    if (hdr->status != CRQA_STATUS_OK || res->status != CRQA_STATUS_OK) {
+        printf("CRQAPCI: job %lu failed in SystemC (status %u/%u)\n",
+               hdr->tag, hdr->status, res->status);
+    }
+    crqa_post_done(s, hdr->tag, res);
+}
+
 static void crqa_event_handler(void *opaque)
 {
 	CrqaDevState *s = opaque;
@@ -366,11 +959,65 @@ static void crqa_event_handler(void *opaque)
 	{
 		return;
 	}
-	//read results from the socket
-	// Read results from socket
-	ssize_t n = read(s->sockfd, &s->results, sizeof(s->results));
-	if (n != sizeof(s->results)) {
-		printf("CRQAPCI: async read failed (%zd bytes): %s\n", n, strerror(errno));
+	// Drain every response frame that has arrived; they may complete
+	// jobs in any order and a frame may be split across reads.
+	while (s->sockfd >= 0) {
+		uint8_t discard[256];
+		uint8_t *dst;
+		size_t want;
+
+		if (s->rx_off < sizeof(s->rx.hdr)) {
+			dst = (uint8_t *)&s->rx + s->rx_off;
+			want = sizeof(s->rx.hdr) - s->rx_off;
+		} else {
+			size_t frame = sizeof(s->rx.hdr) + s->rx.hdr.payload_len;
+			size_t keep = frame < sizeof(s->rx) ? frame : sizeof(s->rx);
+			if (s->rx_off < keep) {
+				dst = (uint8_t *)&s->rx + s->rx_off;
+				want = keep - s->rx_off;
+			} else {
+				/* results of further windows, never sent by us */
+				dst = discard;
+				want = frame - s->rx_off < sizeof(discard) ? frame - s->rx_off : sizeof(discard);
+			}
+		}
+
+		ssize_t n = read(s->sockfd, dst, want);
+		if (n <= 0) {
+			if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+				printf("CRQAPCI: async read failed: %s\n", n ? strerror(errno) : "connection closed");
+				crqa_disconnect(s);
+			}
+			break;
+		}
+		s->rx_off += n;
+		if (s->rx_off < sizeof(s->rx.hdr)) {
+			continue;
+		}
+		if (s->rx_off == sizeof(s->rx.hdr) && !crqa_frame_hdr_valid(&s->rx.hdr)) {
+			printf("CRQAPCI: bad response header (magic 0x%x, version %u)\n",
+			       s->rx.hdr.magic, s->rx.hdr.version);
+			crqa_disconnect(s);
+			break;
+		}
+		if (s->rx_off == sizeof(s->rx.hdr) + s->rx.hdr.payload_len) {
+			size_t got = s->rx.hdr.payload_len < sizeof(s->rx.res) ? s->rx.hdr.payload_len : sizeof(s->rx.res);
+			if (s->buffer_fd >= 0) {
+				/* rx is packed: statuses out to aligned storage */
+				uint32_t st[CRQA_QUEUE_DEPTH];
+				size_t nst = (s->rx.hdr.payload_len < sizeof(st) ? s->rx.hdr.payload_len : sizeof(st)) / sizeof(st[0]);
+				memcpy(st, s->rx.status, nst * sizeof(st[0]));
+				crqa_complete(s, &s->rx.hdr, NULL, 0, st, nst);
+			} else {
+				crqa_complete(s, &s->rx.hdr, s->rx.res, got / sizeof(s->rx.res[0]), NULL, 0);
+			}
+			s->rx_off = 0;
+		}
+	}
+	// completions made room for more requests
+	crqa_send_legacy(s);
+	crqa_queue_submit(s);
+	if (s->done_count == 0 && !s->pending_irq) {
 		return;
 	}
 	//update that we have pending irq
@@ -378,21 +1025,6 @@ static void crqa_event_handler(void *opaque)
 	s->pending_irq = true;
 	//schedule the interrupt delivery.
 	qemu_bh_schedule(s->irq_bh);
-        /*	
-	// Copy results back to shared buffer
-        uint8_t *buf = s->buffer;
-	double *res = (double *)(buf + 24 + 8192);
-	memcpy(res, s->results, sizeof(s->results));
-	s->trigger_counter++;
-	*(uint64_t *)(buf + 16) = s->trigger_counter; // update ID
-	printf("QEMU: crqa-dev: async results received, IRQ pulse!\n");	
-	//raise & clear (pulse alike)
-	printf("QEMU: crqa-dev: igniting pulse\n");
-
-	//qemu_irq_pulse(s->irq);
-	PCIDevice *pdev = PCI_DEVICE(s);   // get PCIDevice pointer
-	msi_notify(pdev, 0);   // send vector 0
-	*/
 }
 
 /* ────────────────────────────────────────────────────────────────────── */
@@ -405,6 +1037,9 @@ static void crqa_realize(PCIDevice *pdev, Error **errp)
 
     pci_config_set_interrupt_pin(pci_conf, 0);
 
+    if (!s->socket_path) {
+        s->socket_path = g_strdup(SOCKET_PATH);
+    }
 
       /* eventfd creation */
     s->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
@@ -422,6 +1057,16 @@ static void crqa_realize(PCIDevice *pdev, Error **errp)
     memory_region_init_io(&s->mmio, OBJECT(dev), &mmio_ops, s,
                           "crqa", 2 * MiB);
     pci_register_bar(pdev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &s->mmio);
+
+    /* TRIGGER_REG is a pure doorbell: a store of TRIGGER_MAGIC signals the
+     * notifier and returns, crqa_trigger() takes the job on the main loop */
+    if (event_notifier_init(&s->trigger_notifier, 0) < 0) {
+        printf("QEMU: error trigger eventfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    event_notifier_set_handler(&s->trigger_notifier, crqa_trigger);
+    memory_region_add_eventfd(&s->mmio, TRIGGER_REG, 8, true, TRIGGER_MAGIC,
+                              &s->trigger_notifier);
 	
 
     // Enable MSI for the device
@@ -433,21 +1078,59 @@ static void crqa_realize(PCIDevice *pdev, Error **errp)
     } else {
 	printf("CRQAPCI: MSI enabled\n");
     }
-    s->buffer = g_malloc0(BUFFER_SIZE);
+    /* and MSI-X, a vector per completion ring, table and PBA in BAR 1 */
+    ret = msix_init_exclusive_bar(pdev, CRQA_NUM_CQ, 1, &err);
+    if (ret < 0) {
+        fprintf(stderr, "CRQAPCI: MSI-X init failed: %s\n", error_get_pretty(err));
+        error_free(err);
+        err = NULL;
+    } else {
+        for (unsigned q = 0; q < CRQA_NUM_CQ; q++) {
+            msix_vector_use(pdev, q);
+        }
+        printf("CRQAPCI: MSI-X enabled, %u vectors\n", CRQA_NUM_CQ);
+    }
+    /* memfd-backed so SystemC can map the buffer; plain RAM (inline
+     * transfers) if the host has no memfd */
+    s->buffer = qemu_memfd_alloc("crqa-buffer", RAM_SIZE, 0, &s->buffer_fd, NULL);
+    if (!s->buffer) {
+        printf("CRQAPCI: no memfd for the buffer, using inline transfers\n");
+        s->buffer = g_malloc0(RAM_SIZE);
+        s->buffer_fd = -1;
+    }
     memory_region_init_ram_ptr(&s->buffer_mr, OBJECT(dev), "crqa-buffer",
-                               BUFFER_SIZE, s->buffer);
+                               RAM_SIZE, s->buffer);
     memory_region_add_subregion(&s->mmio, BUFFER_OFFSET, &s->buffer_mr);
 
     s->trigger_counter = 1;
     s->sockfd = -1;
+    s->n_inflight = 0;
+    s->rx_off = 0;
+    s->done_head = s->done_count = 0;
+    s->sq_tail = s->sq_head = 0;
+    memset(s->cq, 0, sizeof(s->cq));
+    s->q_outstanding = 0;
+    s->q_seq = 0;
+    memset(s->qbuf, 0, sizeof(s->qbuf));
+    s->dma_base = 0;
+    s->dma_size = 0;
+    s->submit_bh = qemu_bh_new(crqa_submit_bh, s);
+    s->tx_pos = s->tx_cnt = 0;
+    s->tx_legacy = false;
+    s->legacy_pending = false;
+    s->connect_failures = 0;
+    s->reconnect_timer = timer_new_ms(QEMU_CLOCK_REALTIME, crqa_reconnect, s);
+    s->coal_count = s->coal_usec = 0;
+    s->coal_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, crqa_coal_expired, s);
 
     //initialization of related stuff for the MSI delivery.
     s->pending_irq = false; 
     s->irq_bh = qemu_bh_new(crqa_irq_bh, s);
 
 
-    printf("CRQAPCI: Device initialized – shared buffer at 0x%x (16 KB)\n", BUFFER_OFFSET);
-    printf("CRQAPCI: Socket will be kept open between requests\n");
+    printf("CRQAPCI: Device initialized – shared buffer at 0x%x (16 KB), "
+           "%u-entry queues at 0x%x\n", BUFFER_OFFSET, CRQA_QUEUE_DEPTH, CRQA_SQ_OFFSET);
+    printf("CRQAPCI: Socket will be kept open between requests, connected on first use\n");
 
 }
 
@@ -455,17 +1138,39 @@ static void crqa_exit(PCIDevice *pdev)
 {
     CrqaDevState *s = CRQADEV(pdev);
 
+    memory_region_del_eventfd(&s->mmio, TRIGGER_REG, 8, true, TRIGGER_MAGIC,
+                              &s->trigger_notifier);
+    event_notifier_set_handler(&s->trigger_notifier, NULL);
+    event_notifier_cleanup(&s->trigger_notifier);
+    timer_free(s->reconnect_timer);
+    timer_free(s->coal_timer);
+    qemu_bh_delete(s->submit_bh);
+    if (msix_present(pdev)) {
+        msix_unuse_all_vectors(pdev);
+        msix_uninit_exclusive_bar(pdev);
+    }
+
     if (s->sockfd >= 0) {
         printf("CRQAPCI: Closing SystemC connection (fd=%d)\n", s->sockfd);
+        qemu_set_fd_handler(s->sockfd, NULL, NULL, NULL);
         close(s->sockfd);
     }
-    g_free(s->buffer);
+    if (s->buffer_fd >= 0) {
+        qemu_memfd_free(s->buffer, RAM_SIZE, s->buffer_fd);
+    } else {
+        g_free(s->buffer);
+    }
 
     if(s->irq_bh){
 	    qemu_bh_delete(s->irq_bh);
     }
 }
 
+/* One server per instance: -device crqa-pci-dev,socket=/tmp/crqa_socket1 */
+static const Property crqa_properties[] = {
+    DEFINE_PROP_STRING("socket", CrqaDevState, socket_path),
+};
+
 static void crqa_class_init(ObjectClass *class, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(class);
@@ -479,6 +1184,7 @@ static void crqa_class_init(ObjectClass *class, const void *data)
     k->class_id  = PCI_CLASS_OTHERS;
 
     dc->desc = "CRQA PCI Device (Persistent Connection)";
+    device_class_set_props(dc, crqa_properties);
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
@@ -0,0 +1,372 @@
+/* crqa_virtio.c - guest driver of the virtio CRQA device (vhost-user-crqa)
+ *
+ * Requests written to /dev/crqa_virtio go onto the virtqueue as they are,
+ * one descriptor chain each, and the SystemC back-end reads the samples
+ * straight out of these buffers. Completions come back on the used ring
+ * with the virtqueue interrupt; see crqa_virtio.h for the file interface.
+ */
+#include <linux/module.h>
+#include <linux/virtio.h>
+#include <linux/virtio_config.h>
+#include <linux/scatterlist.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include "crqa_virtio.h"
+
+struct crqa_vdev {
+	struct virtio_device *vdev;
+	struct virtqueue *vq;
+	spinlock_t lock;		/* vq and every file's done list */
+	wait_queue_head_t room;		/* writers waiting for free descriptors */
+	struct miscdevice misc;
+};
+
+static struct crqa_vdev *crqa_dev;
+
+/* one open file: its requests complete onto its own list */
+struct crqa_file {
+	struct list_head done;
+	wait_queue_head_t wq;
+	unsigned int inflight;
+	bool closed;			/* freed by the last completion */
+};
+
+struct crqa_req {
+	struct list_head node;
+	struct crqa_file *owner;
+	u64 id;
+	struct crqa_window_result res;	/* device-writable */
+	u8 data[];			/* device-readable: crqa_window, sig1, sig2 */
+};
+
+static void crqa_kick(struct crqa_vdev *cd)
+{
+	bool notify;
+
+	spin_lock_irq(&cd->lock);
+	notify = virtqueue_kick_prepare(cd->vq);
+	spin_unlock_irq(&cd->lock);
+	if (notify)
+		virtqueue_notify(cd->vq);
+}
+
+/* Put one request on the virtqueue, waiting for room if 'block'. */
+static int crqa_queue(struct crqa_vdev *cd, struct crqa_file *cf, struct crqa_req *req,
+		      size_t data_len, bool block)
+{
+	struct scatterlist out, in, *sgs[2] = { &out, &in };
+	int ret;
+
+	sg_init_one(&out, req->data, data_len);
+	sg_init_one(&in, &req->res, sizeof(req->res));
+
+	for (;;) {
+		spin_lock_irq(&cd->lock);
+		ret = virtqueue_add_sgs(cd->vq, sgs, 1, 1, req, GFP_ATOMIC);
+		if (ret == 0)
+			cf->inflight++;
+		spin_unlock_irq(&cd->lock);
+
+		if (ret != -ENOSPC)
+			return ret;
+		if (!block)
+			return -EAGAIN;
+		/* the device must see what is queued already to make room */
+		crqa_kick(cd);
+		if (wait_event_interruptible(cd->room, cd->vq->num_free > 0))
+			return -ERESTARTSYS;
+	}
+}
+
+static void crqa_vq_done(struct virtqueue *vq)
+{
+	struct crqa_vdev *cd = vq->vdev->priv;
+	struct crqa_req *req;
+	unsigned long flags;
+	unsigned int len;
+
+	spin_lock_irqsave(&cd->lock, flags);
+	do {
+		virtqueue_disable_cb(vq);
+		while ((req = virtqueue_get_buf(vq, &len))) {
+			struct crqa_file *cf = req->owner;
+
+			if (len < sizeof(req->res)) {
+				memset(&req->res, 0, sizeof(req->res));
+				req->res.status = CRQA_STATUS_BAD_REQ;
+			}
+			cf->inflight--;
+			if (cf->closed) {
+				kfree(req);
+				if (!cf->inflight)
+					kfree(cf);
+				continue;
+			}
+			list_add_tail(&req->node, &cf->done);
+			wake_up_interruptible(&cf->wq);
+		}
+	} while (!virtqueue_enable_cb(vq));
+	spin_unlock_irqrestore(&cd->lock, flags);
+
+	wake_up_interruptible(&cd->room);
+}
+
+static int crqa_open(struct inode *inode, struct file *filp)
+{
+	struct crqa_file *cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+
+	if (!cf)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&cf->done);
+	init_waitqueue_head(&cf->wq);
+	filp->private_data = cf;
+	return 0;
+}
+
+static int crqa_release(struct inode *inode, struct file *filp)
+{
+	struct crqa_file *cf = filp->private_data;
+	struct crqa_req *req, *tmp;
+	bool free_now;
+
+	spin_lock_irq(&crqa_dev->lock);
+	list_for_each_entry_safe(req, tmp, &cf->done, node) {
+		list_del(&req->node);
+		kfree(req);
+	}
+	cf->closed = true;
+	free_now = !cf->inflight;
+	spin_unlock_irq(&crqa_dev->lock);
+
+	if (free_now)
+		kfree(cf);
+	return 0;
+}
+
+static ssize_t crqa_write(struct file *filp, const char __user *ubuf, size_t len, loff_t *off)
+{
+	struct crqa_file *cf = filp->private_data;
+	struct crqa_vdev *cd = crqa_dev;
+	size_t done = 0;
+	int ret = 0;
+
+	while (done < len) {
+		struct crqa_virtio_req hdr;
+		struct crqa_req *req;
+		size_t data_len;
+
+		if (len - done < sizeof(hdr)) {
+			ret = -EINVAL;
+			break;
+		}
+		if (copy_from_user(&hdr, ubuf + done, sizeof(hdr))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (hdr.w.n == 0 || hdr.w.n > CRQA_PROTO_MAX_SAMPLES) {
+			ret = -EINVAL;
+			break;
+		}
+		data_len = sizeof(hdr.w) + 2 * (size_t)hdr.w.n * sizeof(double);
+		if (len - done < sizeof(hdr.id) + data_len) {
+			ret = -EINVAL;
+			break;
+		}
+
+		req = kmalloc(struct_size(req, data, data_len), GFP_KERNEL);
+		if (!req) {
+			ret = -ENOMEM;
+			break;
+		}
+		req->owner = cf;
+		req->id = hdr.id;
+		if (copy_from_user(req->data, ubuf + done + sizeof(hdr.id), data_len)) {
+			kfree(req);
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = crqa_queue(cd, cf, req, data_len, !(filp->f_flags & O_NONBLOCK));
+		if (ret) {
+			kfree(req);
+			break;
+		}
+		done += sizeof(hdr.id) + data_len;
+	}
+
+	/* one notification for the whole batch */
+	if (done)
+		crqa_kick(cd);
+	return done ? done : ret;
+}
+
+static ssize_t crqa_read(struct file *filp, char __user *ubuf, size_t len, loff_t *off)
+{
+	struct crqa_file *cf = filp->private_data;
+	struct crqa_vdev *cd = crqa_dev;
+	size_t max = len / sizeof(struct crqa_virtio_done);
+	struct crqa_req *req, *tmp;
+	LIST_HEAD(batch);
+	size_t n = 0;
+	int ret = 0;
+
+	if (!max)
+		return -EINVAL;
+
+	spin_lock_irq(&cd->lock);
+	while (list_empty(&cf->done)) {
+		bool idle = !cf->inflight;
+
+		spin_unlock_irq(&cd->lock);
+		if (idle)
+			return 0;
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(cf->wq, !list_empty(&cf->done)))
+			return -ERESTARTSYS;
+		spin_lock_irq(&cd->lock);
+	}
+	list_for_each_entry_safe(req, tmp, &cf->done, node) {
+		if (n == max)
+			break;
+		list_move_tail(&req->node, &batch);
+		n++;
+	}
+	spin_unlock_irq(&cd->lock);
+
+	n = 0;
+	list_for_each_entry_safe(req, tmp, &batch, node) {
+		struct crqa_virtio_done d = { .id = req->id, .res = req->res };
+
+		if (!ret && copy_to_user(ubuf + n * sizeof(d), &d, sizeof(d)))
+			ret = -EFAULT;
+		if (!ret)
+			n++;
+		list_del(&req->node);
+		kfree(req);
+	}
+	return ret ? ret : n * sizeof(struct crqa_virtio_done);
+}
+
+static __poll_t crqa_poll(struct file *filp, poll_table *wait)
+{
+	struct crqa_file *cf = filp->private_data;
+	struct crqa_vdev *cd = crqa_dev;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &cf->wq, wait);
+	poll_wait(filp, &cd->room, wait);
+
+	spin_lock_irq(&cd->lock);
+	if (!list_empty(&cf->done))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (cd->vq->num_free > 0)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	spin_unlock_irq(&cd->lock);
+
+	return mask;
+}
+
+static const struct file_operations crqa_fops = {
+	.owner   = THIS_MODULE,
+	.open    = crqa_open,
+	.release = crqa_release,
+	.write   = crqa_write,
+	.read    = crqa_read,
+	.poll    = crqa_poll,
+	.llseek  = noop_llseek,
+};
+
+static int crqa_virtio_probe(struct virtio_device *vdev)
+{
+	struct crqa_vdev *cd;
+	int ret;
+
+	if (crqa_dev)
+		return -EBUSY;		/* one device, one /dev node */
+
+	cd = kzalloc(sizeof(*cd), GFP_KERNEL);
+	if (!cd)
+		return -ENOMEM;
+	cd->vdev = vdev;
+	spin_lock_init(&cd->lock);
+	init_waitqueue_head(&cd->room);
+	vdev->priv = cd;
+
+	cd->vq = virtio_find_single_vq(vdev, crqa_vq_done, "requests");
+	if (IS_ERR(cd->vq)) {
+		ret = PTR_ERR(cd->vq);
+		goto err_free;
+	}
+	virtio_device_ready(vdev);
+
+	cd->misc.minor = MISC_DYNAMIC_MINOR;
+	cd->misc.name = "crqa_virtio";
+	cd->misc.fops = &crqa_fops;
+	crqa_dev = cd;
+	ret = misc_register(&cd->misc);
+	if (ret)
+		goto err_vq;
+
+	dev_info(&vdev->dev, "CRQA virtio device ready, %u descriptors\n",
+		 virtqueue_get_vring_size(cd->vq));
+	return 0;
+
+err_vq:
+	crqa_dev = NULL;
+	virtio_reset_device(vdev);
+	vdev->config->del_vqs(vdev);
+err_free:
+	kfree(cd);
+	return ret;
+}
+
+static void crqa_virtio_remove(struct virtio_device *vdev)
+{
+	struct crqa_vdev *cd = vdev->priv;
+	struct crqa_req *req;
+
+	misc_deregister(&cd->misc);
+	virtio_reset_device(vdev);
+
+	/* requests the device never completed */
+	spin_lock_irq(&cd->lock);
+	while ((req = virtqueue_detach_unused_buf(cd->vq))) {
+		struct crqa_file *cf = req->owner;
+
+		cf->inflight--;
+		kfree(req);
+		if (cf->closed && !cf->inflight)
+			kfree(cf);
+		else
+			wake_up_interruptible(&cf->wq);
+	}
+	spin_unlock_irq(&cd->lock);
+
+	vdev->config->del_vqs(vdev);
+	crqa_dev = NULL;
+	kfree(cd);
+}
+
+static const struct virtio_device_id crqa_virtio_ids[] = {
+	{ CRQA_VIRTIO_ID, VIRTIO_DEV_ANY_ID },
+	{ 0 },
+};
+MODULE_DEVICE_TABLE(virtio, crqa_virtio_ids);
+
+static struct virtio_driver crqa_virtio_driver = {
+	.driver.name = KBUILD_MODNAME,
+	.id_table    = crqa_virtio_ids,
+	.probe       = crqa_virtio_probe,
+	.remove      = crqa_virtio_remove,
+};
+
+module_virtio_driver(crqa_virtio_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("You");
+MODULE_DESCRIPTION("CRQA virtio device - vhost-user SystemC back-end");
@@ -0,0 +1,31 @@
+/* crqa_virtio.h - user interface of /dev/crqa_virtio, shared by the guest
+ * driver (crqa_virtio.c) and programs (main.c). */
+#ifndef CRQA_VIRTIO_H
+#define CRQA_VIRTIO_H
+
+#include "crqa_proto.h"
+
+#define CRQA_VIRTIO_DEV "/dev/crqa_virtio"
+
+/*
+ * write(): one or more requests back to back, each
+ *   struct crqa_virtio_req, then sig1[w.n], sig2[w.n] (doubles)
+ * queued with a single kick. Returns the bytes of the requests queued; with
+ * O_NONBLOCK it stops early (or fails with EAGAIN) when the virtqueue is full.
+ *
+ * read(): as many struct crqa_virtio_done as fit and have completed, in
+ * completion order; blocks for the first one unless O_NONBLOCK. Returns 0
+ * when nothing is in flight. poll() reports POLLIN for completions waiting
+ * and POLLOUT for room on the virtqueue.
+ */
+struct crqa_virtio_req {
+    uint64_t id;                    /* returned in crqa_virtio_done */
+    struct crqa_window w;
+} __attribute__((packed));
+
+struct crqa_virtio_done {
+    uint64_t id;
+    struct crqa_window_result res;
+} __attribute__((packed));
+
+#endif
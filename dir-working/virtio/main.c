@@ -0,0 +1,162 @@
+// main.c - queue CRQA windows on the virtio CRQA device
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "crqa_virtio.h"
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#define N_SAMPLES     512
+#define MAX_SAMPLES   (1 << 20)
+#define WINDOW_STEP   (N_SAMPLES / 2)
+#define R_FIRST       0.05
+#define R_STEP        0.05
+
+/* Returns the number of samples read (the rest of signal is zeroed). */
+static int load_signal_from_file(const char *filename, double *signal, int max_samples) {
+	FILE *fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "Error opening %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	int i = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), fp) && i < max_samples) {
+		if (line[0] == '\n' || line[0] == '#') continue;
+		char *endptr;
+		double value = strtod(line, &endptr);
+		if (endptr != line) signal[i++] = value;
+	}
+	fclose(fp);
+
+	int n = i;
+	for (; i < max_samples; i++) signal[i] = 0.0;
+	printf("Loaded %d samples from %s\n", n, filename);
+	return n;
+}
+
+int main(int argc, char *argv[]) {
+	const char *sig1_file = "systemc_input_F7_T7.txt";
+	const char *sig2_file = "systemc_input_FP1_F7.txt";
+	int n_radii = 8;
+
+	if (argc >= 3) {
+		sig1_file = argv[1];
+		sig2_file = argv[2];
+	}
+	if (argc >= 4) {
+		n_radii = atoi(argv[3]);
+		if (n_radii < 1) n_radii = 1;
+	}
+
+	double *sig1 = malloc(MAX_SAMPLES * sizeof(double));
+	double *sig2 = malloc(MAX_SAMPLES * sizeof(double));
+	if (!sig1 || !sig2) {
+		perror("malloc");
+		return 1;
+	}
+
+	printf("Loading signals...\n");
+	int n1 = load_signal_from_file(sig1_file, sig1, MAX_SAMPLES);
+	int n2 = load_signal_from_file(sig2_file, sig2, MAX_SAMPLES);
+	if (n1 < 0 || n2 < 0) {
+		return 1;
+	}
+
+	// Every window of WINDOW_STEP stride, each at n_radii radii
+	int len = n1 < n2 ? n1 : n2;
+	int n_windows = len > N_SAMPLES ? (len - N_SAMPLES) / WINDOW_STEP + 1 : 1;
+	int n_jobs = n_windows * n_radii;
+
+	int fd = open(CRQA_VIRTIO_DEV, O_RDWR);
+	if (fd < 0) {
+		perror("open " CRQA_VIRTIO_DEV);
+		return 1;
+	}
+
+	// All requests in one buffer, handed over with one write()
+	size_t req_size = sizeof(struct crqa_virtio_req) + 2 * N_SAMPLES * sizeof(double);
+	uint8_t *reqs = malloc((size_t)n_jobs * req_size);
+	struct crqa_virtio_done *done = malloc((size_t)n_jobs * sizeof(*done));
+	if (!reqs || !done) {
+		perror("malloc");
+		return 1;
+	}
+	for (int j = 0; j < n_jobs; j++) {
+		int w = j / n_radii;
+		int r = j % n_radii;
+		struct crqa_virtio_req *q = (struct crqa_virtio_req *)(reqs + j * req_size);
+		double *s = (double *)(q + 1);
+
+		memset(q, 0, sizeof(*q));
+		q->id = j;
+		q->w.R = R_FIRST + r * R_STEP;
+		q->w.n = N_SAMPLES;
+		q->w.opcode = 42;
+		memcpy(s, sig1 + w * WINDOW_STEP, N_SAMPLES * sizeof(double));
+		memcpy(s + N_SAMPLES, sig2 + w * WINDOW_STEP, N_SAMPLES * sizeof(double));
+	}
+
+	printf("\nQueueing %d windows x %d radii = %d jobs\n", n_windows, n_radii, n_jobs);
+	uint64_t start = now_ns();
+
+	// The driver blocks for room on the virtqueue, so this only returns
+	// once everything is queued (or on error).
+	ssize_t wr = write(fd, reqs, (size_t)n_jobs * req_size);
+	if (wr < 0) {
+		perror("write");
+		return 1;
+	}
+	int queued = (int)(wr / req_size);
+
+	int got = 0, failed = 0;
+	while (got < queued) {
+		ssize_t rd = read(fd, done + got, (size_t)(queued - got) * sizeof(*done));
+		if (rd < 0) {
+			if (errno == EINTR) continue;
+			perror("read");
+			break;
+		}
+		if (rd == 0)
+			break;
+		got += (int)(rd / sizeof(*done));
+	}
+
+	uint64_t end = now_ns();
+	double elapsed_ms = (end - start) / 1e6;
+
+	for (int k = 0; k < got; k++) {
+		struct crqa_virtio_done *d = &done[k];
+		double *res = &d->res.eps;
+		if (d->res.status) {
+			printf("job %4lu: failed, status %u\n", (unsigned long)d->id, d->res.status);
+			failed++;
+			continue;
+		}
+		printf("job %4lu (window %4lu, R=%.2f): eps=%.6f RR=%.6f DET=%.6f L=%.6f "
+		       "Lmax=%.0f DIV=%.6f ENTR=%.6f LAM=%.6f\n",
+		       (unsigned long)d->id, (unsigned long)d->id / n_radii,
+		       R_FIRST + (d->id % n_radii) * R_STEP,
+		       res[0], res[1], res[2], res[3], res[4], res[5], res[6], res[7]);
+	}
+
+	printf("\n=== %d of %d jobs complete, %d failed ===\n", got, n_jobs, failed);
+	printf("Total time = %.3f ms (%.3f ms per job)\n", elapsed_ms, got ? elapsed_ms / got : 0.0);
+
+	close(fd);
+	free(reqs);
+	free(done);
+	free(sig1);
+	free(sig2);
+
+	return (got == n_jobs && failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+/* vhost-user-crqa.c - QEMU virtio CRQA device served by the SystemC server
+ *
+ * A virtio device with one request virtqueue whose back-end is the SystemC
+ * server (vhost-user): QEMU only negotiates features and hands guest memory
+ * and the kick/call eventfds to the server, it never touches a request.
+ * Buffer layout on the virtqueue: see crqa_proto.h.
+ *
+ * Drop it into hw/virtio/ with crqa_proto.h and add
+ *   system_ss.add(when: 'CONFIG_VHOST_USER', if_true: files('vhost-user-crqa.c'))
+ * to hw/virtio/meson.build. virtio_init() only accepts device ids it can
+ * name, so also add
+ *   [CRQA_VIRTIO_ID] = "vhost-user-crqa",
+ * to virtio_device_names[] in hw/virtio/virtio.c.
+ *
+ * Guest RAM must be shareable, e.g. for a RISC-V or x86 TCG guest:
+ *   ./systemc_server &
+ *   qemu-system-riscv64 -M virt -m 1G \
+ *     -object memory-backend-memfd,id=mem,size=1G,share=on -machine memory-backend=mem \
+ *     -chardev socket,id=crqa,path=/tmp/crqa_vhost.sock \
+ *     -device vhost-user-crqa-pci,chardev=crqa ...
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "hw/qdev-properties.h"
+#include "hw/virtio/virtio-pci.h"
+#include "hw/virtio/vhost-user-base.h"
+#include "qom/object.h"
+#include "qemu/module.h"
+#include "crqa_proto.h"
+
+#define TYPE_VHOST_USER_CRQA     "vhost-user-crqa"
+#define TYPE_VHOST_USER_CRQA_PCI "vhost-user-crqa-pci-base"
+
+typedef struct VHostUserCrqa {
+    VHostUserBase parent_obj;
+} VHostUserCrqa;
+
+typedef struct VHostUserCrqaPCI {
+    VirtIOPCIProxy parent_obj;
+    VHostUserCrqa vdev;
+} VHostUserCrqaPCI;
+
+DECLARE_INSTANCE_CHECKER(VHostUserCrqaPCI, VHOST_USER_CRQA_PCI, TYPE_VHOST_USER_CRQA_PCI)
+
+static const VMStateDescription vu_crqa_vmstate = {
+    .name = "vhost-user-crqa",
+    .unmigratable = 1,          /* the back-end keeps no dirty log */
+};
+
+static const Property vu_crqa_properties[] = {
+    DEFINE_PROP_CHR("chardev", VHostUserBase, chardev),
+};
+
+static void vu_crqa_realize(DeviceState *dev, Error **errp)
+{
+    VHostUserBase *vub = VHOST_USER_BASE(dev);
+    VHostUserBaseClass *vubc = VHOST_USER_BASE_GET_CLASS(dev);
+
+    /* one request queue, no config space */
+    vub->virtio_id = CRQA_VIRTIO_ID;
+    vub->num_vqs = 1;
+    vub->vq_size = CRQA_VIRTIO_QUEUE_SIZE;
+    vub->config_size = 0;
+
+    vubc->parent_realize(dev, errp);
+}
+
+static void vu_crqa_class_init(ObjectClass *class, const void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(class);
+    VHostUserBaseClass *vubc = VHOST_USER_BASE_CLASS(class);
+
+    dc->desc = "CRQA virtio device (vhost-user SystemC back-end)";
+    dc->vmsd = &vu_crqa_vmstate;
+    device_class_set_props(dc, vu_crqa_properties);
+    device_class_set_parent_realize(dc, vu_crqa_realize, &vubc->parent_realize);
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+}
+
+/* ────────────────────────────────────────────────────────────────────── */
+static const Property vu_crqa_pci_properties[] = {
+    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, DEV_NVECTORS_UNSPECIFIED),
+};
+
+static void vu_crqa_pci_realize(VirtIOPCIProxy *vpci_dev, Error **errp)
+{
+    VHostUserCrqaPCI *dev = VHOST_USER_CRQA_PCI(vpci_dev);
+
+    if (vpci_dev->nvectors == DEV_NVECTORS_UNSPECIFIED) {
+        vpci_dev->nvectors = 2;     /* config changes + the request queue */
+    }
+    qdev_realize(DEVICE(&dev->vdev), BUS(&vpci_dev->bus), errp);
+}
+
+static void vu_crqa_pci_class_init(ObjectClass *class, const void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(class);
+    VirtioPCIClass *k = VIRTIO_PCI_CLASS(class);
+    PCIDeviceClass *pcidev_k = PCI_DEVICE_CLASS(class);
+
+    k->realize = vu_crqa_pci_realize;
+    device_class_set_props(dc, vu_crqa_pci_properties);
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+    pcidev_k->vendor_id = PCI_VENDOR_ID_REDHAT_QUMRANET;
+    pcidev_k->device_id = 0;        /* set by virtio-pci from the virtio id */
+    pcidev_k->revision = 0x00;
+    pcidev_k->class_id = PCI_CLASS_OTHERS;
+}
+
+static void vu_crqa_pci_instance_init(Object *obj)
+{
+    VHostUserCrqaPCI *dev = VHOST_USER_CRQA_PCI(obj);
+
+    virtio_instance_init_common(obj, &dev->vdev, sizeof(dev->vdev), TYPE_VHOST_USER_CRQA);
+}
+
+static void vu_crqa_register_types(void)
+{
+    static const TypeInfo vu_crqa_info = {
+        .name          = TYPE_VHOST_USER_CRQA,
+        .parent        = TYPE_VHOST_USER_BASE,
+        .instance_size = sizeof(VHostUserCrqa),
+        .class_init    = vu_crqa_class_init,
+    };
+
+    static const VirtioPCIDeviceTypeInfo vu_crqa_pci_info = {
+        .base_name             = TYPE_VHOST_USER_CRQA_PCI,
+        .non_transitional_name = "vhost-user-crqa-pci",
+        .instance_size         = sizeof(VHostUserCrqaPCI),
+        .instance_init         = vu_crqa_pci_instance_init,
+        .class_init            = vu_crqa_pci_class_init,
+    };
+
+    type_register_static(&vu_crqa_info);
+    virtio_pci_types_register(&vu_crqa_pci_info);
+}
+
+type_init(vu_crqa_register_types)
@@ -4,6 +4,7 @@
 #include <systemc>
 #include <cmath>
 #include <array>
+#include "crqa_kernel.h"
 
 using namespace sc_core;
 
@@ -23,36 +24,32 @@ SC_MODULE(PSDEpsilonModule)
     static const int WINDOW_SIZE = 512;
     static const int m = 3;
     static const int tau = 1;
-    static const int N = WINDOW_SIZE - (m - 1) * tau; // = 510
+    typedef CrqaKernel<m, tau, WINDOW_SIZE> Kernel;
+    static const int N = Kernel::LEN; // = 510
 
     SC_CTOR(PSDEpsilonModule)
     {
         SC_THREAD(process);
     }
 
-    // Helper: embed into 3D vectors
-    void embed_3d(const double *x, std::array<std::array<double,3>,N> &emb)
+    // Helper: embed into 3D vectors (one array per coordinate, unnormalised)
+    void embed_3d(const double *x, std::array<std::array<double,N>,3> &emb)
     {
-        for (int i = 0; i < N; i++) {
-            emb[i][0] = x[i];
-            emb[i][1] = x[i + tau];
-            emb[i][2] = x[i + 2 * tau];
-        }
+        static_assert(sizeof(emb) == sizeof(double) * m * N, "embedding must be contiguous");
+        Kernel::embed(x, 0.0, 1.0, emb[0].data());
     }
 
     // Helper: compute PSD (max 3D distance)
-    double compute_psd(const std::array<std::array<double,3>,N> &emb)
+    double compute_psd(const std::array<std::array<double,N>,3> &emb)
     {
+        const CrqaDistanceKernels &kern = crqa_distance_kernels();
+        const double *cols[3] = { emb[0].data(), emb[1].data(), emb[2].data() };
         double maxd = 0.0;
 
         for (int i = 0; i < N; i++) {
-            for (int j = i+1; j < N; j++) {
-                double dx = emb[i][0] - emb[j][0];
-                double dy = emb[i][1] - emb[j][1];
-                double dz = emb[i][2] - emb[j][2];
-                double d2 = dx*dx + dy*dy + dz*dz;
-                if (d2 > maxd) maxd = d2;
-            }
+            double x[3] = { emb[0][i], emb[1][i], emb[2][i] };
+            double d2 = kern.max_dist_sq(x, cols, 3, i + 1, N);
+            if (d2 > maxd) maxd = d2;
         }
         return std::sqrt(maxd);
     }
@@ -76,8 +73,8 @@ SC_MODULE(PSDEpsilonModule)
                 sig2[i] = in_sig2[i].read();
 
             // ---- Embed both signals ----
-            std::array<std::array<double,3>,N> emb1;
-            std::array<std::array<double,3>,N> emb2;
+            std::array<std::array<double,N>,3> emb1;
+            std::array<std::array<double,N>,3> emb2;
 
             embed_3d(sig1, emb1);
             embed_3d(sig2, emb2);
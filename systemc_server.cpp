@@ -2,6 +2,7 @@
 #include <systemc>
 #include <iostream>
 #include <vector>
+#include <string>
 #include <cmath>
 #include <algorithm>
 #include <unistd.h>
@@ -9,183 +10,77 @@
 #include <sys/un.h>
 #include <cstring>
 #include <csignal>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <deque>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "crqa_proto.h"
+#include "crqa_kernel.h"
+#include "crqa_dispatch.h"
+#include "crqa_vhost.h"
 
 using namespace std;
 using namespace sc_core;
 
 #define SOCKET_PATH "/tmp/crqa_socket"
-#define N_SAMPLES 512
-
-// Message structures (MUST match QEMU exactly)
-#pragma pack(push, 1)
-struct Input {
-    double R;
-    double sig1[N_SAMPLES];
-    double sig2[N_SAMPLES];
-    int32_t opcode;
-    int32_t ready;
-};
+#define VHOST_SOCKET_PATH "/tmp/crqa_vhost.sock"   // vhost-user-crqa devices
+#define N_SAMPLES CRQA_PROTO_SAMPLES
 
-struct Output {
-    double eps, rr, det, l, lmax, div, ent, lam;
-};
-#pragma pack(pop)
-
-// CRQA computation function
-void compute_crqa_complete(double R, double* sig1, double* sig2, double results[8]) {
-    // 1. Normalize
-    double mean1 = 0, mean2 = 0;
-    for (int i = 0; i < N_SAMPLES; i++) {
-        mean1 += sig1[i];
-        mean2 += sig2[i];
-    }
-    mean1 /= N_SAMPLES;
-    mean2 /= N_SAMPLES;
-    
-    double std1 = 0, std2 = 0;
-    for (int i = 0; i < N_SAMPLES; i++) {
-        double d1 = sig1[i] - mean1;
-        double d2 = sig2[i] - mean2;
-        std1 += d1 * d1;
-        std2 += d2 * d2;
-    }
-    std1 = sqrt(std1 / N_SAMPLES);
-    std2 = sqrt(std2 / N_SAMPLES);
-    
-    if (std1 < 1e-12) std1 = 1;
-    if (std2 < 1e-12) std2 = 1;
-    
-    // 2. Embedding (m=3, tau=5)
-    int m = 3, tau = 5;
-    int len = N_SAMPLES - (m-1)*tau;
-    
-    if (len <= 0) {
-        for (int i = 0; i < 8; i++) results[i] = 0;
-        return;
-    }
-    
-    // Create embedded vectors
-    vector<vector<double>> e1(len, vector<double>(m));
-    vector<vector<double>> e2(len, vector<double>(m));
-    
-    for (int i = 0; i < len; i++) {
-        for (int j = 0; j < m; j++) {
-            e1[i][j] = (sig1[i + j*tau] - mean1) / std1;
-            e2[i][j] = (sig2[i + j*tau] - mean2) / std2;
-        }
-    }
-    
-    // 3. Build recurrence matrix
-    vector<vector<bool>> RM(len, vector<bool>(len, false));
-    int rec = 0;
-    
-    for (int i = 0; i < len; i++) {
-        for (int j = 0; j < len; j++) {
-            double dist_sq = 0;
-            for (int k = 0; k < m; k++) {
-                double d = e1[i][k] - e2[j][k];
-                dist_sq += d * d;
-            }
-            if (sqrt(dist_sq) <= R) {
-                RM[i][j] = true;
-                rec++;
-            }
-        }
-    }
-    
-    double RR = (double)rec / (len * len);
-    
-    // 4. Diagonal line analysis
-    const int min_diag = 2;
-    int d_lines = 0, d_points = 0, d_max = 0;
-    double d_avg = 0, d_ent = 0;
-    vector<int> d_lengths;
-    double d_total = 0;
-    
-    for (int k = -(len-1); k < len; k++) {
-        int cur = 0;
-        for (int i = max(0, -k), j = max(0, k); i < len && j < len; i++, j++) {
-            if (RM[i][j]) {
-                cur++;
-            } else {
-                if (cur >= min_diag) {
-                    d_lines++;
-                    d_points += cur;
-                    d_lengths.push_back(cur);
-                    d_total += cur;
-                    if (cur > d_max) d_max = cur;
-                }
-                cur = 0;
-            }
-        }
-        if (cur >= min_diag) {
-            d_lines++;
-            d_points += cur;
-            d_lengths.push_back(cur);
-            d_total += cur;
-            if (cur > d_max) d_max = cur;
-        }
-    }
-    
-    d_avg = d_lines > 0 ? d_total / d_lines : 0;
-    
-    // Entropy
-    for (int l : d_lengths) {
-        double p = (double)l / d_total;
-        if (p > 0) d_ent -= p * log2(p);
-    }
-    
-    // 5. Vertical line analysis  
-    const int min_vert = 2;
-    int v_lines = 0, v_points = 0, v_max = 0;
-    double v_avg = 0;
-    double v_total = 0;
-    
-    for (int j = 0; j < len; j++) {
-        int cur = 0;
-        for (int i = 0; i < len; i++) {
-            if (RM[i][j]) {
-                cur++;
-            } else {
-                if (cur >= min_vert) {
-                    v_lines++;
-                    v_points += cur;
-                    v_total += cur;
-                    if (cur > v_max) v_max = cur;
-                }
-                cur = 0;
-            }
-        }
-        if (cur >= min_vert) {
-            v_lines++;
-            v_points += cur;
-            v_total += cur;
-            if (cur > v_max) v_max = cur;
-        }
-    }
-    
-    v_avg = v_lines > 0 ? v_total / v_lines : 0;
-    
-    // 6. Final metrics
-    double DET = rec > 0 ? (double)d_points / rec : 0;
-    double LAM = rec > 0 ? (double)v_points / rec : 0;
-    double DIV = d_max > 0 ? 1.0 / d_max : 0;
-    
-    // 7. Output in QEMU order
-    results[0] = DET;      // epsilon
-    results[1] = RR;       // recurrence rate
-    results[2] = DET;      // determinism
-    results[3] = v_avg;    // L (trapping time)
-    results[4] = d_max;    // L_max
-    results[5] = DIV;      // divergence
-    results[6] = d_ent;    // entropy
-    results[7] = LAM;      // laminarity
+// CRQA computation function: dispatches to the kernel specialised for
+// params (m, tau, n) or to the generic one.
+void compute_crqa_complete(CrqaWorkspace &ws, const CrqaParams &params, double R, double* sig1, double* sig2, double results[8]) {
+    crqa_compute(ws, params, R, sig1, sig2, results);
 }
 
-static int recv_eventfd(int sock)
+// Compute threads for long windows: CRQA_THREADS, default one per CPU.
+static int server_threads()
+{
+    int n = 0;
+    if (const char *v = getenv("CRQA_THREADS")) n = atoi(v);
+    if (n <= 0) n = (int)std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// Server-wide CRQA parameters, used for any window field left at 0; CRQA_M, CRQA_TAU, CRQA_MIN_DIAG and
+// CRQA_MIN_VERT override the defaults without a rebuild.
+static CrqaParams server_params()
+{
+    CrqaParams p = CRQA_DEFAULT_PARAMS;
+    p.n = N_SAMPLES;
+    if (const char *v = getenv("CRQA_M")) p.m = atoi(v);
+    if (const char *v = getenv("CRQA_TAU")) p.tau = atoi(v);
+    if (const char *v = getenv("CRQA_MIN_DIAG")) p.min_diag = atoi(v);
+    if (const char *v = getenv("CRQA_MIN_VERT")) p.min_vert = atoi(v);
+    return p;
+}
+
+// Parameters of one window of a request frame.
+static CrqaParams window_params(const CrqaParams &defaults, const crqa_window &w)
+{
+    CrqaParams p = defaults;
+    p.n = (int)w.n;
+    if (w.m) p.m = w.m;
+    if (w.tau) p.tau = w.tau;
+    if (w.min_diag) p.min_diag = w.min_diag;
+    if (w.min_vert) p.min_vert = w.min_vert;
+    return p;
+}
+
+// Receive the client's eventfd and, if it shares its device buffer, the
+// memfd behind it (-1 otherwise). Returns -1 with errno EAGAIN while a
+// non-blocking socket has not sent them yet, EPROTO if it sent none or more
+// than fit (any fds beyond the first two are closed).
+static int recv_client_fds(int sock, int &efd, int &memfd)
 {
     struct msghdr msg = {};
-    char buf[CMSG_SPACE(sizeof(int))];
+    char buf[CMSG_SPACE(8 * sizeof(int))];      // room to see extra fds and close them
     char dummy;
     struct iovec iov = { &dummy, sizeof(dummy) };
 
@@ -194,168 +89,922 @@ static int recv_eventfd(int sock)
     msg.msg_control = buf;
     msg.msg_controllen = sizeof(buf);
 
-    if (recvmsg(sock, &msg, 0) < 0) {
-        perror("[SystemC] recvmsg");
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("[SystemC] recvmsg");
+        return -1;
+    }
+
+    // every fd received is ours to close unless handed out
+    int fds[2] = { -1, -1 };
+    size_t got = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < n; i++, got++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+            if (got < 2)
+                fds[got] = fd;
+            else
+                close(fd);
+        }
+    }
+    if (got == 0 || (msg.msg_flags & MSG_CTRUNC)) {
+        cerr << "[SystemC] " << (got ? "Too many fds received" : "No eventfd received") << endl;
+        for (int fd : fds)
+            if (fd >= 0) close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    if (got > 2)
+        cerr << "[SystemC] Closed " << got - 2 << " unexpected fds" << endl;
+
+    efd = fds[0];
+    memfd = fds[1];
+    cout << "[SystemC] Received eventfd = " << efd;
+    if (memfd >= 0)
+        cout << ", shared buffer memfd = " << memfd;
+    cout << endl;
+    return 0;
+}
+
+// Non-blocking listening socket at path, replacing a stale one; -1 on error.
+static int listen_unix(const char *path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        cerr << "[SystemC] socket() failed: " << strerror(errno) << endl;
         return -1;
     }
 
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
-        cerr << "[SystemC] No eventfd received" << endl;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    unlink(path);
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        cerr << "[SystemC] bind(" << path << ") failed: " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 16) < 0) {
+        cerr << "[SystemC] listen() failed: " << strerror(errno) << endl;
+        close(fd);
         return -1;
     }
+    return fd;
+}
 
-    int efd;
-    memcpy(&efd, CMSG_DATA(cmsg), sizeof(int));
-    cout << "[SystemC] Received eventfd = " << efd << endl;
-    return efd;
+// Compute workers: CRQA_WORKERS, default one per CPU in CRQA_WORKER_CPUS
+// (e.g. "2-5"), else one per CPU. Workers are pinned only if CRQA_WORKER_CPUS is set.
+static int server_workers(const std::vector<int> &cpus)
+{
+    int n = 0;
+    if (const char *v = getenv("CRQA_WORKERS")) n = atoi(v);
+    if (n <= 0) n = cpus.empty() ? (int)std::thread::hardware_concurrency() : (int)cpus.size();
+    return n > 0 ? n : 1;
 }
 
+// Request frames in flight across all workers; each slot holds one frame.
+#define CRQA_SLOTS 64
+
+// One QEMU connection. Kept alive by every request slot that refers to it,
+// so results of a client that already hung up never go to a reused fd.
+struct ClientConn {
+    int fd;
+    int eventfd;                    // -1 until the client has sent it
+    int id;
+    uint8_t *shm;                   // client's shared device buffer, or null
+    size_t shm_size;
+
+    // I/O thread
+    bool open;
+    bool starved;                   // waiting for a free slot, EPOLLIN off
+    bool want_out;                  // EPOLLOUT armed
+    crqa_frame_hdr rx_hdr;          // header being received
+    size_t hdr_off;
+    int rx_slot;                    // slot whose payload is being received, or -1
+    size_t rx_off;
+    uint64_t requests;              // frames received
+    uint64_t tx_queued;             // response bytes queued by the SystemC thread
+    uint64_t tx_sent;               // response bytes written so far
+    std::deque<uint64_t> tx_ends;   // end offset (in tx_sent terms) of each queued frame
+
+    // Results waiting to be written, filled by the SystemC thread
+    std::mutex tx_mtx;
+    std::vector<uint8_t> tx;
+    size_t tx_off;
+
+    ClientConn(int f, int n)
+        : fd(f), eventfd(-1), id(n), shm(nullptr), shm_size(0), open(true), starved(false), want_out(false),
+          hdr_off(0), rx_slot(-1), rx_off(0), requests(0), tx_queued(0), tx_sent(0), tx_off(0) {}
+    ~ClientConn()
+    {
+        close(fd);
+        if (eventfd >= 0) close(eventfd);
+        if (shm) munmap(shm, shm_size);
+    }
+};
+
+// Where one window's inputs and outputs live: in the slot's payload and
+// response for inline frames, in the client's shared buffer for CRQA_FRAME_SHM.
+struct WindowJob {
+    const crqa_window *win;
+    double *sig1, *sig2;
+    double *results;                        // 8 doubles
+    uint32_t *status;
+};
+
+// One request frame and its response, or a batch of virtqueue requests of
+// a vhost-user device (vdev set, no frame on the wire). payload and the
+// vectors only grow, so a warmed-up slot is reused without allocating.
+struct RequestSlot {
+    std::shared_ptr<ClientConn> conn;
+    std::shared_ptr<CrqaVhostDev> vdev;
+    std::vector<CrqaVirtqElem> elems;       // virtqueue requests, vdev only
+    crqa_frame_hdr hdr;
+    std::vector<uint8_t> payload;           // windows, then the signals (inline, or
+                                            // virtqueue signals split across descriptors)
+    std::vector<WindowJob> jobs;
+    std::vector<uint32_t> shm_status;       // per window, CRQA_FRAME_SHM only
+    crqa_frame_hdr out_hdr;
+    std::vector<crqa_window_result> out;    // inline only
+    std::atomic<uint32_t> remaining;        // windows still being computed
+
+    bool shared() const { return hdr.flags & CRQA_FRAME_SHM; }
+};
+
+// Set by signal_handler(), which does nothing else that is not
+// async-signal-safe: it records the signal and kicks the I/O thread through
+// this copy of its wake eventfd. That thread logs it and wakes the SystemC
+// thread, which stops the simulation.
+static volatile sig_atomic_t stop_signal = 0;
+static volatile sig_atomic_t signal_wake_fd = -1;
+
+// Completion path from the compute workers into the simulation: notify() is
+// safe from any thread and fires completed_event() in the next delta cycle.
+// While attached the kernel suspends instead of ending when it runs out of
+// events, so sc_start() keeps serving; detached, it ends once idle.
+class CompletionChannel : public sc_prim_channel {
+public:
+    explicit CompletionChannel(const char *name) : sc_prim_channel(name)
+    {
+        async_attach_suspending();
+    }
+
+    using sc_prim_channel::async_detach_suspending;
+    void notify() { async_request_update(); }
+    const sc_event &completed_event() const { return completed; }
+
+private:
+    sc_event completed;
+
+    void update() override { completed.notify(SC_ZERO_TIME); }
+};
 
 // SystemC module
 SC_MODULE(CRQAServer) {
-    SC_CTOR(CRQAServer) {
+    SC_HAS_PROCESS(CRQAServer);
+
+    // One server per crqa-pci-dev instance, each on sockets of its own.
+    CRQAServer(sc_module_name name, const char *socket_path, const char *vhost_socket_path)
+        : sc_module(name), socket_path(socket_path), vhost_socket_path(vhost_socket_path),
+          slots(CRQA_SLOTS), completions("completions"),
+          worker_cpus(crqa_parse_cpu_list(getenv("CRQA_WORKER_CPUS"))),
+          pool(server_threads()),
+          dispatcher(CRQA_SLOTS, CRQA_SLOTS * CRQA_PROTO_MAX_WINDOWS,
+                     server_workers(worker_cpus), worker_cpus,
+                     getenv("CRQA_HUGEPAGES") != nullptr, &pool,
+                     [this](uint32_t job, CrqaWorkspace &ws, uint32_t &slot) {
+                         return compute_window(job, ws, slot);
+                     },
+                     [this]() { completions.notify(); }) {
         SC_THREAD(server_thread);
     }
-    int eventfd = -1; 
+
+    ~CRQAServer() {
+        signal_wake_fd = -1;
+        stopping = true;
+        wake_io();
+        if (io.joinable()) io.join();
+        if (ep_fd >= 0) close(ep_fd);
+        if (wake_fd >= 0) close(wake_fd);
+        if (srv_fd >= 0) close(srv_fd);
+        if (vhost_srv_fd >= 0) close(vhost_srv_fd);
+        // only the sockets this server bound
+        if (srv_fd >= 0) unlink(socket_path.c_str());
+        if (vhost_srv_fd >= 0) unlink(vhost_socket_path.c_str());
+    }
+
+    std::string socket_path;
+    std::string vhost_socket_path;
+    CrqaParams params = server_params();
+    std::vector<RequestSlot> slots;
+    CompletionChannel completions;
+    std::vector<int> worker_cpus;
+    // Windows of CRQA_TILED_MIN_LEN points or more are split over the pool.
+    CrqaThreadPool pool;
+    CrqaDispatcher dispatcher;
+
+    int srv_fd = -1;
+    int vhost_srv_fd = -1;
+    int ep_fd = -1;
+    int wake_fd = -1;                       // kicks the I/O thread: results queued or slots freed
+    std::thread io;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> stop_requested{false};    // by a signal, for the SystemC thread
+
+    // I/O thread only
+    std::unordered_map<int, std::shared_ptr<ClientConn>> clients;
+    int connection_count = 0;
+    std::unordered_map<int, std::shared_ptr<CrqaVhostDev>> vhosts;      // by socket
+    std::unordered_map<int, std::shared_ptr<CrqaVhostDev>> vhost_kicks; // by kick eventfd
+    std::vector<std::shared_ptr<CrqaVhostDev>> vhost_starved;           // kicked, no free slot
+
+    // Connections with results to write, handed from the SystemC thread
+    std::mutex tx_ready_mtx;
+    std::vector<std::shared_ptr<ClientConn>> tx_ready;
+
+    // A job is one window of one frame: slot * CRQA_PROTO_MAX_WINDOWS + window.
+    // Worker side, no SystemC calls here.
+    bool compute_window(uint32_t job, CrqaWorkspace &ws, uint32_t &done_slot) {
+        uint32_t slot = job / CRQA_PROTO_MAX_WINDOWS;
+        uint32_t w = job % CRQA_PROTO_MAX_WINDOWS;
+        RequestSlot &r = slots[slot];
+        const WindowJob &j = r.jobs[w];
+        CrqaParams p = window_params(params, *j.win);
+
+        *j.status = crqa_params_valid(p) ? CRQA_STATUS_OK : CRQA_STATUS_BAD_PARAMS;
+        compute_crqa_complete(ws, p, j.win->R, j.sig1, j.sig2, j.results);
+
+        if (r.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return false;
+        done_slot = slot;
+        return true;
+    }
+
+    void wake_io() {
+        if (wake_fd < 0) return;
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
+    }
+
+    // Nothing to serve: without this the suspended kernel would wait
+    // forever for completions.
+    void stop_serving() {
+        completions.async_detach_suspending();
+        sc_stop();
+    }
 
     void server_thread() {
         cout << "[SystemC] Starting CRQA server..." << endl;
+        cout << "[SystemC] m = " << params.m << ", tau = " << params.tau
+             << (crqa_find_kernel(params) ? " (specialised kernel)" : " (generic kernel)") << endl;
+        cout << "[SystemC] " << dispatcher.workers() << " compute workers";
+        if (!worker_cpus.empty()) {
+            cout << " on CPUs";
+            for (int k = 0; k < dispatcher.workers(); k++)
+                cout << " " << dispatcher.worker_cpu(k);
+        }
+        cout << endl;
+        cout << "[SystemC] " << pool.size() << " compute threads for windows >= "
+             << CRQA_TILED_MIN_LEN << " points" << endl;
         
-        // Create socket
-        int srv_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        srv_fd = listen_unix(socket_path.c_str());
         if (srv_fd < 0) {
-            cerr << "[SystemC] socket() failed: " << strerror(errno) << endl;
+            stop_serving();
             return;
         }
-        
-        // Set socket options
-        int opt = 1;
-        setsockopt(srv_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        
-        // Remove old socket
-        unlink(SOCKET_PATH);
-        
-        // Bind
-        struct sockaddr_un addr = {0};
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path)-1);
-        
-        if (bind(srv_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-            cerr << "[SystemC] bind() failed: " << strerror(errno) << endl;
-            close(srv_fd);
+        vhost_srv_fd = listen_unix(vhost_socket_path.c_str());
+
+        ep_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (ep_fd < 0 || wake_fd < 0) {
+            cerr << "[SystemC] epoll/eventfd setup failed: " << strerror(errno) << endl;
+            stop_serving();
             return;
         }
+        epoll_watch(EPOLL_CTL_ADD, srv_fd, EPOLLIN);
+        epoll_watch(EPOLL_CTL_ADD, wake_fd, EPOLLIN);
+        signal_wake_fd = wake_fd;
+        if (vhost_srv_fd >= 0)
+            epoll_watch(EPOLL_CTL_ADD, vhost_srv_fd, EPOLLIN);
         
-        // Listen
-        if (listen(srv_fd, 5) < 0) {
-            cerr << "[SystemC] listen() failed: " << strerror(errno) << endl;
-            close(srv_fd);
+        cout << "[SystemC] Listening on " << socket_path << endl;
+        if (vhost_srv_fd >= 0)
+            cout << "[SystemC] vhost-user back-end on " << vhost_socket_path << endl;
+        cout << "[SystemC] Ready for QEMU connections (any number, kept open)" << endl;
+
+        // All socket I/O happens on its own thread; this process only orders
+        // finished results, so the kernel never blocks on QEMU.
+        io = std::thread(&CRQAServer::io_thread, this);
+        if (stop_signal)
+            wake_io();      // signalled before there was a wake_fd to kick
+
+        while (true) {
+            wait(completions.completed_event());
+            if (stop_requested) {
+                stop_serving();
+                return;
+            }
+            uint32_t slot;
+            bool queued = false;
+            while (dispatcher.done.try_pop(slot)) {
+                complete(slot);
+                queued = true;
+            }
+            if (queued)
+                wake_io();
+        }
+    }
+
+    // Frames go out as soon as all their windows are done; QEMU matches
+    // them by tag.
+    void complete(uint32_t slot) {
+        RequestSlot &r = slots[slot];
+        if (r.vdev) {
+            complete_virtio(slot);
             return;
         }
-        
-        cout << "[SystemC] Listening on " << SOCKET_PATH << endl;
-        cout << "[SystemC] Ready for QEMU connections (keeps connection open)" << endl;
-        
-        int connection_count = 0;
-        
-        // Main server loop
+        std::shared_ptr<ClientConn> conn = std::move(r.conn);
+
+        if (r.shared()) {
+            for (uint32_t st : r.shm_status)
+                if (st != CRQA_STATUS_OK && r.out_hdr.status == CRQA_STATUS_OK)
+                    r.out_hdr.status = st;
+        }
+
+        cout << "[SystemC] Frame tag " << r.out_hdr.tag << " done (connection #" << conn->id
+             << ", " << r.out_hdr.count << (r.shared() ? " shared" : "") << " windows)";
+        if (!r.jobs.empty() && r.out_hdr.count) {
+            const double *res = r.jobs[0].results;
+            cout << ": epsilon=" << res[0] << " RR=" << res[1]
+                 << " DET=" << res[2] << " LAM=" << res[7];
+        }
+        cout << endl;
+        {
+            std::lock_guard<std::mutex> lk(conn->tx_mtx);
+            const uint8_t *h = (const uint8_t *)&r.out_hdr;
+            const uint8_t *p = r.shared() ? (const uint8_t *)r.shm_status.data()
+                                          : (const uint8_t *)r.out.data();
+            conn->tx.insert(conn->tx.end(), h, h + sizeof(r.out_hdr));
+            conn->tx.insert(conn->tx.end(), p, p + r.out_hdr.payload_len);
+            conn->tx_queued += sizeof(r.out_hdr) + r.out_hdr.payload_len;
+            conn->tx_ends.push_back(conn->tx_queued);
+        }
+        {
+            std::lock_guard<std::mutex> lk(tx_ready_mtx);
+            tx_ready.push_back(std::move(conn));
+        }
+        dispatcher.free_slots.push(slot);
+    }
+
+    // Results go straight into the guest's buffers and onto the used ring;
+    // one interrupt for the whole batch.
+    void complete_virtio(uint32_t slot) {
+        RequestSlot &r = slots[slot];
+        std::shared_ptr<CrqaVhostDev> dev = std::move(r.vdev);
+        uint32_t count = r.out_hdr.count;
+
+        for (uint32_t w = 0; w < count; w++) {
+            CrqaVirtqElem &e = r.elems[w];
+            e.write(0, &r.out[w], sizeof(r.out[w]));
+            dev->push(e, sizeof(r.out[w]));
+            e.mem.reset();
+        }
+        dev->notify();
+
+        cout << "[SystemC] vhost device #" << dev->id << ": " << count << " requests done";
+        if (count) {
+            const double *res = &r.out[0].eps;
+            cout << ": epsilon=" << res[0] << " RR=" << res[1]
+                 << " DET=" << res[2] << " LAM=" << res[7];
+        }
+        cout << endl;
+        dispatcher.free_slots.push(slot);
+    }
+
+    void epoll_watch(int op, int fd, uint32_t events) {
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(ep_fd, op, fd, &ev);
+    }
+
+    void update_events(ClientConn &c) {
+        epoll_watch(EPOLL_CTL_MOD, c.fd, (c.starved ? 0u : (uint32_t)EPOLLIN) |
+                                         (c.want_out ? (uint32_t)EPOLLOUT : 0u));
+    }
+
+    // Event loop over the listening socket, every client and wake_fd.
+    void io_thread() {
+        struct epoll_event events[64];
+
+        while (!stopping) {
+            int n = epoll_wait(ep_fd, events, 64, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                cerr << "[SystemC] epoll_wait() failed: " << strerror(errno) << endl;
+                break;
+            }
+            for (int k = 0; k < n && !stopping; k++) {
+                int fd = events[k].data.fd;
+                if (fd == srv_fd) {
+                    accept_clients();
+                } else if (fd == wake_fd) {
+                    uint64_t v;
+                    read(wake_fd, &v, sizeof(v));
+                    handle_wake();
+                } else if (fd == vhost_srv_fd) {
+                    accept_vhost();
+                } else if (vhosts.count(fd)) {
+                    std::shared_ptr<CrqaVhostDev> dev = vhosts[fd];
+                    if (!dev->handle_input())
+                        drop_vhost(dev);
+                    else
+                        watch_kick(dev);
+                } else if (vhost_kicks.count(fd)) {
+                    std::shared_ptr<CrqaVhostDev> dev = vhost_kicks[fd];
+                    dev->ack_kick();
+                    serve_vhost(dev);
+                } else {
+                    auto it = clients.find(fd);
+                    if (it == clients.end()) continue;
+                    std::shared_ptr<ClientConn> c = it->second;
+                    if (events[k].events & EPOLLOUT)
+                        flush(*c);
+                    if (c->open && (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                        read_client(*c);
+                }
+            }
+        }
+    }
+
+    void accept_clients() {
         while (true) {
-            cout << "\n[SystemC] Waiting for connection..." << endl;
-            
-            int cli_fd = accept(srv_fd, NULL, NULL);
+            int cli_fd = accept4(srv_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
             if (cli_fd < 0) {
                 if (errno == EINTR) continue;
-                cerr << "[SystemC] accept() failed: " << strerror(errno) << endl;
-                wait(1, SC_SEC);
-                continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    cerr << "[SystemC] accept() failed: " << strerror(errno) << endl;
+                return;
             }
-            
             connection_count++;
-            cout << "[SystemC] QEMU connected! (fd=" << cli_fd 
+            cout << "[SystemC] QEMU connected! (fd=" << cli_fd
                  << ", connection #" << connection_count << ")" << endl;
-            cout << "[SystemC] Connection will stay open for multiple requests" << endl;
-            
-            /* receive eventfd ONCE */
-            eventfd = recv_eventfd(cli_fd);
-            if (eventfd < 0) {
-                cerr << "[SystemC] Failed to receive eventfd" << endl;
+            clients[cli_fd] = std::make_shared<ClientConn>(cli_fd, connection_count);
+            epoll_watch(EPOLL_CTL_ADD, cli_fd, EPOLLIN);
+        }
+    }
+
+    // vhost-user front-ends, non-blocking like the clients: a message is
+    // handled once all of it is in.
+    void accept_vhost() {
+        while (true) {
+            int fd = accept4(vhost_srv_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    cerr << "[SystemC] vhost accept() failed: " << strerror(errno) << endl;
                 return;
             }
+            connection_count++;
+            cout << "[SystemC] vhost-user front-end connected (fd=" << fd
+                 << ", device #" << connection_count << ")" << endl;
+            vhosts[fd] = std::make_shared<CrqaVhostDev>(fd, connection_count);
+            epoll_watch(EPOLL_CTL_ADD, fd, EPOLLIN);
+        }
+    }
+
+    // Follow the kick eventfd of a device after a message may have replaced it.
+    void watch_kick(const std::shared_ptr<CrqaVhostDev> &dev) {
+        for (auto it = vhost_kicks.begin(); it != vhost_kicks.end(); ++it) {
+            if (it->second != dev) continue;
+            if (it->first == dev->kick_fd()) return;
+            epoll_ctl(ep_fd, EPOLL_CTL_DEL, it->first, NULL);   // fd may be closed already
+            vhost_kicks.erase(it);
+            break;
+        }
+        if (dev->kick_fd() >= 0) {
+            vhost_kicks[dev->kick_fd()] = dev;
+            epoll_watch(EPOLL_CTL_ADD, dev->kick_fd(), EPOLLIN);
+            serve_vhost(dev);       // requests queued before the kick fd came
+        }
+    }
 
-            int request_count = 0;
-            bool connection_active = true;
-            
-            // Handle this connection
-            while (connection_active) {
-                Input msg;
-                
-                // BLOCKING READ - waits forever for QEMU
-                ssize_t bytes = read(cli_fd, &msg, sizeof(msg));
-                
-                if (bytes <= 0) {
-                    if (bytes == 0) {
-                        cout << "[SystemC] QEMU closed the connection" << endl;
-                    } else {
-                        cerr << "[SystemC] read() error: " << strerror(errno) << endl;
-                    }
-                    connection_active = false;
+    void drop_vhost(std::shared_ptr<CrqaVhostDev> dev) {
+        cout << "[SystemC] vhost device #" << dev->id << " disconnected" << endl;
+        epoll_ctl(ep_fd, EPOLL_CTL_DEL, dev->fd(), NULL);
+        if (dev->kick_fd() >= 0) {
+            epoll_ctl(ep_fd, EPOLL_CTL_DEL, dev->kick_fd(), NULL);
+            vhost_kicks.erase(dev->kick_fd());
+        }
+        vhosts.erase(dev->fd());
+        vhost_starved.erase(std::remove(vhost_starved.begin(), vhost_starved.end(), dev),
+                            vhost_starved.end());
+        dev->shutdown();            // fds close once no request refers to it
+    }
+
+    // Check one virtqueue request and read its window parameters. A valid
+    // request carries crqa_window, sig1 and sig2 and has room for a result.
+    static bool virtio_request_ok(const CrqaVirtqElem &e, crqa_window &w) {
+        if (e.bad || e.in_bytes() < sizeof(crqa_window_result) || !e.read(0, &w, sizeof(w)))
+            return false;
+        if (w.n == 0 || w.n > CRQA_PROTO_MAX_SAMPLES)
+            return false;
+        return e.out_bytes() == sizeof(w) + 2ull * w.n * sizeof(double);
+    }
+
+    // Pull everything the guest has queued into slots, up to
+    // CRQA_PROTO_MAX_WINDOWS requests per slot. Signals lying in one piece of
+    // guest memory are computed in place, others are gathered into the slot.
+    void serve_vhost(const std::shared_ptr<CrqaVhostDev> &dev) {
+        while (true) {
+            uint32_t slot;
+            if (!dispatcher.free_slots.try_pop(slot)) {
+                if (std::find(vhost_starved.begin(), vhost_starved.end(), dev) == vhost_starved.end())
+                    vhost_starved.push_back(dev);
+                return;
+            }
+            RequestSlot &r = slots[slot];
+            if (r.elems.size() < CRQA_PROTO_MAX_WINDOWS)
+                r.elems.resize(CRQA_PROTO_MAX_WINDOWS);
+
+            uint32_t count = 0;
+            size_t gather = 0;
+            bool rejected = false;
+            while (count < CRQA_PROTO_MAX_WINDOWS) {
+                CrqaVirtqElem &e = r.elems[count];
+                if (!dev->pop(e))
                     break;
+                crqa_window w;
+                if (!virtio_request_ok(e, w)) {
+                    cerr << "[SystemC] vhost device #" << dev->id << ": malformed request "
+                         << e.head << endl;
+                    crqa_window_result bad = {};
+                    bad.status = CRQA_STATUS_BAD_REQ;
+                    uint32_t len = e.write(0, &bad, sizeof(bad)) ? sizeof(bad) : 0;
+                    dev->push(e, len);
+                    e.mem.reset();
+                    rejected = true;
+                    continue;
                 }
-                
-                if (bytes != sizeof(msg)) {
-                    cerr << "[SystemC] Incomplete message: " << bytes 
-                         << " bytes, expected " << sizeof(msg) << endl;
-                    connection_active = false;
-                    break;
+                size_t sig_bytes = 2 * (size_t)w.n * sizeof(double);
+                if (!e.out_span(sizeof(w), sig_bytes))
+                    gather += sig_bytes;
+                count++;
+            }
+            if (rejected)
+                dev->notify();
+            if (count == 0) {
+                dispatcher.free_slots.push(slot);
+                return;
+            }
+
+            r.payload.resize((size_t)count * sizeof(crqa_window) + gather);
+            r.out.resize(count);
+            r.jobs.resize(count);
+            crqa_window *win = (crqa_window *)r.payload.data();
+            uint8_t *spill = r.payload.data() + (size_t)count * sizeof(crqa_window);
+            for (uint32_t w = 0; w < count; w++) {
+                CrqaVirtqElem &e = r.elems[w];
+                e.read(0, &win[w], sizeof(win[w]));
+                size_t sig_bytes = 2 * (size_t)win[w].n * sizeof(double);
+                double *sig = (double *)e.out_span(sizeof(win[w]), sig_bytes);
+                if (!sig) {
+                    e.read(sizeof(win[w]), spill, sig_bytes);
+                    sig = (double *)spill;
+                    spill += sig_bytes;
                 }
-                
-                if (msg.ready) {
-                    request_count++;
-                    cout << "\n[SystemC] === Processing request #" << request_count << " ===" << endl;
-                    cout << "[SystemC] R = " << msg.R << ", opcode = " << msg.opcode << endl;
-                    cout << "[SystemC] s1[0] = " << msg.sig1[0] << ", s2[0] = " << msg.sig2[0] << endl;
-                    
-                    // Compute CRQA
-                    Output results;
-                    compute_crqa_complete(msg.R, msg.sig1, msg.sig2, (double*)&results);
-                    
-                    // Send results back
-                    ssize_t written = write(cli_fd, &results, sizeof(results));
-                    if (written != sizeof(results)) {
-                        cerr << "[SystemC] write() error: " << strerror(errno) << endl;
-                        connection_active = false;
-                        break;
-                    }
-                    cout << "[SystemC] Results sent to QEMU" << endl;
-                    cout << "[SystemC] epsilon=" << results.eps << " RR=" << results.rr 
-                         << " DET=" << results.det << " LAM=" << results.lam << endl;
-                    cout << "[SystemC] Waiting for next request..." << endl;
-		    /*  SIGNAL QEMU */
-		    cout << "now writing on QEMU's shared eventfd" << endl;
-                    uint64_t one = 1;
-                    write(eventfd, &one, sizeof(one)); 
+                WindowJob &j = r.jobs[w];
+                j.win = &win[w];
+                j.sig1 = sig;
+                j.sig2 = sig + win[w].n;
+                j.results = &r.out[w].eps;
+                j.status = &r.out[w].status;
+                r.out[w].reserved = 0;
+            }
+            r.hdr.flags = 0;
+            crqa_frame_hdr_init(&r.out_hdr, 0, count, 0);
+            r.vdev = dev;
+            r.remaining.store(count, std::memory_order_relaxed);
+            for (uint32_t w = 0; w < count; w++)
+                dispatcher.jobs.push(slot * CRQA_PROTO_MAX_WINDOWS + w);
+            if (count < CRQA_PROTO_MAX_WINDOWS)
+                return;
+        }
+    }
 
+    void drop_client(ClientConn &c) {
+        c.open = false;
+        epoll_ctl(ep_fd, EPOLL_CTL_DEL, c.fd, NULL);
+        if (c.rx_slot >= 0) {
+            // a slot free again: the starved clients get it on the next wake,
+            // not from under whoever is dropping this one
+            dispatcher.free_slots.push(c.rx_slot);
+            c.rx_slot = -1;
+            wake_io();
+        }
+        cout << "[SystemC] Connection #" << c.id << " closed" << endl;
+        clients.erase(c.fd);        // fd is closed once no request refers to it
+    }
 
+    // Read as many whole requests as are available, straight into slots.
+    void read_client(ClientConn &c) {
+        if (c.eventfd < 0) {
+            /* receive eventfd ONCE, before any request */
+            int efd, memfd;
+            if (recv_client_fds(c.fd, efd, memfd) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                cerr << "[SystemC] Failed to receive eventfd" << endl;
+                drop_client(c);
+                return;
+            }
+            c.eventfd = efd;
+            if (memfd >= 0) {
+                map_shared_buffer(c, memfd);
+                close(memfd);
+            }
+            return;
+        }
+
+        while (true) {
+            if (c.rx_slot < 0) {
+                if (c.hdr_off < sizeof(c.rx_hdr)) {
+                    ssize_t bytes = recv(c.fd, (uint8_t *)&c.rx_hdr + c.hdr_off,
+                                         sizeof(c.rx_hdr) - c.hdr_off, 0);
+                    if (!rx_ok(c, bytes))
+                        return;
+                    if (bytes > 0) c.hdr_off += bytes;
+                    continue;
+                }
+                if (!crqa_frame_hdr_valid(&c.rx_hdr)) {
+                    cerr << "[SystemC] Bad frame header on connection #" << c.id << " (magic 0x"
+                         << hex << c.rx_hdr.magic << dec << ", version " << c.rx_hdr.version
+                         << ", " << c.rx_hdr.count << " windows, " << c.rx_hdr.payload_len
+                         << " bytes), expected protocol version " << CRQA_PROTO_VERSION << endl;
+                    drop_client(c);
+                    return;
                 }
+
+                uint32_t slot;
+                if (!dispatcher.free_slots.try_pop(slot)) {
+                    // all slots busy: stop reading until one is freed
+                    c.starved = true;
+                    update_events(c);
+                    return;
+                }
+                RequestSlot &r = slots[slot];
+                r.hdr = c.rx_hdr;
+                r.payload.resize(r.hdr.payload_len);
+                c.rx_slot = (int)slot;
+                c.rx_off = 0;
+                c.hdr_off = 0;
+            }
+
+            // Payload, plus whatever of the next header is already there.
+            RequestSlot &r = slots[c.rx_slot];
+            size_t want = r.payload.size() - c.rx_off;
+            if (want) {
+                struct iovec iov[2] = {
+                    { r.payload.data() + c.rx_off, want },
+                    { &c.rx_hdr, sizeof(c.rx_hdr) },
+                };
+                ssize_t bytes = readv(c.fd, iov, 2);
+                if (!rx_ok(c, bytes))
+                    return;
+                if (bytes <= 0)
+                    continue;
+                size_t body = (size_t)bytes < want ? (size_t)bytes : want;
+                c.rx_off += body;
+                c.hdr_off = bytes - body;
+                if (c.rx_off < r.payload.size())
+                    continue;
             }
-            
-            close(cli_fd);
-            cout << "[SystemC] Connection #" << connection_count << " closed" << endl;
+
+            uint32_t slot = (uint32_t)c.rx_slot;
+            c.rx_slot = -1;
+            start_frame(c, slot);
         }
-        
-        // Cleanup (never reached in practice)
-        close(srv_fd);
-        unlink(SOCKET_PATH);
     }
-};
 
-// Global for signal handler
-CRQAServer* g_server = nullptr;
+    // Handle a recv()/readv() result. False if the caller must stop reading
+    // (would block, or the client is gone); true with bytes <= 0 means retry.
+    bool rx_ok(ClientConn &c, ssize_t bytes) {
+        if (bytes > 0)
+            return true;
+        if (bytes < 0 && errno == EINTR)
+            return true;
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+        if (bytes == 0) {
+            if (c.hdr_off || c.rx_slot >= 0)
+                cerr << "[SystemC] Incomplete frame: " << (c.rx_slot >= 0 ? c.rx_off : c.hdr_off)
+                     << " bytes received" << endl;
+            cout << "[SystemC] QEMU closed the connection" << endl;
+        } else {
+            cerr << "[SystemC] read() error: " << strerror(errno) << endl;
+        }
+        drop_client(c);
+        return false;
+    }
+
+    // Map the device buffer a client shares; without it the client can
+    // still send inline frames.
+    void map_shared_buffer(ClientConn &c, int memfd) {
+        struct stat st;
+        void *p = MAP_FAILED;
+        if (fstat(memfd, &st) == 0 && st.st_size > 0)
+            p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (p == MAP_FAILED) {
+            cerr << "[SystemC] Cannot map shared buffer of connection #" << c.id << ": "
+                 << strerror(errno) << endl;
+            return;
+        }
+        c.shm = (uint8_t *)p;
+        c.shm_size = st.st_size;
+        cout << "[SystemC] Connection #" << c.id << " shares a " << c.shm_size
+             << " byte buffer (zero-copy)" << endl;
+    }
+
+    // Point every window of an inline frame into the payload and response.
+    bool bind_inline(RequestSlot &r) {
+        uint32_t count = r.hdr.count;
+        if ((uint64_t)count * sizeof(crqa_window) > r.payload.size())
+            return false;
+        const crqa_window *win = (const crqa_window *)r.payload.data();
+        for (uint32_t w = 0; w < count; w++)
+            if (win[w].n == 0 || win[w].n > CRQA_PROTO_MAX_SAMPLES)
+                return false;
+        if (crqa_request_payload_len(win, count) != r.payload.size())
+            return false;
+
+        r.out.resize(count);
+        r.jobs.resize(count);
+        size_t off = (size_t)count * sizeof(crqa_window);
+        for (uint32_t w = 0; w < count; w++) {
+            WindowJob &j = r.jobs[w];
+            j.win = &win[w];
+            j.sig1 = (double *)(r.payload.data() + off);
+            j.sig2 = j.sig1 + win[w].n;
+            j.results = &r.out[w].eps;
+            j.status = &r.out[w].status;
+            r.out[w].reserved = 0;
+            off += 2 * (size_t)win[w].n * sizeof(double);
+        }
+        crqa_frame_hdr_init(&r.out_hdr, r.hdr.tag, count, crqa_response_payload_len(count));
+        return true;
+    }
+
+    // Point every window of a zero-copy frame into the client's shared buffer.
+    bool bind_shared(ClientConn &c, RequestSlot &r) {
+        uint32_t count = r.hdr.count;
+        if (!c.shm || r.payload.size() != crqa_shm_payload_len(count))
+            return false;
+        const crqa_shm_window *win = (const crqa_shm_window *)r.payload.data();
+        for (uint32_t w = 0; w < count; w++) {
+            uint64_t sig_bytes = (uint64_t)win[w].w.n * sizeof(double);
+            if (win[w].w.n == 0 || win[w].w.n > CRQA_PROTO_MAX_SAMPLES ||
+                !crqa_shm_range_ok(win[w].sig1_off, sig_bytes, c.shm_size) ||
+                !crqa_shm_range_ok(win[w].sig2_off, sig_bytes, c.shm_size) ||
+                !crqa_shm_range_ok(win[w].result_off, 8 * sizeof(double), c.shm_size))
+                return false;
+        }
+
+        r.shm_status.resize(count);
+        r.jobs.resize(count);
+        for (uint32_t w = 0; w < count; w++) {
+            WindowJob &j = r.jobs[w];
+            j.win = &win[w].w;
+            j.sig1 = (double *)(c.shm + win[w].sig1_off);
+            j.sig2 = (double *)(c.shm + win[w].sig2_off);
+            j.results = (double *)(c.shm + win[w].result_off);
+            j.status = &r.shm_status[w];
+        }
+        crqa_frame_hdr_init(&r.out_hdr, r.hdr.tag, count, crqa_shm_response_payload_len(count));
+        return true;
+    }
+
+    // A whole frame is in the slot: check the payload against the header
+    // and queue one job per window. Frames that cannot be computed are
+    // answered straight away.
+    void start_frame(ClientConn &c, uint32_t slot) {
+        RequestSlot &r = slots[slot];
+        uint32_t count = r.hdr.count;
+        r.jobs.clear();
+        r.shm_status.clear();
+        bool ok = r.shared() ? bind_shared(c, r) : bind_inline(r);
+
+        r.conn = clients[c.fd];
+        c.requests++;
+        if (!ok || count == 0) {
+            if (!ok)
+                cerr << "[SystemC] Frame tag " << r.hdr.tag << " (connection #" << c.id
+                     << "): payload does not match its " << count
+                     << (r.shared() ? " shared" : "") << " windows" << endl;
+            r.jobs.clear();
+            crqa_frame_hdr_init(&r.out_hdr, r.hdr.tag, 0, 0);
+            r.out_hdr.status = ok ? CRQA_STATUS_OK : CRQA_STATUS_BAD_REQ;
+            dispatcher.done.push(slot);
+            completions.notify();
+            return;
+        }
+        r.remaining.store(count, std::memory_order_relaxed);
+
+        cout << "[SystemC] Queued frame tag " << r.hdr.tag << " (connection #" << c.id
+             << ", #" << c.requests << "): " << count << (r.shared() ? " shared" : "")
+             << " windows, R = " << r.jobs[0].win->R << ", opcode = " << r.jobs[0].win->opcode << endl;
+        for (uint32_t w = 0; w < count; w++)
+            dispatcher.jobs.push(slot * CRQA_PROTO_MAX_WINDOWS + w);
+    }
+
+    // Results were queued and/or slots freed.
+    void handle_wake() {
+        if (stop_signal && !stop_requested.exchange(true)) {
+            cout << "\n[SystemC] Received signal " << stop_signal << ", shutting down..." << endl;
+            // the kernel may be suspended waiting for completions: wake it to stop
+            completions.notify();
+        }
+
+        std::vector<std::shared_ptr<ClientConn>> ready;
+        {
+            std::lock_guard<std::mutex> lk(tx_ready_mtx);
+            ready.swap(tx_ready);
+        }
+        for (std::shared_ptr<ClientConn> &c : ready)
+            if (c->open) flush(*c);
+
+        std::vector<std::shared_ptr<ClientConn>> starved;
+        for (auto &kv : clients)
+            if (kv.second->starved) starved.push_back(kv.second);
+        for (std::shared_ptr<ClientConn> &c : starved) {
+            c->starved = false;
+            update_events(*c);
+            read_client(*c);
+        }
+
+        std::vector<std::shared_ptr<CrqaVhostDev>> kicked;
+        kicked.swap(vhost_starved);
+        for (std::shared_ptr<CrqaVhostDev> &dev : kicked)
+            serve_vhost(dev);
+    }
 
+    // Write queued responses without blocking; the rest waits for EPOLLOUT.
+    // QEMU's eventfd is signalled once per complete response frame written.
+    void flush(ClientConn &c) {
+        std::unique_lock<std::mutex> lk(c.tx_mtx);
+        while (c.tx_off < c.tx.size()) {
+            ssize_t n = send(c.fd, c.tx.data() + c.tx_off, c.tx.size() - c.tx_off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                lk.unlock();
+                cerr << "[SystemC] write() error on connection #" << c.id << ": " << strerror(errno) << endl;
+                drop_client(c);
+                return;
+            }
+            c.tx_off += n;
+            c.tx_sent += n;
+            uint64_t frames = 0;
+            while (!c.tx_ends.empty() && c.tx_ends.front() <= c.tx_sent) {
+                c.tx_ends.pop_front();
+                frames++;
+            }
+            /*  SIGNAL QEMU */
+            if (frames)
+                write(c.eventfd, &frames, sizeof(frames));
+        }
+        bool pending = c.tx_off < c.tx.size();
+        if (!pending) {
+            c.tx.clear();
+            c.tx_off = 0;
+        }
+        lk.unlock();
+
+        if (pending != c.want_out) {
+            c.want_out = pending;
+            update_events(c);
+        }
+    }
+};
+
+// Async-signal-safe only: see stop_signal.
 void signal_handler(int sig) {
-    cout << "\n[SystemC] Received signal " << sig << ", shutting down..." << endl;
-    sc_stop();
+    int saved_errno = errno;
+    int fd = signal_wake_fd;
+
+    stop_signal = sig;
+    if (fd >= 0) {
+        uint64_t one = 1;
+        ssize_t r = write(fd, &one, sizeof(one));
+        (void)r;
+    }
+    errno = saved_errno;
 }
 
 
@@ -365,14 +1014,19 @@ int sc_main(int argc, char* argv[]) {
     cout << "\n==========================================" << endl;
     cout << "    SystemC CRQA Server - PERSISTENT CONNECTION" << endl;
     cout << "==========================================\n" << endl;
+    cout << "[SystemC] Distance kernel: " << crqa_distance_kernels().name << endl;
     
     // Setup signal handlers
     //signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
+    // Sockets: [socket [vhost-socket]], e.g. a second server for a second
+    // crqa-pci-dev,socket=/tmp/crqa_socket1
+    const char *socket_path = argc > 1 ? argv[1] : SOCKET_PATH;
+    const char *vhost_socket_path = argc > 2 ? argv[2] : VHOST_SOCKET_PATH;
+
     // Create server
-    CRQAServer server("server");
-    g_server = &server;
+    CRQAServer server("server", socket_path, vhost_socket_path);
     
     cout << "[SystemC] Starting simulation (press Ctrl+C to exit)..." << endl;
     
@@ -380,7 +1034,6 @@ int sc_main(int argc, char* argv[]) {
     sc_start();
     
     cout << "\n[SystemC] Simulation ended" << endl;
-    g_server = nullptr;
     
     return 0;
 }